@@ -0,0 +1,235 @@
+#include "broadcastscheduler.h"
+
+#include <iostream>
+#include <cstring>
+
+#define BROADCAST_DONE_TIMEOUT_MS   1000    // Longest the thread waits for a GAP_AdvertDataUpdateDone before counting it lost.
+
+static double elapsedMicroseconds(const timespec& from, const timespec& to)
+{
+    return (to.tv_sec - from.tv_sec) * 1000000.0 + (to.tv_nsec - from.tv_nsec) / 1000.0;
+}
+
+void* __broadcastThreadEntry(void* castedScheduler)
+{
+    static_cast<BroadcastScheduler*>(castedScheduler)->threadMethod();
+    return NULL;
+}
+
+BroadcastScheduler::BroadcastScheduler(CC2540Communicator* communicator, unsigned int pipelineDepth) :
+    _communicator       (communicator),
+    _pipeline_depth     (pipelineDepth > 0 ? pipelineDepth : 1),
+    _ad_type            (0x01),
+    _back               (0),
+    _back_fresh         (false),
+    _running            (false),
+    _latency_total_us   (0)
+{
+    _mutex  = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+    _cond   = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+
+    memset(_lengths, 0, sizeof(_lengths));
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+BroadcastScheduler::~BroadcastScheduler()
+{
+    stop();
+}
+
+bool BroadcastScheduler::start(unsigned char eventType, unsigned char channelMap, unsigned char adType)
+{
+    pthread_mutex_lock(&_mutex);
+    if(_running)
+    {
+        pthread_mutex_unlock(&_mutex);
+        return false;
+    }
+
+    int retval;
+    try
+    {
+        retval = _communicator->txMakeDiscoverable(eventType, channelMap, 0x00);
+    }
+    catch(std::string error)
+    {
+        pthread_mutex_unlock(&_mutex);
+        throw;
+    }
+    if(retval != Tx_Success)
+    {
+        pthread_mutex_unlock(&_mutex);
+        return false;
+    }
+
+    memset(&_stats, 0, sizeof(_stats));
+    _latency_total_us   = 0;
+    _ad_type            = adType;
+    _inflight.clear();
+    clock_gettime(CLOCK_MONOTONIC, &_started);
+
+    _running = true;
+    pthread_create(&_thread, NULL, __broadcastThreadEntry, this);
+    pthread_mutex_unlock(&_mutex);
+    return true;
+}
+
+bool BroadcastScheduler::stop()
+{
+    pthread_mutex_lock(&_mutex);
+    if(!_running)
+    {
+        pthread_mutex_unlock(&_mutex);
+        return false;
+    }
+    _running = false;
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+
+    pthread_join(_thread, NULL);
+
+    // Also run by the destructor, which must not throw.
+    try
+    {
+        return _communicator->txEndDiscoverable() == Tx_Success;
+    }
+    catch(std::string error)
+    {
+        return false;
+    }
+}
+
+void BroadcastScheduler::stagePayload(const unsigned char* data, unsigned char length)
+{
+    if(length > sizeof(_buffers[0]))
+        length = sizeof(_buffers[0]);
+
+    pthread_mutex_lock(&_mutex);
+    memcpy(_buffers[_back], data, length);
+    _lengths[_back] = length;
+    _back_fresh     = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+BroadcastStats BroadcastScheduler::getStats()
+{
+    BroadcastStats retval;
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&_mutex);
+    retval = _stats;
+    double elapsed = elapsedMicroseconds(_started, now);
+    retval.updates_per_second   = (elapsed > 0) ? retval.updates_done * 1000000.0 / elapsed : 0;
+    retval.latency_avg_us       = (retval.updates_done > 0) ? _latency_total_us / retval.updates_done : 0;
+    pthread_mutex_unlock(&_mutex);
+
+    return retval;
+}
+
+void BroadcastScheduler::recordDone(int result)
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&_mutex);
+    if(!_inflight.empty())
+    {
+        double latency = elapsedMicroseconds(_inflight.front(), now);
+        _inflight.pop_front();
+
+        if(result != Tx_Success)
+        {
+            _stats.updates_failed++;
+        }
+        else
+        {
+            if(_stats.updates_done == 0 || latency < _stats.latency_min_us)
+                _stats.latency_min_us = latency;
+            if(latency > _stats.latency_max_us)
+                _stats.latency_max_us = latency;
+            _latency_total_us += latency;
+            _stats.updates_done++;
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+/**
+ * Main loop for the update thread. Sends whatever is staged while there's room in the pipeline, and otherwise waits for the
+ * oldest update to be done. When there is nothing staged and nothing in flight, it sleeps until stagePayload() is called.
+ */
+void BroadcastScheduler::threadMethod()
+{
+    for(;;)
+    {
+        pthread_mutex_lock(&_mutex);
+        while(_running && !_back_fresh && _inflight.empty())
+            pthread_cond_wait(&_cond, &_mutex);
+
+        if(!_running && _inflight.empty())
+        {
+            pthread_mutex_unlock(&_mutex);
+            break;
+        }
+
+        // Swaps buffers: the staged one gets sent, and the application can fill the other one meanwhile.
+        int  front      = -1;
+        if(_running && _back_fresh && _inflight.size() < _pipeline_depth)
+        {
+            front       = _back;
+            _back       = 1 - _back;
+            _back_fresh = false;
+        }
+        pthread_mutex_unlock(&_mutex);
+
+        if(front >= 0)
+        {
+            timespec sent;
+            clock_gettime(CLOCK_MONOTONIC, &sent);
+
+            bool queued;
+            try
+            {
+                queued = _communicator->txQueueAdvertisingData(_ad_type, _buffers[front], _lengths[front]);
+            }
+            catch(std::string error)
+            {
+                /// Nobody would catch it in this thread. The update counts as failed.
+                pthread_mutex_lock(&_mutex);
+                _stats.updates_failed++;
+                pthread_mutex_unlock(&_mutex);
+                continue;
+            }
+            if(!queued)
+                continue;
+
+            pthread_mutex_lock(&_mutex);
+            _inflight.push_back(sent);
+            _stats.updates_sent++;
+            bool roomleft = _back_fresh && _inflight.size() < _pipeline_depth;
+            pthread_mutex_unlock(&_mutex);
+
+            // Fills the pipeline before waiting for any answer.
+            if(roomleft)
+                continue;
+        }
+
+        // Blocks until the oldest update in flight is done, or is taken as lost, so stop() always gets through.
+        int result;
+        try
+        {
+            result = _communicator->rxPacket(NULL, BROADCAST_DONE_TIMEOUT_MS);
+        }
+        catch(std::string error)
+        {
+            result = Tx_TxUnsuccessful;
+        }
+        recordDone(result);
+    }
+
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Broadcast scheduler stopped after " << _stats.updates_done << " updates." << std::endl;
+    #endif
+}
@@ -0,0 +1,78 @@
+#ifndef BROADCASTSCHEDULER_H
+#define BROADCASTSCHEDULER_H
+
+#include "cc2540communicator.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <deque>
+
+/**
+ * Achieved performance of a BroadcastScheduler. Latency is measured from sending an update to its GAP_AdvertDataUpdateDone.
+ */
+struct BroadcastStats
+{
+    unsigned long   updates_sent;
+    unsigned long   updates_done;
+    unsigned long   updates_failed;
+    double          updates_per_second;
+    double          latency_avg_us, latency_min_us, latency_max_us;
+};
+
+/**
+ * Broadcaster mode: keeps the dongle advertising and rotates its advertising data as fast as the controller takes it.
+ * The application stages the next payload whenever it wants (stagePayload()), into a back buffer that is swapped with the
+ * one being sent, and up to pipelineDepth updates are kept in flight, so the time between updates doesn't depend on a
+ * host round-trip. The dongle must have been initialized with the Role_Broadcaster or Role_Peripheral role.
+ */
+class BroadcastScheduler
+{
+private:
+    CC2540Communicator*     _communicator;
+    unsigned int            _pipeline_depth;
+    unsigned char           _ad_type;
+
+    unsigned char           _buffers[2][31];
+    unsigned char           _lengths[2];
+    int                     _back;
+    bool                    _back_fresh;
+
+    bool                    _running;
+    pthread_t               _thread;
+    pthread_mutex_t         _mutex;
+    pthread_cond_t          _cond;
+
+    std::deque<timespec>    _inflight;
+    timespec                _started;
+    BroadcastStats          _stats;
+    double                  _latency_total_us;
+
+    void            threadMethod();
+    void            recordDone(int result);
+
+    friend void*    __broadcastThreadEntry(void* castedScheduler);
+
+public:
+    BroadcastScheduler(CC2540Communicator* communicator, unsigned int pipelineDepth = 2);
+    ~BroadcastScheduler();
+
+    /**
+     * Starts advertising (GAP_MakeDiscoverable) and the update thread. adType is 0x01 to rotate the advertising data,
+     * or 0x00 to rotate the scan response data.
+     */
+    bool            start(unsigned char eventType = Adv_NonConnectableUndirected, unsigned char channelMap = 0x07, unsigned char adType = 0x01);
+
+    /**
+     * Waits for the updates in flight, stops the thread and ends advertising. Returns false if ending it failed; it never throws.
+     */
+    bool            stop();
+
+    /**
+     * Sets the payload to be sent next (at most 31 bytes). If the previous one wasn't sent yet, it's replaced.
+     */
+    void            stagePayload(const unsigned char* data, unsigned char length);
+
+    BroadcastStats  getStats();
+};
+
+#endif // BROADCASTSCHEDULER_H
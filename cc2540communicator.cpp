@@ -1,25 +1,241 @@
 #include "cc2540communicator.h"
 #include "binaryparameter.h"
+#include "startupcache.h"
+#include "eventworkerpool.h"
+#include "metrics.h"
+#include "rssistore.h"
+#include "irkresolver.h"
+#include "discoveryexporter.h"
 #include <iostream>
+#include <deque>
+
+#define BULK_DRAIN_TIMEOUT_MS   1000    // Longest txBulkWrite() waits for the controller to give its buffers back.
+
+const char MacAddress::hexDigits[17] = "0123456789ABCDEF";
+
+uint64_t MacAddress::keyOf(const unsigned char* addr)
+{
+    uint64_t key = 0;
+    for(int i = 0; i < 6; i++)
+        key |= static_cast<uint64_t>(addr[i]) << (8 * i);
+    return key;
+}
 
 std::string MacAddress::toString() const
 {
-    char tempbuffer[4];
-    std::string retval;
+    char text[17];
 
-    sprintf(tempbuffer, "%02X", addr[5]);
-    retval.append(tempbuffer);
-    for(int i = 1; i < 6; i++)
+    for(int i = 0; i < 6; i++)
     {
-        sprintf(tempbuffer, ":%02X", addr[5-i]);
-        retval.append(tempbuffer);
+        text[i * 3]     = hexDigits[addr[5 - i] >> 4];
+        text[i * 3 + 1] = hexDigits[addr[5 - i] & 0x0F];
+        if(i < 5)
+            text[i * 3 + 2] = ':';
     }
 
+    return std::string(text, sizeof(text));
+}
+
+DiscoveryFilter::DiscoveryFilter() :
+    enabled         (false),
+    addr_type_mask  (0xFF),
+    rssi_floor      (-128)
+{
+}
+
+ScanProfile ScanProfile::fastFirstResult()
+{
+    ScanProfile retval;
+    retval.name                 = "fast-first-result";
+    retval.duration_ms          = 2560;
+    retval.scan_interval        = 16;       // 10 ms
+    retval.scan_window          = 16;       // 10 ms: always listening.
+    retval.filter_duplicates    = true;
+    return retval;
+}
+
+ScanProfile ScanProfile::balanced()
+{
+    ScanProfile retval;
+    retval.name                 = "balanced";
+    retval.duration_ms          = 5120;
+    retval.scan_interval        = 160;      // 100 ms
+    retval.scan_window          = 48;       // 30 ms
+    retval.filter_duplicates    = true;
+    return retval;
+}
+
+ScanProfile ScanProfile::lowDuty()
+{
+    ScanProfile retval;
+    retval.name                 = "low-duty";
+    retval.duration_ms          = 10240;
+    retval.scan_interval        = 2048;     // 1.28 s
+    retval.scan_window          = 16;       // 10 ms
+    retval.filter_duplicates    = true;
+    return retval;
+}
+
+std::vector<GapParamSetting> ScanProfile::toSettings() const
+{
+    std::vector<GapParamSetting> retval;
+    retval.push_back(GapParamSetting(TGAP_GEN_DISC_SCAN,        duration_ms));
+    retval.push_back(GapParamSetting(TGAP_LIM_DISC_SCAN,        duration_ms));
+    retval.push_back(GapParamSetting(TGAP_GEN_DISC_SCAN_INT,    scan_interval));
+    retval.push_back(GapParamSetting(TGAP_GEN_DISC_SCAN_WIND,   scan_window));
+    retval.push_back(GapParamSetting(TGAP_LIM_DISC_SCAN_INT,    scan_interval));
+    retval.push_back(GapParamSetting(TGAP_LIM_DISC_SCAN_WIND,   scan_window));
+    retval.push_back(GapParamSetting(TGAP_FILTER_ADV_REPORTS,   filter_duplicates ? 1 : 0));
     return retval;
 }
 
-CC2540Communicator::CC2540Communicator()
+/**
+ * Helper for the commands that have nothing to wait for, other than the Command Status.
+ */
+static bool commandStatusIsFinal(unsigned short opcode)
+{
+    switch(opcode)
+    {
+        case GAP_ConfigureDeviceAddress:
+        case GAP_SetParam:
+        case GAP_GetParam:
+        case GATT_WriteNoRsp:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Whether a failed Command Status only means the controller had no buffer for a write, so it can be sent again later
+ * (MSG_BUFFER_NOT_AVAIL, bleMemAllocError, bleNoResources).
+ */
+static bool writeStatusIsBusy(const unsigned char* packet, size_t length, unsigned char status)
+{
+    HciEventView<GapHciExtCommandStatusEvt> commandstatus(packet, length);
+    if(!commandstatus.complete() || commandstatus.value<GapEventHeader::Event>() != GAP_HCI_ExtentionCommandStatus)
+        return false;
+    if(commandstatus.value<GapHciExtCommandStatusEvt::OpCode>() != GATT_WriteNoRsp)
+        return false;
+
+    return status == 0x04 || status == 0x13 || status == 0x15;
+}
+
+/**
+ * Key used to spread events over an EventWorkerPool: the connection handle for link events, and the advertiser address
+ * (with bit 48 set, so it never collides with a handle) for discovery events. Returns false for events with no key.
+ */
+static bool eventWorkerKey(RxEvent event, const unsigned char* packet, size_t length, uint64_t* key)
+{
+    switch(event)
+    {
+        case GAP_DeviceInformation:
+        {
+            HciEventView<GapDeviceInformationEvt> information(packet, length);
+            if(!information.complete())
+                return false;
+
+            unsigned char addr[6];
+            information.get<GapDeviceInformationEvt::Addr>(&addr);
+            *key = MacAddress::keyOf(addr) | (1ULL << 48);
+            return true;
+        }
+
+        case GAP_EstablishLink:
+        {
+            HciEventView<GapEstablishLinkEvt> link(packet, length);
+            if(!link.complete())
+                return false;
+            *key = link.value<GapEstablishLinkEvt::ConnHandle>();
+            return true;
+        }
+
+        case GAP_TerminateLink:
+        {
+            HciEventView<GapTerminateLinkEvt> terminate(packet, length);
+            if(!terminate.complete())
+                return false;
+            *key = terminate.value<GapTerminateLinkEvt::ConnHandle>();
+            return true;
+        }
+
+        case GAP_LinkParamUpdate:
+        {
+            HciEventView<GapLinkParamUpdateEvt> update(packet, length);
+            if(!update.complete())
+                return false;
+            *key = update.value<GapLinkParamUpdateEvt::ConnHandle>();
+            return true;
+        }
+
+        case ATT_HandleValueNotification:
+        case ATT_HandleValueIndication:
+        {
+            HciEventView<AttHandleValueEvt> notification(packet, length);
+            if(!notification.complete())
+                return false;
+            *key = notification.value<AttHandleValueEvt::ConnHandle>();
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
+CC2540Communicator::CC2540Communicator() :
+    _data_pkt_len       (27),
+    _num_data_pkts      (0),
+    _data_credits       (0),
+
+    _filtered_devices   (0),
+    _hci_cmd_credits    (1),
+
+    _profile_role       (Role_Central),
+    _discovery_active   (false),
+    _scan_profile_set   (false),
+    _first_device_seen  (true),
+
+    _autoconnect_state      (AutoConnect_Off),
+    _autoconnect_predicate  (NULL),
+
+    _worker_pool        (NULL),
+    _rssi_store         (NULL),
+    _irk_resolver       (NULL),
+    _discovery_exporter (NULL),
+
+    _notification_listener      (NULL),
+    _notification_batch_size    (4),
+    _notification_max_delay_ms  (10),
+    _notification_streaming     (false),
+    _notification_flusher_running   (false)
+{
+    _notification_mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+    _links_mutex        = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+
+    // The batches are timed with CLOCK_MONOTONIC: the flusher waits on the same clock.
+    pthread_condattr_t monotonic;
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+    pthread_cond_init(&_notification_cond, &monotonic);
+    pthread_condattr_destroy(&monotonic);
+
+    memset(_device_irk, 0, sizeof(_device_irk));
+    memset(_device_csrk, 0, sizeof(_device_csrk));
+    memset(_device_mac_reversed, 0, sizeof(_device_mac_reversed));
+}
+
+CC2540Communicator::~CC2540Communicator()
 {
+    /// The receiver and hotplug threads call back into this class: they're stopped before any member goes away,
+    /// not in ~SerialCommunicator(), when the overrides are already gone.
+    disableHotplugRecovery();
+    if(_notification_streaming)
+        stopNotificationStream();
+    else
+        turnOffAutomaticReceiving();
+    setNotificationListener(NULL);
+    pthread_cond_destroy(&_notification_cond);
 }
 
 size_t CC2540Communicator::txSendCommand(TxOpcode opcode, std::vector<unsigned char> dataparams)
@@ -34,12 +250,35 @@ size_t CC2540Communicator::txSendCommand(TxOpcode opcode, std::vector<unsigned c
     return send(datasend);
 }
 
+template <typename Command>
+bool CC2540Communicator::txSendFrame(HciCommandFrame<Command>& frame, const char* errormessage)
+{
+    // 0 bytes transferred
+    if(send(frame.data(), frame.size()) == 0)
+    {
+        setError(errormessage);
+        return false;
+    }
+    return true;
+}
+
 int CC2540Communicator::rxPacket()
 {
     return rxPacket(NULL);
 }
 
 int CC2540Communicator::rxPacket(std::vector<unsigned char>* rxdata)
+{
+    // The packet is parsed in place, from the same pooled buffer the USB transfer wrote into.
+    return rxInterpret(recvFrame(), rxdata);
+}
+
+int CC2540Communicator::rxPacket(std::vector<unsigned char>* rxdata, unsigned int deadlineMs)
+{
+    return rxInterpret(recvFrame(deadlineMs), rxdata);
+}
+
+int CC2540Communicator::rxInterpret(FrameRef recvframe, std::vector<unsigned char>* rxdata)
 {
     /* BTool mimic:
     [2] : <Rx> - 04:52:52.878
@@ -51,28 +290,81 @@ int CC2540Communicator::rxPacket(std::vector<unsigned char>* rxdata)
      [What follows depends on the Event]
      */
 
-    std::vector<unsigned char> recvpacket;
-    recvpacket = recv();
-    unsigned char   evtype, evcode, datalen, retval;
+    unsigned char   evtype, evcode, retval;
     unsigned short  eventno;
     RxEvent         eventlabel;
 
-    if(recvpacket.size() < 6)
+    const unsigned char*    packet = recvframe.valid() ? recvframe.data() : NULL;
+    size_t                  length = recvframe.size();
+
+    HciEventView<GapEventHeader> header(packet, length);
+    if(!header.complete())
     {
+        Metrics::count(Metric_RxTooShort);
         setError("Did not receive a message big enough to be successfully interpreted.");
         return Tx_RxTooShort;
     }
 
-    recvpacket >> BinaryGrabber<1>(0, &evtype) >>
-                  BinaryGrabber<1>(1, &evcode) >>
-                  BinaryGrabber<1>(2, &datalen) >>
-                  BinaryGrabber<2>(3, &eventno) >>
-                  BinaryGrabber<1>(5, &retval);
+    evtype      = header.value<HciEventHeader::Type>();
+    evcode      = header.value<HciEventHeader::EventCode>();
+    eventno     = header.value<GapEventHeader::Event>();
+    retval      = header.value<GapEventHeader::Status>();
 
     eventlabel = static_cast<RxEvent>(eventno);
 
+    // Standard HCI Command Complete (answer to the HCI_LE_ commands).
+    if(evtype == RX_TYPE_EVENT && evcode == RX_HCI_CMDCOMPLETE)
+    {
+        HciEventView<HciCommandCompleteEvt> complete(packet, length);
+        if(!complete.complete())
+        {
+            Metrics::count(Metric_RxTooShort);
+            setError("Did not receive a message big enough to be successfully interpreted.");
+            return Tx_RxTooShort;
+        }
+
+        unsigned short hciopcode;
+        _hci_cmd_credits    = complete.value<HciCommandCompleteEvt::NumHciCmdPkts>();
+        Metrics::setGauge(Gauge_HciCmdCredits, _hci_cmd_credits);
+        hciopcode           = complete.value<HciCommandCompleteEvt::CommandOpcode>();
+        retval              = complete.value<HciCommandCompleteEvt::Status>();
+
+        #ifdef CC2540_DEBUGMODE
+        std::cout << "HCI_CommandComplete (opcode: 0x" << std::hex << hciopcode << std::dec << ", status: " << (int) retval << ")" << std::endl;
+        #endif
+
+        if(rxdata != NULL)
+            rxdata->assign(packet, packet + length);
+        return retval;
+    }
+
+    // Standard HCI Number Of Completed Packets: data buffers given back by the controller.
+    if(evtype == RX_TYPE_EVENT && evcode == RX_HCI_NUMCOMPLETEDPKTS)
+    {
+        HciEventView<HciNumCompletedPacketsEvt> completed(packet, length);
+        unsigned char numhandles = completed.complete() ? completed.value<HciNumCompletedPacketsEvt::NumHandles>() : 0;
+        if(!completed.complete() || completed.tailLength<HciNumCompletedPacketsEvt::Entries>() < numhandles * 4U)
+        {
+            Metrics::count(Metric_RxTooShort);
+            setError("Did not receive a message big enough to be successfully interpreted.");
+            return Tx_RxTooShort;
+        }
+
+        const unsigned char* entries = completed.tail<HciNumCompletedPacketsEvt::Entries>();
+        unsigned int credits = _data_credits, capacity = (_num_data_pkts > 0) ? _num_data_pkts : 1;
+        for(unsigned char i = 0; i < numhandles; i++)
+            credits += entries[4 * i + 2] | (entries[4 * i + 3] << 8);
+
+        _data_credits = (credits < capacity) ? credits : capacity;
+
+        if(rxdata != NULL)
+            rxdata->assign(packet, packet + length);
+        return Tx_Success;
+    }
+
     if(evtype != RX_TYPE_EVENT || evcode != RX_HCI_LE_EXTEVENT)
     {
+        Metrics::count(Metric_RxMalformed);
         setError("Received a malformed packet.");
         return Tx_RxMalformed;
     }
@@ -80,6 +372,23 @@ int CC2540Communicator::rxPacket(std::vector<unsigned char>* rxdata)
     // There was an issue on receiving the package. It'll return an error code.
     if(retval != 0)
     {
+        // A write the controller had no room for: the caller sends it again.
+        if(writeStatusIsBusy(packet, length, retval))
+        {
+            if(rxdata != NULL)
+                rxdata->assign(packet, packet + length);
+            return retval;
+        }
+
+        // Cancelling a discovery that was just ending: GAP_DeviceDiscoveryDone comes all the same.
+        HciEventView<GapHciExtCommandStatusEvt> status(packet, length);
+        if(_autoconnect_state == AutoConnect_Cancelling && eventlabel == GAP_HCI_ExtentionCommandStatus &&
+           status.complete() && status.value<GapHciExtCommandStatusEvt::OpCode>() == GAP_DeviceDiscoveryCancel)
+        {
+            recvframe.release();
+            return rxPacket(rxdata);
+        }
+
         if(retval == 0x11)
             return retval;
             //setError("Already performing a similar task.");
@@ -88,21 +397,40 @@ int CC2540Communicator::rxPacket(std::vector<unsigned char>* rxdata)
         return retval;
     }
 
+    // Drop unwanted advertisers before anything gets copied, and keep waiting for the next event.
+    if(eventlabel == GAP_DeviceInformation && !passesDiscoveryFilter(packet, length))
+    {
+        _filtered_devices++;
+        Metrics::count(Metric_DevicesFiltered);
+        recvframe.release();
+        return rxPacket(rxdata);
+    }
+
     if(rxdata != NULL)
     {
-        rxdata->clear();
-        rxdata->reserve(recvpacket.size());
-        rxdata->insert(rxdata->end(), recvpacket.begin(), recvpacket.end());
+        rxdata->assign(packet, packet + length);
     }
 
+    // Application handling goes to the workers (sharing the frame), while the bookkeeping below goes on in this thread.
+    uint64_t workerkey;
+    if(_worker_pool != NULL && eventWorkerKey(eventlabel, packet, length, &workerkey))
+        _worker_pool->post(workerkey, recvframe);
+
     switch(eventlabel)
     {
-        // Acknowledgement. Other receiving packet should follow.
+        // Acknowledgement. Other receiving packet should follow, unless the command was only a parameter access.
         case GAP_HCI_ExtentionCommandStatus:
+        {
+            HciEventView<GapHciExtCommandStatusEvt> status(packet, length);
+            if(status.complete() && commandStatusIsFinal(status.value<GapHciExtCommandStatusEvt::OpCode>()))
+                return Tx_Success;
+
             #ifdef CC2540_DEBUGMODE
             std::cout << "GAP_HCI_ExtentionCommandStatus (Acknowledgement). Other receiving packet should follow." << std::endl;
             #endif
+            recvframe.release();
             return rxPacket(rxdata);
+        }
         break;
 
         // Init device done. We now know the hardware IDs of the USB dongle.
@@ -110,7 +438,7 @@ int CC2540Communicator::rxPacket(std::vector<unsigned char>* rxdata)
             #ifdef CC2540_DEBUGMODE
             std::cout << "GAP_DeviceInitDone. Hardware IDs are now known." << std::endl;
             #endif
-            rxInterpretDeviceInit(recvpacket);
+            rxInterpretDeviceInit(packet, length);
             return Tx_Success;
         break;
 
@@ -119,8 +447,18 @@ int CC2540Communicator::rxPacket(std::vector<unsigned char>* rxdata)
             #ifdef CC2540_DEBUGMODE
             std::cout << "GAP_DeviceInformation." << std::endl;
             #endif
-            rxInterpretDeviceInformation(recvpacket);
+            rxInterpretDeviceInformation(packet, length);
+
+            // An auto-connect target: the scan is cut short right here, instead of waiting for it to time out.
+            if(_autoconnect_state == AutoConnect_Watching && rxAutoConnectMatches(packet, length))
+            {
+                HciCommandFrame<GapDeviceDiscoveryCancelCmd> cancel;
+                if(!txSendFrame(cancel, "Could not transfer the Device Discovery Cancel packet."))
+                    return Tx_TxUnsuccessful;
+                _autoconnect_state = AutoConnect_Cancelling;
+            }
 
+            recvframe.release();
             rxPacket(rxdata);
         break;
 
@@ -128,22 +466,113 @@ int CC2540Communicator::rxPacket(std::vector<unsigned char>* rxdata)
             #ifdef CC2540_DEBUGMODE
             std::cout << "GAP_DeviceDiscoveryDone. Discovered " << _discovered_devices.size() << " devices." << std::endl;
             #endif
+            Metrics::setGauge(Gauge_LastScanDevices, _discovered_devices.size());
+
+            // The controller stopped scanning, so it can initiate now. The link is waited for in this same call.
+            if(_autoconnect_state == AutoConnect_Cancelling)
+            {
+                HciCommandFrame<GapEstablishLinkRequestCmd> establish;
+                establish.set<GapEstablishLinkRequestCmd::HighDutyCycle>(0x00)
+                         .set<GapEstablishLinkRequestCmd::WhiteList>(0x00)
+                         .set<GapEstablishLinkRequestCmd::AddrTypePeer>(_autoconnect_addr_type)
+                         .set<GapEstablishLinkRequestCmd::PeerAddr>(_autoconnect_address.addr);
+
+                if(!txSendFrame(establish, "Could not transfer the Establish Link request."))
+                    return Tx_TxUnsuccessful;
+                _autoconnect_state = AutoConnect_Linking;
+
+                recvframe.release();
+                return rxPacket(rxdata);
+            }
         break;
 
         case GAP_EstablishLink:
             #ifdef CC2540_DEBUGMODE
             std::cout << "GAP_EstablishLink. Established link with a device." << std::endl;
             #endif
+            if(_autoconnect_state == AutoConnect_Linking)
+            {
+                rxInterpretEstablishLink(packet, length, &_autoconnect_link);
+                _autoconnect_link.link_set  = true;
+                _autoconnect_timing.link_ms = msSinceDiscoveryStarted();
+                _autoconnect_state          = AutoConnect_Off;
+
+                pthread_mutex_lock(&_links_mutex);
+                _links.push_back(_autoconnect_link);
+                Metrics::setGauge(Gauge_Links, _links.size());
+                pthread_mutex_unlock(&_links_mutex);
+            }
             return Tx_Success;
         break;
 
         case GAP_TerminateLink:
-            unsigned short term_handle;
-            recvpacket >> BinaryGrabber<2>(6, &term_handle);
+        {
+            HciEventView<GapTerminateLinkEvt> terminate(packet, length);
+            if(!terminate.complete())
+            {
+                Metrics::count(Metric_RxTooShort);
+                return Tx_RxTooShort;
+            }
+
+            #ifdef CC2540_DEBUGMODE
+            std::cout << "GAP_TerminateLink. Terminated link with a device. (handle: " << terminate.value<GapTerminateLinkEvt::ConnHandle>() << ")" << std::endl;
+            #endif
+
+            forgetLink(terminate.value<GapTerminateLinkEvt::ConnHandle>());
+        }
+        break;
+
+        // Pushed by a peer we subscribed to. Delivered, and the answer we were waiting for is still to come.
+        case ATT_HandleValueNotification:
+        case ATT_HandleValueIndication:
+            if(!rxDeliverNotification(recvframe, eventlabel == ATT_HandleValueIndication))
+                Metrics::count(Metric_RxTooShort);
+
+            recvframe.release();
+            return rxPacket(rxdata);
+        break;
+
+        case ATT_WriteRsp:
+            #ifdef CC2540_DEBUGMODE
+            std::cout << "ATT_WriteRsp. Characteristic written." << std::endl;
+            #endif
+            return Tx_Success;
+        break;
+
+        // One part of a long write queued by the peer. The Execute Write Response ends it.
+        case ATT_PrepareWriteRsp:
+            recvframe.release();
+            return rxPacket(rxdata);
+        break;
+
+        case ATT_ExecuteWriteRsp:
+            #ifdef CC2540_DEBUGMODE
+            std::cout << "ATT_ExecuteWriteRsp. Long characteristic value written." << std::endl;
+            #endif
+            return Tx_Success;
+        break;
+
+        // Answer to txUpdateLinkParams(), or an update started by the peer.
+        case GAP_LinkParamUpdate:
+            #ifdef CC2540_DEBUGMODE
+            std::cout << "GAP_LinkParamUpdate. Connection parameters changed." << std::endl;
+            #endif
+            if(!rxInterpretLinkParamUpdate(packet, length))
+            {
+                Metrics::count(Metric_RxTooShort);
+                return Tx_RxTooShort;
+            }
+            return Tx_Success;
+        break;
 
+        // Broadcaster / peripheral role events. Nothing more to wait for.
+        case GAP_MakeDiscoverableDone:
+        case GAP_EndDiscoverableDone:
+        case GAP_AdvertDataUpdateDone:
             #ifdef CC2540_DEBUGMODE
-            std::cout << "GAP_TerminateLink. Terminated link with a device. (handle: " << term_handle << ")" << std::endl;
+            std::cout << "Advertising state changed (event: 0x" << std::hex << eventno << std::dec << ")" << std::endl;
             #endif
+            return Tx_Success;
         break;
 
         default:
@@ -159,6 +588,13 @@ int CC2540Communicator::rxPacket(std::vector<unsigned char>* rxdata)
 
 int CC2540Communicator::txInitCommand()
 {
+    return txInitCommand(Role_Central);
+}
+
+int CC2540Communicator::txInitCommand(unsigned char profileRole)
+{
+    _profile_role = profileRole;
+
     /* BTool mimic:
     [1] : <Tx> - 04:52:52.802
     -Type       : 0x01 (Command)
@@ -176,28 +612,19 @@ int CC2540Communicator::txInitCommand()
     std::cout << "Sent init packet." << std::endl;
     #endif
 
-    size_t sendret;
+    HciCommandFrame<GapDeviceInitCmd> frame;
+    frame.set<GapDeviceInitCmd::ProfileRole>(profileRole)       // Profile role:    0x08 (Central) by default
+         .set<GapDeviceInitCmd::MaxScanRsps>(0x05)              // Max Scan Rsps:   0x05
+         .set<GapDeviceInitCmd::SignCounter>(0x00000001);       // SignCounter: 0x00 00 00 01 (IRK and CSRK: zeroes)
 
-    sendret = txSendCommand(GAP_DeviceInit, std::vector<unsigned char>() <<
-                BinarySender<1>(0x08) <<        // Profile role:    0x08 (Central)
-                BinarySender<1>(0x05) <<        // Max Scan Rsps:   0x05
-                BinarySender<16>(0x00) <<       // IRK: 16 zeroes
-                BinarySender<16>(0x00) <<       // CSRK: 16 zeroes
-                BinarySender<4>(0x00000001)     // SignCounter: 0x00 00 00 01
-    );
-
-    // 0 bytes transferred
-    if(sendret == 0)
-    {
-        setError("Could not transfer the Initialization packet.");
+    if(!txSendFrame(frame, "Could not transfer the Initialization packet."))
         return Tx_TxUnsuccessful;
-    }
 
     // Waits for acknowledgement and retrieving information (2 Rx Packets)
     return rxPacket();
 }
 
-void CC2540Communicator::rxInterpretDeviceInit(std::vector<unsigned char> data)
+void CC2540Communicator::rxInterpretDeviceInit(const unsigned char* packet, size_t length)
 {
     /* BTool mimic
     [14] : <Rx> - 08:30:57.356
@@ -217,162 +644,1400 @@ void CC2540Communicator::rxInterpretDeviceInit(std::vector<unsigned char> data)
     68 E6 8E F6 48 43 04 C4 F0 5C D3 D1 39 A9 9F
      */
 
-    data >> BinaryGrabber<6>(6, _device_mac_reversed) >>
-            BinaryGrabber<16>(15, _device_irk) >>
-            BinaryGrabber<16>(31, _device_csrk);
+    HciEventView<GapDeviceInitDoneEvt> initdone(packet, length);
+    if(!initdone.complete())
+        return;
+
+    initdone.get<GapDeviceInitDoneEvt::DevAddr>(&_device_mac_reversed);
+    initdone.get<GapDeviceInitDoneEvt::DataPktLen>(&_data_pkt_len);
+    initdone.get<GapDeviceInitDoneEvt::NumDataPkts>(&_num_data_pkts);
+    _data_credits = _num_data_pkts;
+    initdone.get<GapDeviceInitDoneEvt::IRK>(&_device_irk);
+    initdone.get<GapDeviceInitDoneEvt::CSRK>(&_device_csrk);
 }
 
 std::vector<MacAddress> CC2540Communicator::txDeviceDiscovery()
+{
+    return txDeviceDiscovery(Discovery_All, true, false);
+}
+
+std::vector<MacAddress> CC2540Communicator::txDeviceDiscovery(DiscoveryMode mode, bool activeScan, bool useWhiteList)
+{
+    // A plain discovery: nothing left over from an auto-connect may act on its events.
+    _autoconnect_state = AutoConnect_Off;
+    return txDeviceDiscoveryRun(mode, activeScan, useWhiteList);
+}
+
+std::vector<MacAddress> CC2540Communicator::txDeviceDiscoveryRun(DiscoveryMode mode, bool activeScan, bool useWhiteList)
 {
     #ifdef CC2540_DEBUGMODE
     std::cout << "Sent device discovery." << std::endl;
     #endif
 
-    size_t sendret;
-
-    sendret = txSendCommand(GAP_DeviceDiscoveryRequest, std::vector<unsigned char>() <<
-                BinarySender<1>(0x03) <<        // Scan for all devices.
-                BinarySender<1>(0x01) <<        // Turn on Name Discovery
-                BinarySender<1>(0x00)           // Don't use White list.
-    );
+    HciCommandFrame<GapDeviceDiscoveryRequestCmd> frame;
+    frame.set<GapDeviceDiscoveryRequestCmd::Mode>(mode)                                    // Which devices to scan for.
+         .set<GapDeviceDiscoveryRequestCmd::ActiveScan>(activeScan ? 0x01 : 0x00)          // Active scan (Name Discovery)
+         .set<GapDeviceDiscoveryRequestCmd::WhiteList>(useWhiteList ? 0x01 : 0x00);        // White list.
 
-    // 0 bytes transferred
-    if(sendret == 0)
-    {
-        setError("Could not transfer the Device Discovery packet.");
+    if(!txSendFrame(frame, "Could not transfer the Device Discovery packet."))
         return std::vector<MacAddress>();
-    }
 
     _discovered_devices.clear();
+    _filtered_devices = 0;
+    Metrics::count(Metric_DiscoveryScans);
 
-    // Waits for acknowledgement and retrieving information (2 Rx Packets)
-    rxPacket();
+    clock_gettime(CLOCK_MONOTONIC, &_discovery_started);
+    _first_device_seen = false;
+    _scan_profile_stats[_scan_profile_set ? _scan_profile.name : std::string("default")].scans++;
+
+    // Remembered, so that a discovery interrupted by a device reset can be started again.
+    _discovery_active       = true;
+    _discovery_mode         = mode;
+    _discovery_active_scan  = activeScan;
+    _discovery_white_list   = useWhiteList;
+
+    // Waits for acknowledgement and retrieving information (2 Rx Packets). A restore nested in there still sees it running.
+    try
+    {
+        rxPacket();
+    }
+    catch(std::string error)
+    {
+        _discovery_active   = false;
+        throw;
+    }
+    _discovery_active       = false;
     return getDiscoveredDevices();
 }
 
-void CC2540Communicator::rxInterpretDeviceInformation(std::vector<unsigned char> data){
-    MacAddress      dev_address;
-    unsigned char   event_type;
+double CC2540Communicator::msSinceDiscoveryStarted() const
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - _discovery_started.tv_sec) * 1000.0 + (now.tv_nsec - _discovery_started.tv_nsec) / 1000000.0;
+}
 
-    data >> BinaryGrabber<6>(8, &(dev_address.addr)) >>
-            BinaryGrabber<1>(6, &event_type);
+LinkInfo CC2540Communicator::txAutoConnect(const std::vector<MacAddress>& targets, DiscoveryMode mode, bool activeScan, AutoConnectTiming* timing)
+{
+    _autoconnect_targets.clear();
+    for(size_t i = 0; i < targets.size(); i++)
+        _autoconnect_targets.insert(targets[i].key());
+    _autoconnect_predicate = NULL;
 
-    if(event_type == 0x04)  // It's a scan response.
-    {
-        _discovered_devices.push_back(dev_address);
-        #ifdef CC2540_DEBUGMODE
-        std::cout << "Discovered a device." << std::endl;
-        #endif
-    }
+    return txAutoConnectRun(mode, activeScan, timing);
 }
 
-std::vector<MacAddress> CC2540Communicator::getDiscoveredDevices() const
+LinkInfo CC2540Communicator::txAutoConnect(AutoConnectPredicate* predicate, DiscoveryMode mode, bool activeScan, AutoConnectTiming* timing)
 {
-    return std::vector<MacAddress>(_discovered_devices);
+    _autoconnect_targets.clear();
+    _autoconnect_predicate = predicate;
+
+    return txAutoConnectRun(mode, activeScan, timing);
 }
 
-LinkInfo CC2540Communicator::txEstablishLink(MacAddress remoteDevice)
+LinkInfo CC2540Communicator::txAutoConnectRun(DiscoveryMode mode, bool activeScan, AutoConnectTiming* timing)
 {
-    /*[18] : <Tx> - 09:04:43.276
-    -Type		: 0x01 (Command)
-    -Opcode		: 0xFE09 (GAP_EstablishLinkRequest)
-    -Data Length	: 0x09 (9) byte(s)
-     HighDutyCycle	: 0x00 (Disable)
-     WhiteList		: 0x00 (Disable)
-     AddrTypePeer	: 0x00 (Public)
-     PeerAddr		: 7A:1D:A0:E5:C5:78
-    Dump(Tx):
-    01 09 FE 09 00 00 00 7A 1D A0 E5 C5 78 */
+    _autoconnect_link.link_set      = false;
+    _autoconnect_timing.sighting_ms = 0;
+    _autoconnect_timing.link_ms     = 0;
+    _autoconnect_state              = AutoConnect_Watching;
+
+    // The whole sequence (discovery, cancel, link request and link) runs inside the discovery's receiving.
+    // A failed link throws out of it: the state must not outlive the call either way.
+    try
+    {
+        txDeviceDiscoveryRun(mode, activeScan, false);
+    }
+    catch(std::string error)
+    {
+        _autoconnect_state = AutoConnect_Off;
+        throw;
+    }
+    _autoconnect_state = AutoConnect_Off;
 
     #ifdef CC2540_DEBUGMODE
-    std::cout << "Sent establish link request to Device " << remoteDevice.toString() << std::endl;
+    if(_autoconnect_link.link_set)
+        std::cout << "Auto-connected to " << _autoconnect_link.dev_address.toString() << ": seen after " << _autoconnect_timing.sighting_ms
+                  << " ms, linked after " << _autoconnect_timing.link_ms << " ms." << std::endl;
+    else
+        std::cout << "Auto-connect: no target advertised during the discovery." << std::endl;
     #endif
 
-    std::vector<unsigned char> rxdata;
-    size_t sendret, recvret;
-    LinkInfo retval;
-    retval.link_set = false;
+    if(timing != NULL)
+        *timing = _autoconnect_timing;
+    return _autoconnect_link;
+}
 
-    std::vector<unsigned char> senddata = std::vector<unsigned char>() <<
-                                          BinarySender<1>(0x00) <<        // High Duty Cyle: Disable (0x00)
-                                          BinarySender<1>(0x00) <<        // White List: Disable (0x00)
-                                          BinarySender<1>(0x00);           // Address Type Peer: Public (0x00)
+/**
+ * Whether an advertising report is from an auto-connect target that takes connections. If so, its address and address
+ * type are kept for the link request.
+ */
+bool CC2540Communicator::rxAutoConnectMatches(const unsigned char* packet, size_t length)
+{
+    HciEventView<GapDeviceInformationEvt> information(packet, length);
+    if(!information.complete())
+        return false;
 
-    senddata.insert(senddata.end(), &(remoteDevice.addr[0]), &(remoteDevice.addr[6]));
+    // Scannable and non-connectable undirected advertisers can't be connected to.
+    unsigned char eventtype = information.value<GapDeviceInformationEvt::EventType>();
+    if(eventtype == 0x02 || eventtype == 0x03)
+        return false;
 
-    sendret = txSendCommand(GAP_EstablishLinkRequest, senddata);
+    MacAddress address;
+    information.get<GapDeviceInformationEvt::Addr>(&(address.addr));
+    unsigned char addrtype = information.value<GapDeviceInformationEvt::AddrType>();
 
-    // 0 bytes transferred
-    if(sendret == 0)
+    bool matched;
+    if(_autoconnect_predicate != NULL)
     {
-        setError("Could not try to establish a Establish Link request.");
-        return retval;
-    }
+        size_t datalength = information.tailLength<GapDeviceInformationEvt::Data>();
+        if(datalength > information.value<GapDeviceInformationEvt::DataLength>())
+            datalength = information.value<GapDeviceInformationEvt::DataLength>();
 
-    // Waits for acknowledgement and retrieving information (2 Rx Packets)
-    recvret = rxPacket(&rxdata);
-    if(recvret == 0x11)
-    {
-        std::cout << "Already doing that. Try send a Terminate Link Request signal before doing this again." << std::endl;
-        return retval;
+        matched = _autoconnect_predicate->matches(address, addrtype, information.value<GapDeviceInformationEvt::Rssi>(),
+                                                  information.tail<GapDeviceInformationEvt::Data>(), datalength);
     }
-    else if(recvret != 0x00)
+    else
     {
-        std::cout << "There was an unidentified problem trying to establish a link with the device " << remoteDevice.toString() << std::endl;
-        return retval;
+        matched = _autoconnect_targets.count(address.key()) > 0;
     }
 
-    // Success! Interpret the thing and let's go.
-    rxInterpretEstablishLink(rxdata, &retval);
-    retval.link_set = true;
+    if(!matched)
+        return false;
 
-    return retval;
+    _autoconnect_address            = address;
+    _autoconnect_addr_type          = addrtype;
+    _autoconnect_timing.sighting_ms = msSinceDiscoveryStarted();
+
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Auto-connect target " << address.toString() << " seen. Cancelling the discovery." << std::endl;
+    #endif
+    return true;
 }
 
-int CC2540Communicator::txTerminateLinkRequest(LinkInfo remoteLink)
-{
-    if(!remoteLink.link_set)
+void CC2540Communicator::rxInterpretDeviceInformation(const unsigned char* packet, size_t length){
+    MacAddress      dev_address;
+    unsigned char   event_type;
+
+    HciEventView<GapDeviceInformationEvt> information(packet, length);
+    if(!information.complete())
+        return;
+
+    information.get<GapDeviceInformationEvt::Addr>(&(dev_address.addr));
+    information.get<GapDeviceInformationEvt::EventType>(&event_type);
+
+    if(!_first_device_seen)
     {
+        double elapsed = msSinceDiscoveryStarted();
+
+        ScanProfileStats& stats = _scan_profile_stats[_scan_profile_set ? _scan_profile.name : std::string("default")];
+        if(stats.scans_with_devices == 0 || elapsed < stats.first_device_min_ms)
+            stats.first_device_min_ms = elapsed;
+        if(stats.scans_with_devices == 0 || elapsed > stats.first_device_max_ms)
+            stats.first_device_max_ms = elapsed;
+        stats.first_device_avg_ms = (stats.first_device_avg_ms * stats.scans_with_devices + elapsed) / (stats.scans_with_devices + 1);
+        stats.scans_with_devices++;
+
+        _first_device_seen = true;
         #ifdef CC2540_DEBUGMODE
-        std::cout << "The supplied Connection Info was not set." << std::endl;
+        std::cout << "First device after " << elapsed << " ms." << std::endl;
         #endif
-        return Tx_TxUnsuccessful;
     }
 
-    #ifdef CC2540_DEBUGMODE
-    std::cout << "Sent a Terminate Link Request signal (MAC: " << remoteLink.dev_address.toString() << ", handle: " << remoteLink.conn_handle << ")" << std::endl;
-    #endif
+    // Advertisements and scan responses alike: every one is an RSSI sample.
+    MacAddress  rssi_address = dev_address;
+    IrkIdentity identity;
+    if(_irk_resolver != NULL && information.value<GapDeviceInformationEvt::AddrType>() == 0x01 && _irk_resolver->resolve(dev_address, &identity))
+        rssi_address = identity.address;
 
-    size_t sendret;
+    if(_rssi_store != NULL)
+        _rssi_store->ingest(rssi_address.key(), information.value<GapDeviceInformationEvt::Rssi>());
 
-    sendret = txSendCommand(GAP_TerminateLinkRequest, std::vector<unsigned char>() <<
-                BinarySender<2>(remoteLink.conn_handle) <<        // Connection handle for the established link.
-                BinarySender<1>(0x13)                             // Reason: Remote User Terminated Connection
-    );
+    if(_discovery_exporter != NULL)
+        _discovery_exporter->push(event_type, information.value<GapDeviceInformationEvt::AddrType>(), dev_address,
+                                  information.value<GapDeviceInformationEvt::Rssi>(), information.tail<GapDeviceInformationEvt::Data>(),
+                                  information.tailLength<GapDeviceInformationEvt::Data>());
 
-    // 0 bytes transferred
-    if(sendret == 0)
+    if(event_type == 0x04)  // It's a scan response.
     {
-        setError("Could not transfer the Terminate Link Request packet.");
-        return Tx_TxUnsuccessful;
+        _discovered_devices.push_back(dev_address);
+        Metrics::count(Metric_DevicesDiscovered);
+        #ifdef CC2540_DEBUGMODE
+        std::cout << "Discovered a device." << std::endl;
+        #endif
     }
+}
 
-    // Waits for acknowledgement and retrieving information (2 Rx Packets)
-    return rxPacket();
+std::vector<MacAddress> CC2540Communicator::getDiscoveredDevices() const
+{
+    return std::vector<MacAddress>(_discovered_devices);
 }
 
-void CC2540Communicator::rxInterpretEstablishLink(std::vector<unsigned char> data, LinkInfo *linforeturner)
+bool CC2540Communicator::passesDiscoveryFilter(const unsigned char* packet, size_t length) const
 {
+    if(!_discovery_filter.enabled)
+        return true;
 
-    data >> BinaryGrabber<6>(7, &(linforeturner->dev_address.addr)) >>
-            BinaryGrabber<1>(6, &(linforeturner->dev_addr_type)) >>
-            BinaryGrabber<2>(13, &(linforeturner->conn_handle)) >>
-            BinaryGrabber<2>(15, &(linforeturner->conn_interval)) >>
-            BinaryGrabber<2>(17, &(linforeturner->conn_latency)) >>
-            BinaryGrabber<2>(19, &(linforeturner->conn_timeout)) >>
-            BinaryGrabber<1>(20, &(linforeturner->clock_accuracy));
+    HciEventView<GapDeviceInformationEvt> information(packet, length);
+    if(!information.complete())
+        return false;
 
-    #ifdef CC2540_DEBUGMODE
-    std::cout << "Established link with device " << linforeturner->dev_address.toString() << " (handle: " << linforeturner->conn_handle << ")" << std::endl;
-    #endif
+    if(!(_discovery_filter.addr_type_mask & (1 << (information.value<GapDeviceInformationEvt::AddrType>() & 0x07))))
+        return false;
+
+    if(information.value<GapDeviceInformationEvt::Rssi>() < _discovery_filter.rssi_floor)
+        return false;
+
+    if(_discovery_filter.oui_prefixes.empty())
+        return true;
+
+    // The address comes reversed: the OUI is in its three last bytes.
+    unsigned char addr[6];
+    information.get<GapDeviceInformationEvt::Addr>(&addr);
+    unsigned int oui = (addr[5] << 16) | (addr[4] << 8) | addr[3];
+    for(size_t i = 0; i < _discovery_filter.oui_prefixes.size(); i++)
+    {
+        if(_discovery_filter.oui_prefixes[i] == oui)
+            return true;
+    }
+    return false;
+}
+
+void CC2540Communicator::setDiscoveryFilter(const DiscoveryFilter& filter)
+{
+    _discovery_filter = filter;
+}
+
+DiscoveryFilter CC2540Communicator::getDiscoveryFilter() const
+{
+    return _discovery_filter;
+}
+
+unsigned int CC2540Communicator::getFilteredDeviceCount() const
+{
+    return _filtered_devices;
+}
+
+int CC2540Communicator::txWhiteListAdd(const std::vector<WhiteListEntry>& entries)
+{
+    int retval = txWhiteListBatch<HCI_LE_AddDeviceToWhiteList>(entries);
+    if(retval == Tx_Success)
+        _white_list.insert(_white_list.end(), entries.begin(), entries.end());
+    return retval;
+}
+
+int CC2540Communicator::txWhiteListRemove(const std::vector<WhiteListEntry>& entries)
+{
+    int retval = txWhiteListBatch<HCI_LE_RemoveDeviceFromWhiteList>(entries);
+    if(retval != Tx_Success)
+        return retval;
+
+    for(size_t i = 0; i < entries.size(); i++)
+    {
+        for(size_t j = 0; j < _white_list.size(); j++)
+        {
+            if(memcmp(_white_list[j].address.addr, entries[i].address.addr, 6) == 0)
+            {
+                _white_list.erase(_white_list.begin() + j);
+                break;
+            }
+        }
+    }
+    return retval;
+}
+
+int CC2540Communicator::txWhiteListClear()
+{
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Sent white list clear." << std::endl;
+    #endif
+
+    HciCommandFrame<HciLeClearWhiteListCmd> frame;
+    if(!txSendFrame(frame, "Could not transfer the White List Clear packet."))
+        return Tx_TxUnsuccessful;
+
+    _white_list.clear();
+    return rxPacket();
+}
+
+/**
+ * Sends count commands, built by batch.build(frame, item), keeping as many in flight as the controller says it can take
+ * (NumHciCmdPkts). The answers come in the order the commands went: each one goes to batch.answer(item, status, rxdata),
+ * which returns the status to count. Returns the first error.
+ */
+template <class Batch>
+int CC2540Communicator::txPipelined(Batch& batch, size_t count, const char* errormessage)
+{
+    size_t  sent = 0, answered = 0;
+    int     firsterror = Tx_Success;
+
+    while(answered < count)
+    {
+        while(sent < count && (sent - answered) < (_hci_cmd_credits > 0 ? _hci_cmd_credits : 1))
+        {
+            HciCommandFrame<typename Batch::Command> frame;
+            batch.build(frame, sent);
+
+            if(!txSendFrame(frame, errormessage))
+                return Tx_TxUnsuccessful;
+            sent++;
+        }
+
+        std::vector<unsigned char> rxdata;
+        int recvret = rxPacket(&rxdata);
+        recvret = batch.answer(answered, recvret, rxdata);
+        if(recvret != Tx_Success && firsterror == Tx_Success)
+            firsterror = recvret;
+        answered++;
+    }
+
+    return firsterror;
+}
+
+template <TxOpcode Opcode>
+struct WhiteListBatch
+{
+    typedef HciLeWhiteListCmd<Opcode> Command;
+
+    const std::vector<WhiteListEntry>&  entries;
+
+    WhiteListBatch(const std::vector<WhiteListEntry>& toSend) : entries(toSend) {}
+
+    void build(HciCommandFrame<Command>& frame, size_t item) const
+    {
+        frame.template set<typename Command::AddrType>(entries[item].addr_type == Addr_Public ? 0x00 : 0x01)   // HCI: Public / Random
+             .template set<typename Command::Addr>(entries[item].address.addr);
+    }
+
+    int answer(size_t /*item*/, int status, const std::vector<unsigned char>& /*rxdata*/) const
+    {
+        return status;
+    }
+};
+
+template <TxOpcode Opcode>
+int CC2540Communicator::txWhiteListBatch(const std::vector<WhiteListEntry>& entries)
+{
+    /*[1] : <Tx>
+    -Type		: 0x01 (Command)
+    -OpCode		: 0x2011 (HCI_LE_AddDeviceToWhiteList)
+    -Data Length	: 0x07 (7) byte(s)
+     AddrType		: 0x00 (Public)
+     DevAddr		: 7A:1D:A0:E5:C5:78 */
+
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Sending " << entries.size() << " white list entries." << std::endl;
+    #endif
+
+    WhiteListBatch<Opcode> batch(entries);
+    return txPipelined(batch, entries.size(), "Could not transfer a White List packet.");
+}
+
+LinkInfo CC2540Communicator::txEstablishLink(MacAddress remoteDevice)
+{
+    return txEstablishLink(remoteDevice, Addr_Public);
+}
+
+LinkInfo CC2540Communicator::txEstablishLinkWhiteList()
+{
+    MacAddress anydevice;
+    memset(anydevice.addr, 0, sizeof(anydevice.addr));
+
+    return txEstablishLink(anydevice, 0xFF);
+}
+
+LinkInfo CC2540Communicator::txEstablishLink(MacAddress remoteDevice, unsigned char addrType)
+{
+    /*[18] : <Tx> - 09:04:43.276
+    -Type		: 0x01 (Command)
+    -Opcode		: 0xFE09 (GAP_EstablishLinkRequest)
+    -Data Length	: 0x09 (9) byte(s)
+     HighDutyCycle	: 0x00 (Disable)
+     WhiteList		: 0x00 (Disable)
+     AddrTypePeer	: 0x00 (Public)
+     PeerAddr		: 7A:1D:A0:E5:C5:78
+    Dump(Tx):
+    01 09 FE 09 00 00 00 7A 1D A0 E5 C5 78 */
+
+    // This link is the caller's own, not an auto-connect one.
+    _autoconnect_state = AutoConnect_Off;
+
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Sent establish link request to Device " << remoteDevice.toString() << std::endl;
+    #endif
+
+    std::vector<unsigned char> rxdata;
+    int recvret;
+    LinkInfo retval;
+    retval.link_set = false;
+
+    // An address type of 0xFF means "whoever is in the white list": the peer address is ignored by the controller then.
+    bool usewhitelist = (addrType == 0xFF);
+
+    HciCommandFrame<GapEstablishLinkRequestCmd> frame;
+    frame.set<GapEstablishLinkRequestCmd::HighDutyCycle>(0x00)                                 // High Duty Cyle: Disable (0x00)
+         .set<GapEstablishLinkRequestCmd::WhiteList>(usewhitelist ? 0x01 : 0x00)               // White List
+         .set<GapEstablishLinkRequestCmd::AddrTypePeer>(usewhitelist ? 0x00 : addrType)        // Address Type Peer
+         .set<GapEstablishLinkRequestCmd::PeerAddr>(remoteDevice.addr);
+
+    if(!txSendFrame(frame, "Could not try to establish a Establish Link request."))
+        return retval;
+
+    // Waits for acknowledgement and retrieving information (2 Rx Packets)
+    recvret = rxPacket(&rxdata);
+    if(recvret == 0x11)
+    {
+        std::cout << "Already doing that. Try send a Terminate Link Request signal before doing this again." << std::endl;
+        return retval;
+    }
+    else if(recvret != 0x00)
+    {
+        std::cout << "There was an unidentified problem trying to establish a link with the device " << remoteDevice.toString() << std::endl;
+        return retval;
+    }
+
+    // Success! Interpret the thing and let's go.
+    rxInterpretEstablishLink(rxdata.data(), rxdata.size(), &retval);
+    retval.link_set = true;
+    pthread_mutex_lock(&_links_mutex);
+    _links.push_back(retval);
+    Metrics::setGauge(Gauge_Links, _links.size());
+    pthread_mutex_unlock(&_links_mutex);
+
+    return retval;
+}
+
+int CC2540Communicator::txTerminateLinkRequest(LinkInfo remoteLink)
+{
+    if(!remoteLink.link_set)
+    {
+        #ifdef CC2540_DEBUGMODE
+        std::cout << "The supplied Connection Info was not set." << std::endl;
+        #endif
+        return Tx_TxUnsuccessful;
+    }
+
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Sent a Terminate Link Request signal (MAC: " << remoteLink.dev_address.toString() << ", handle: " << remoteLink.conn_handle << ")" << std::endl;
+    #endif
+
+    HciCommandFrame<GapTerminateLinkRequestCmd> frame;
+    frame.set<GapTerminateLinkRequestCmd::ConnHandle>(remoteLink.conn_handle)     // Connection handle for the established link.
+         .set<GapTerminateLinkRequestCmd::Reason>(0x13);                          // Reason: Remote User Terminated Connection
+
+    if(!txSendFrame(frame, "Could not transfer the Terminate Link Request packet."))
+        return Tx_TxUnsuccessful;
+
+    // Waits for acknowledgement and retrieving information (2 Rx Packets)
+    return rxPacket();
+}
+
+void CC2540Communicator::rxInterpretEstablishLink(const unsigned char* packet, size_t length, LinkInfo *linforeturner)
+{
+    HciEventView<GapEstablishLinkEvt> link(packet, length);
+    if(!link.complete())
+        return;
+
+    link.get<GapEstablishLinkEvt::DevAddr>(&(linforeturner->dev_address.addr));
+    linforeturner->dev_addr_type    = link.value<GapEstablishLinkEvt::DevAddrType>();
+    linforeturner->conn_handle      = link.value<GapEstablishLinkEvt::ConnHandle>();
+    linforeturner->conn_interval    = link.value<GapEstablishLinkEvt::ConnInterval>();
+    linforeturner->conn_latency     = link.value<GapEstablishLinkEvt::ConnLatency>();
+    linforeturner->conn_timeout     = link.value<GapEstablishLinkEvt::ConnTimeout>();
+    linforeturner->clock_accuracy   = link.value<GapEstablishLinkEvt::ClockAccuracy>();
+
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Established link with device " << linforeturner->dev_address.toString() << " (handle: " << linforeturner->conn_handle << ")" << std::endl;
+    #endif
+}
+
+int CC2540Communicator::txUpdateLinkParams(unsigned short connHandle, unsigned short intervalMin, unsigned short intervalMax, unsigned short connLatency, unsigned short connTimeout)
+{
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Sent an Update Link Parameter Request (handle: " << connHandle << ", interval: " << intervalMin << "-" << intervalMax << ")" << std::endl;
+    #endif
+
+    HciCommandFrame<GapUpdateLinkParamReqCmd> frame;
+    frame.set<GapUpdateLinkParamReqCmd::ConnHandle>(connHandle)
+         .set<GapUpdateLinkParamReqCmd::IntervalMin>(intervalMin)          // 1.25 ms units.
+         .set<GapUpdateLinkParamReqCmd::IntervalMax>(intervalMax)
+         .set<GapUpdateLinkParamReqCmd::ConnLatency>(connLatency)          // Connection events the peripheral may skip.
+         .set<GapUpdateLinkParamReqCmd::ConnTimeout>(connTimeout);         // Supervision timeout, 10 ms units.
+
+    if(!txSendFrame(frame, "Could not transfer the Update Link Parameter Request packet."))
+        return Tx_TxUnsuccessful;
+
+    // Waits for acknowledgement and GAP_LinkParamUpdate (2 Rx Packets). The link is updated on the way.
+    return rxPacket();
+}
+
+bool CC2540Communicator::rxInterpretLinkParamUpdate(const unsigned char* packet, size_t length)
+{
+    HciEventView<GapLinkParamUpdateEvt> update(packet, length);
+    if(!update.complete())
+        return false;
+
+    unsigned short connhandle = update.value<GapLinkParamUpdateEvt::ConnHandle>();
+    pthread_mutex_lock(&_links_mutex);
+    for(size_t i = 0; i < _links.size(); i++)
+    {
+        if(_links[i].conn_handle == connhandle)
+        {
+            _links[i].conn_interval = update.value<GapLinkParamUpdateEvt::ConnInterval>();
+            _links[i].conn_latency  = update.value<GapLinkParamUpdateEvt::ConnLatency>();
+            _links[i].conn_timeout  = update.value<GapLinkParamUpdateEvt::ConnTimeout>();
+
+            #ifdef CC2540_DEBUGMODE
+            std::cout << "Link " << connhandle << " now at interval " << _links[i].conn_interval << ", latency " << _links[i].conn_latency << ", timeout " << _links[i].conn_timeout << std::endl;
+            #endif
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_links_mutex);
+    return true;
+}
+
+int CC2540Communicator::txWriteCharValue(unsigned short connHandle, unsigned short attrHandle, const unsigned char* value, unsigned char length)
+{
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Sent a Write Characteristic Value (handle: " << connHandle << ", attribute: 0x" << std::hex << attrHandle << std::dec << ")" << std::endl;
+    #endif
+
+    HciCommandFrame<GattWriteCharValueCmd> frame;
+    frame.set<GattWriteCharValueCmd::ConnHandle>(connHandle)
+         .set<GattWriteCharValueCmd::Handle>(attrHandle)
+         .setTail<GattWriteCharValueCmd::Value>(value, length);
+
+    if(!txSendFrame(frame, "Could not transfer the Write Characteristic Value packet."))
+        return Tx_TxUnsuccessful;
+
+    // Waits for acknowledgement and ATT_WriteRsp (2 Rx Packets)
+    return rxPacket();
+}
+
+int CC2540Communicator::txSubscribe(unsigned short connHandle, unsigned short cccdHandle, bool indications)
+{
+    // Client Characteristic Configuration: bit 0 notifications, bit 1 indications. Little endian.
+    unsigned char cccd[2] = { static_cast<unsigned char>(indications ? 0x02 : 0x01), 0x00 };
+    return txWriteCharValue(connHandle, cccdHandle, cccd, sizeof(cccd));
+}
+
+int CC2540Communicator::txUnsubscribe(unsigned short connHandle, unsigned short cccdHandle)
+{
+    unsigned char cccd[2] = { 0x00, 0x00 };
+    return txWriteCharValue(connHandle, cccdHandle, cccd, sizeof(cccd));
+}
+
+int CC2540Communicator::txBulkWrite(unsigned short connHandle, unsigned short attrHandle, const unsigned char* data, size_t length,
+                                    BulkWriteResult* result, bool reliable)
+{
+    BulkWriteResult stats;
+    timespec        started, finished;
+    int             retval;
+
+    memset(&stats, 0, sizeof(stats));
+
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Bulk writing " << length << " bytes (handle: " << connHandle << ", attribute: 0x" << std::hex << attrHandle << std::dec
+              << (reliable ? ", prepared writes" : ", without response") << ")" << std::endl;
+    #endif
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if(reliable)
+        retval = txBulkWriteLong(connHandle, attrHandle, data, length, &stats);
+    else
+        retval = txBulkWriteNoRsp(connHandle, attrHandle, data, length, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    stats.seconds           = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    stats.bytes_per_second  = (stats.seconds > 0) ? stats.bytes_written / stats.seconds : 0.0;
+
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Bulk write done: " << stats.bytes_written << " bytes in " << stats.chunks << " chunks (" << stats.retries << " sent again), "
+              << stats.bytes_per_second << " B/s." << std::endl;
+    #endif
+
+    if(result != NULL)
+        *result = stats;
+    return retval;
+}
+
+/**
+ * Write Without Response pipeline. Every chunk takes a data buffer of the controller until Number Of Completed Packets
+ * gives it back, and gets a Command Status telling whether it was queued. When one wasn't, nothing more is sent until the
+ * statuses of those after it are in: they are refused too, and the whole tail is sent again from the first refused chunk.
+ */
+int CC2540Communicator::txBulkWriteNoRsp(unsigned short connHandle, unsigned short attrHandle, const unsigned char* data, size_t length, BulkWriteResult* result)
+{
+    // The L2CAP (4 bytes) and ATT (3 bytes) headers share the data packet. 20 bytes with the default ATT MTU of 23.
+    size_t chunksize = (_data_pkt_len > 8) ? _data_pkt_len - 7 : 1;
+    if(chunksize > 20)
+        chunksize = 20;
+
+    size_t          chunks = (length + chunksize - 1) / chunksize;
+    unsigned char   capacity = (_num_data_pkts > 0) ? _num_data_pkts : 1;
+
+    // Without GAP_DeviceInitDone there's no buffer count: one chunk at a time then. Otherwise the running count is kept, as
+    // an earlier write may still hold buffers.
+    if(_num_data_pkts == 0 && _data_credits == 0)
+        _data_credits = capacity;
+
+    std::deque<size_t>  awaiting;           // Chunks sent whose Command Status hasn't come yet, oldest first.
+    size_t              next = 0, resendfrom = 0;
+    bool                refused = false, takenafter = false;
+
+    while(next < chunks || !awaiting.empty())
+    {
+        while(!refused && next < chunks && _data_credits > 0)
+        {
+            size_t offset = next * chunksize;
+            size_t part = (length - offset < chunksize) ? length - offset : chunksize;
+
+            HciCommandFrame<GattWriteNoRspCmd> frame;
+            frame.set<GattWriteNoRspCmd::ConnHandle>(connHandle)
+                 .set<GattWriteNoRspCmd::Handle>(attrHandle)
+                 .setTail<GattWriteNoRspCmd::Value>(data + offset, part);
+
+            if(!txSendFrame(frame, "Could not transfer a Write Without Response packet."))
+                return Tx_TxUnsuccessful;
+
+            _data_credits--;
+            awaiting.push_back(next++);
+        }
+
+        std::vector<unsigned char> rxdata;
+        int recvret = rxPacket(&rxdata);
+        if(recvret < 0)
+            return recvret;
+
+        // Given back buffers, notifications and the like were already taken care of by rxPacket().
+        HciEventView<GapHciExtCommandStatusEvt> status(rxdata.data(), rxdata.size());
+        bool ours = rxdata.size() > 1 && rxdata[1] == RX_HCI_LE_EXTEVENT && status.complete() &&
+                    status.value<GapEventHeader::Event>() == GAP_HCI_ExtentionCommandStatus &&
+                    status.value<GapHciExtCommandStatusEvt::OpCode>() == GATT_WriteNoRsp;
+
+        if(!ours || awaiting.empty())
+        {
+            if(recvret != Tx_Success)
+                return recvret;
+            continue;
+        }
+
+        size_t chunk = awaiting.front();
+        awaiting.pop_front();
+
+        if(recvret == Tx_Success)
+        {
+            size_t offset = chunk * chunksize;
+            result->bytes_written  += (length - offset < chunksize) ? length - offset : chunksize;
+            result->chunks++;
+            if(refused)
+                takenafter = true;
+        }
+        else
+        {
+            // Refused: its buffer was never used.
+            if(_data_credits < capacity)
+                _data_credits++;
+            if(!refused)
+            {
+                refused     = true;
+                resendfrom  = chunk;
+            }
+            result->retries++;
+        }
+
+        if(refused && awaiting.empty())
+        {
+            if(takenafter)
+            {
+                setError("The controller refused a Write Without Response chunk but took later ones. The data would be out of order.");
+                return Tx_TxUnsuccessful;
+            }
+            next    = resendfrom;
+            refused = false;
+        }
+    }
+
+    // Every chunk was taken. The buffers coming back are waited for, but only so long: if a Number Of Completed Packets
+    // event is lost, the data has been sent all the same, and the count starts over from all of them.
+    timespec            drainstart, now;
+    clock_gettime(CLOCK_MONOTONIC, &drainstart);
+
+    while(_data_credits < capacity)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long waited = (now.tv_sec - drainstart.tv_sec) * 1000 + (now.tv_nsec - drainstart.tv_nsec) / 1000000;
+
+        bool timedout = waited >= BULK_DRAIN_TIMEOUT_MS;
+        FrameRef recvframe;
+        if(!timedout)
+            recvframe = recvFrame(BULK_DRAIN_TIMEOUT_MS - waited, &timedout);
+        if(timedout)
+        {
+            _data_credits = capacity;
+            break;
+        }
+
+        int recvret = rxInterpret(recvframe, NULL);
+        if(recvret < 0)
+            return recvret;
+    }
+
+    return Tx_Success;
+}
+
+/**
+ * Prepared writes: GATT_WriteLongCharValue splits each part in Prepare Write requests, and it's done once the peer answers
+ * the Execute Write. Only one such procedure runs at a time on a link, so parts go one after another.
+ */
+int CC2540Communicator::txBulkWriteLong(unsigned short connHandle, unsigned short attrHandle, const unsigned char* data, size_t length, BulkWriteResult* result)
+{
+    if(length > 512)
+    {
+        setError("A reliable bulk write can't be longer than 512 bytes, the largest attribute value.");
+        return Tx_TxUnsuccessful;
+    }
+
+    for(size_t offset = 0; offset < length; offset += GattWriteLongCharValueCmd::Value::max_size)
+    {
+        size_t part = length - offset;
+        if(part > GattWriteLongCharValueCmd::Value::max_size)
+            part = GattWriteLongCharValueCmd::Value::max_size;
+
+        HciCommandFrame<GattWriteLongCharValueCmd> frame;
+        frame.set<GattWriteLongCharValueCmd::ConnHandle>(connHandle)
+             .set<GattWriteLongCharValueCmd::Handle>(attrHandle)
+             .set<GattWriteLongCharValueCmd::Offset>(offset)
+             .setTail<GattWriteLongCharValueCmd::Value>(data + offset, part);
+
+        if(!txSendFrame(frame, "Could not transfer a Write Long Characteristic Value packet."))
+            return Tx_TxUnsuccessful;
+
+        // Waits for acknowledgement, the Prepare Write Responses and ATT_ExecuteWriteRsp.
+        int recvret = rxPacket();
+        if(recvret != Tx_Success)
+            return recvret;
+
+        result->bytes_written  += part;
+        result->chunks++;
+    }
+
+    return Tx_Success;
+}
+
+/**
+ * Decodes a Handle Value Notification / Indication where it is, in the received frame, and queues it in its link's
+ * batch. Indications are confirmed right away: the peer sends nothing else on that link until then.
+ */
+bool CC2540Communicator::rxDeliverNotification(const FrameRef& frame, bool indication)
+{
+    HciEventView<AttHandleValueEvt> event(frame.data(), frame.size());
+    if(!event.complete())
+        return false;
+
+    GattNotification notification;
+    notification.conn_handle    = event.value<AttHandleValueEvt::ConnHandle>();
+    notification.attr_handle    = event.value<AttHandleValueEvt::Handle>();
+    notification.indication     = indication;
+    notification.value          = event.tail<AttHandleValueEvt::Value>();
+    notification.length         = event.tailLength<AttHandleValueEvt::Value>();
+    notification.frame          = frame;
+
+    if(indication)
+    {
+        HciCommandFrame<AttHandleValueConfirmationCmd> confirmation;
+        confirmation.set<AttHandleValueConfirmationCmd::ConnHandle>(notification.conn_handle);
+        try
+        {
+            txSendFrame(confirmation, "Could not confirm an indication.");
+        }
+        catch(std::string error)
+        {
+            /// Maybe called from the receiver thread: the error is only recorded.
+        }
+    }
+
+    pthread_mutex_lock(&_notification_mutex);
+    if(_notification_listener == NULL)
+    {
+        pthread_mutex_unlock(&_notification_mutex);
+        return true;
+    }
+
+    NotificationBatch* batch = NULL;
+    for(size_t i = 0; i < _notification_batches.size(); i++)
+    {
+        if(_notification_batches[i].conn_handle == notification.conn_handle)
+        {
+            batch = &(_notification_batches[i]);
+            break;
+        }
+    }
+    if(batch == NULL)
+    {
+        _notification_batches.push_back(NotificationBatch());
+        batch = &(_notification_batches.back());
+        batch->conn_handle = notification.conn_handle;
+        batch->items.reserve(_notification_batch_size);
+    }
+
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(batch->items.empty())
+    {
+        batch->first = now;
+        pthread_cond_signal(&_notification_cond);
+    }
+    batch->items.push_back(notification);
+
+    double waited = (now.tv_sec - batch->first.tv_sec) * 1000.0 + (now.tv_nsec - batch->first.tv_nsec) / 1000000.0;
+    if(batch->items.size() >= _notification_batch_size || waited >= _notification_max_delay_ms)
+        flushBatch(*batch);
+
+    pthread_mutex_unlock(&_notification_mutex);
+    return true;
+}
+
+/**
+ * Hands a batch to the listener and empties it. _notification_mutex must be held.
+ */
+void CC2540Communicator::flushBatch(NotificationBatch& batch)
+{
+    if(batch.items.empty())
+        return;
+
+    if(_notification_listener != NULL)
+        _notification_listener->atNotifications(batch.conn_handle, &(batch.items[0]), batch.items.size());
+
+    // Clearing gives the frames back to the pool.
+    batch.items.clear();
+}
+
+void* __notificationFlushEntry(void* castedCommunicator)
+{
+    static_cast<CC2540Communicator*>(castedCommunicator)->notificationFlushMethod();
+    return NULL;
+}
+
+/**
+ * Main loop of the flusher thread: sleeps until the oldest pending batch is due, and hands over those that are.
+ */
+void CC2540Communicator::notificationFlushMethod()
+{
+    pthread_mutex_lock(&_notification_mutex);
+    while(_notification_flusher_running)
+    {
+        timespec    now, due;
+        bool        pending = false;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        for(size_t i = 0; i < _notification_batches.size(); i++)
+        {
+            NotificationBatch& batch = _notification_batches[i];
+            if(batch.items.empty())
+                continue;
+
+            timespec batchdue = batch.first;
+            batchdue.tv_sec    += _notification_max_delay_ms / 1000;
+            batchdue.tv_nsec   += (_notification_max_delay_ms % 1000) * 1000000L;
+            if(batchdue.tv_nsec >= 1000000000L)
+            {
+                batchdue.tv_sec++;
+                batchdue.tv_nsec -= 1000000000L;
+            }
+
+            if(batchdue.tv_sec < now.tv_sec || (batchdue.tv_sec == now.tv_sec && batchdue.tv_nsec <= now.tv_nsec))
+            {
+                flushBatch(batch);
+            }
+            else if(!pending || batchdue.tv_sec < due.tv_sec || (batchdue.tv_sec == due.tv_sec && batchdue.tv_nsec < due.tv_nsec))
+            {
+                due     = batchdue;
+                pending = true;
+            }
+        }
+
+        if(pending)
+            pthread_cond_timedwait(&_notification_cond, &_notification_mutex, &due);
+        else
+            pthread_cond_wait(&_notification_cond, &_notification_mutex);
+    }
+    pthread_mutex_unlock(&_notification_mutex);
+}
+
+void CC2540Communicator::setNotificationListener(NotificationListener* listener, unsigned int batchSize, unsigned int maxDelayMs)
+{
+    pthread_mutex_lock(&_notification_mutex);
+    for(size_t i = 0; i < _notification_batches.size(); i++)
+        flushBatch(_notification_batches[i]);
+
+    _notification_listener      = listener;
+    _notification_batch_size    = (batchSize > 0) ? batchSize : 1;
+    _notification_max_delay_ms  = maxDelayMs;
+
+    // The flusher is only needed while there's a listener to hand batches to.
+    bool flusher = (listener != NULL);
+    if(flusher && !_notification_flusher_running)
+    {
+        _notification_flusher_running = true;
+        pthread_create(&_notification_flusher, NULL, __notificationFlushEntry, this);
+    }
+    else if(!flusher && _notification_flusher_running)
+    {
+        _notification_flusher_running = false;
+        pthread_cond_signal(&_notification_cond);
+        pthread_mutex_unlock(&_notification_mutex);
+
+        pthread_join(_notification_flusher, NULL);
+        return;
+    }
+    else
+    {
+        // A new delay: the flusher works out its wait again.
+        pthread_cond_signal(&_notification_cond);
+    }
+    pthread_mutex_unlock(&_notification_mutex);
+}
+
+void CC2540Communicator::flushNotifications()
+{
+    pthread_mutex_lock(&_notification_mutex);
+    for(size_t i = 0; i < _notification_batches.size(); i++)
+        flushBatch(_notification_batches[i]);
+    pthread_mutex_unlock(&_notification_mutex);
+}
+
+bool CC2540Communicator::startNotificationStream()
+{
+    _notification_streaming = true;
+    if(!turnOnAutomaticReceiving())
+    {
+        _notification_streaming = false;
+        return false;
+    }
+    return true;
+}
+
+void CC2540Communicator::stopNotificationStream()
+{
+    turnOffAutomaticReceiving();
+    _notification_streaming = false;
+    flushNotifications();
+}
+
+/**
+ * Streaming mode receive path, in the receiver thread. Only notifications are handled in full; link events keep the
+ * link list up to date, and anything else just closes the pending batches.
+ */
+void CC2540Communicator::atReceiving(const FrameRef& frame)
+{
+    if(!_notification_streaming)
+        return;
+
+    HciEventView<GapEventHeader> header(frame.data(), frame.size());
+    if(!header.complete() || header.value<HciEventHeader::EventCode>() != RX_HCI_LE_EXTEVENT)
+        return;
+
+    unsigned short event = header.value<GapEventHeader::Event>();
+    if(event == ATT_HandleValueNotification || event == ATT_HandleValueIndication)
+    {
+        if(!rxDeliverNotification(frame, event == ATT_HandleValueIndication))
+            Metrics::count(Metric_RxTooShort);
+        return;
+    }
+
+    flushNotifications();
+
+    if(event == GAP_TerminateLink)
+    {
+        HciEventView<GapTerminateLinkEvt> terminate(frame.data(), frame.size());
+        if(terminate.complete())
+            forgetLink(terminate.value<GapTerminateLinkEvt::ConnHandle>());
+    }
+    else if(event == GAP_LinkParamUpdate)
+    {
+        rxInterpretLinkParamUpdate(frame.data(), frame.size());
+    }
+}
+
+int CC2540Communicator::txConfigureDeviceAddress(unsigned char addrMode, MacAddress address)
+{
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Sent configure device address (mode: " << (int) addrMode << ")" << std::endl;
+    #endif
+
+    HciCommandFrame<GapConfigureDeviceAddressCmd> frame;
+    frame.set<GapConfigureDeviceAddressCmd::AddrMode>(addrMode)
+         .set<GapConfigureDeviceAddressCmd::Addr>(address.addr);
+
+    if(!txSendFrame(frame, "Could not transfer the Configure Device Address packet."))
+        return Tx_TxUnsuccessful;
+
+    return rxPacket();
+}
+
+int CC2540Communicator::txMakeDiscoverable(unsigned char eventType, unsigned char channelMap, unsigned char filterPolicy)
+{
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Sent make discoverable." << std::endl;
+    #endif
+
+    HciCommandFrame<GapMakeDiscoverableCmd> frame;
+    frame.set<GapMakeDiscoverableCmd::EventType>(eventType)
+         .set<GapMakeDiscoverableCmd::InitiatorAddrType>(0x00)         // Only used by directed advertising.
+         .set<GapMakeDiscoverableCmd::ChannelMap>(channelMap)
+         .set<GapMakeDiscoverableCmd::FilterPolicy>(filterPolicy);
+
+    if(!txSendFrame(frame, "Could not transfer the Make Discoverable packet."))
+        return Tx_TxUnsuccessful;
+
+    // Waits for acknowledgement and GAP_MakeDiscoverableDone (2 Rx Packets)
+    return rxPacket();
+}
+
+int CC2540Communicator::txUpdateAdvertisingData(unsigned char adType, const unsigned char* data, unsigned char length)
+{
+    if(!txQueueAdvertisingData(adType, data, length))
+        return Tx_TxUnsuccessful;
+
+    // Waits for acknowledgement and GAP_AdvertDataUpdateDone (2 Rx Packets)
+    return rxPacket();
+}
+
+bool CC2540Communicator::txQueueAdvertisingData(unsigned char adType, const unsigned char* data, unsigned char length)
+{
+    unsigned char datalength = length;
+    if(datalength > GapUpdateAdvertisingDataCmd::AdvertData::max_size)
+        datalength = GapUpdateAdvertisingDataCmd::AdvertData::max_size;
+
+    HciCommandFrame<GapUpdateAdvertisingDataCmd> frame;
+    frame.set<GapUpdateAdvertisingDataCmd::AdType>(adType)
+         .set<GapUpdateAdvertisingDataCmd::DataLength>(datalength)
+         .setTail<GapUpdateAdvertisingDataCmd::AdvertData>(data, length);
+
+    return txSendFrame(frame, "Could not transfer the Update Advertising Data packet.");
+}
+
+int CC2540Communicator::txEndDiscoverable()
+{
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Sent end discoverable." << std::endl;
+    #endif
+
+    HciCommandFrame<GapEndDiscoverableCmd> frame;
+    if(!txSendFrame(frame, "Could not transfer the End Discoverable packet."))
+        return Tx_TxUnsuccessful;
+
+    // Waits for acknowledgement and GAP_EndDiscoverableDone (2 Rx Packets)
+    return rxPacket();
+}
+
+int CC2540Communicator::txGetParam(GapParamId paramId, unsigned short* value)
+{
+    /* The value comes back inside the Command Status:
+     Event : 0x067F, Status, OpCode : 0xFE31, DataLength : 0x02, ParamValue (2 bytes) */
+
+    std::vector<unsigned char> rxdata;
+    int recvret;
+
+    HciCommandFrame<GapGetParamCmd> frame;
+    frame.set<GapGetParamCmd::ParamID>(paramId);
+
+    if(!txSendFrame(frame, "Could not transfer the Get Param packet."))
+        return Tx_TxUnsuccessful;
+
+    recvret = rxPacket(&rxdata);
+    if(recvret != Tx_Success)
+        return recvret;
+
+    HciEventView<GapHciExtCommandStatusEvt> status(rxdata.data(), rxdata.size());
+    if(!status.complete() || status.tailLength<GapHciExtCommandStatusEvt::Data>() < 2)
+    {
+        Metrics::count(Metric_RxTooShort);
+        return Tx_RxTooShort;
+    }
+
+    memcpy(value, status.tail<GapHciExtCommandStatusEvt::Data>(), 2);
+    return Tx_Success;
+}
+
+int CC2540Communicator::txSetParam(GapParamId paramId, unsigned short value)
+{
+    HciCommandFrame<GapSetParamCmd> frame;
+    frame.set<GapSetParamCmd::ParamID>(paramId)
+         .set<GapSetParamCmd::ParamValue>(value);
+
+    if(!txSendFrame(frame, "Could not transfer the Set Param packet."))
+        return Tx_TxUnsuccessful;
+
+    return rxPacket();
+}
+
+struct SetParamBatch
+{
+    typedef GapSetParamCmd Command;
+
+    const std::vector<GapParamSetting>& settings;
+
+    SetParamBatch(const std::vector<GapParamSetting>& toSet) : settings(toSet) {}
+
+    void build(HciCommandFrame<Command>& frame, size_t item) const
+    {
+        frame.set<GapSetParamCmd::ParamID>(settings[item].id)
+             .set<GapSetParamCmd::ParamValue>(settings[item].value);
+    }
+
+    int answer(size_t /*item*/, int status, const std::vector<unsigned char>& /*rxdata*/) const
+    {
+        return status;
+    }
+};
+
+struct GetParamBatch
+{
+    typedef GapGetParamCmd Command;
+
+    std::vector<GapParamSetting>*       settings;
+
+    GetParamBatch(std::vector<GapParamSetting>* toGet) : settings(toGet) {}
+
+    void build(HciCommandFrame<Command>& frame, size_t item) const
+    {
+        frame.set<GapGetParamCmd::ParamID>((*settings)[item].id);
+    }
+
+    // The answers don't say which parameter they are for: they come in the order the requests went.
+    int answer(size_t item, int status, const std::vector<unsigned char>& rxdata)
+    {
+        HciEventView<GapHciExtCommandStatusEvt> event(rxdata.data(), rxdata.size());
+        if(status == Tx_Success && (!event.complete() || event.tailLength<GapHciExtCommandStatusEvt::Data>() < 2))
+        {
+            Metrics::count(Metric_RxTooShort);
+            return Tx_RxTooShort;
+        }
+
+        if(status == Tx_Success)
+            memcpy(&((*settings)[item].value), event.tail<GapHciExtCommandStatusEvt::Data>(), 2);
+        return status;
+    }
+};
+
+int CC2540Communicator::txSetParams(const std::vector<GapParamSetting>& settings)
+{
+    SetParamBatch batch(settings);
+    return txPipelined(batch, settings.size(), "Could not transfer a Set Param packet.");
+}
+
+int CC2540Communicator::txGetParams(std::vector<GapParamSetting>* settings)
+{
+    GetParamBatch batch(settings);
+    return txPipelined(batch, settings->size(), "Could not transfer a Get Param packet.");
+}
+
+int CC2540Communicator::txApplyScanProfile(const ScanProfile& profile)
+{
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Applying scan profile " << profile.name << "." << std::endl;
+    #endif
+
+    std::vector<GapParamSetting> wanted = profile.toSettings();
+    int retval = txSetParams(wanted);
+    if(retval != Tx_Success)
+        return retval;
+
+    std::vector<GapParamSetting> readback = wanted;
+    retval = txGetParams(&readback);
+    if(retval != Tx_Success)
+        return retval;
+
+    for(size_t i = 0; i < wanted.size(); i++)
+    {
+        if(readback[i].value != wanted[i].value)
+        {
+            #ifdef CC2540_DEBUGMODE
+            std::cout << "Parameter " << (int) wanted[i].id << " is " << readback[i].value << ", not " << wanted[i].value << std::endl;
+            #endif
+            return Tx_ParamMismatch;
+        }
+    }
+
+    _scan_profile       = profile;
+    _scan_profile_set   = true;
+    return Tx_Success;
+}
+
+std::map<std::string, ScanProfileStats> CC2540Communicator::getScanProfileStats() const
+{
+    return _scan_profile_stats;
+}
+
+std::vector<LinkInfo> CC2540Communicator::getLinks() const
+{
+    pthread_mutex_lock(&_links_mutex);
+    std::vector<LinkInfo> retval(_links);
+    pthread_mutex_unlock(&_links_mutex);
+    return retval;
+}
+
+bool CC2540Communicator::getLink(unsigned short connHandle, LinkInfo* link) const
+{
+    bool found = false;
+
+    pthread_mutex_lock(&_links_mutex);
+    for(size_t i = 0; i < _links.size(); i++)
+    {
+        if(_links[i].conn_handle == connHandle)
+        {
+            *link = _links[i];
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_links_mutex);
+    return found;
+}
+
+void CC2540Communicator::forgetLink(unsigned short connHandle)
+{
+    // What the link sent before going away is still delivered.
+    pthread_mutex_lock(&_notification_mutex);
+    for(size_t i = 0; i < _notification_batches.size(); i++)
+    {
+        if(_notification_batches[i].conn_handle == connHandle)
+        {
+            flushBatch(_notification_batches[i]);
+            _notification_batches.erase(_notification_batches.begin() + i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_notification_mutex);
+
+    pthread_mutex_lock(&_links_mutex);
+    for(size_t i = 0; i < _links.size(); i++)
+    {
+        if(_links[i].conn_handle == connHandle)
+        {
+            _links.erase(_links.begin() + i);
+            Metrics::setGauge(Gauge_Links, _links.size());
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_links_mutex);
+}
+
+bool CC2540Communicator::restoreSession()
+{
+    /* After a reset the controller knows nothing: init again, then put back the white list, the links and the discovery
+     that were running. Link handles change, so getLinks() has the new ones afterwards. */
+
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Restoring session after the device came back." << std::endl;
+    #endif
+
+    bool restored = true;
+
+    if(txInitCommand(_profile_role) != Tx_Success)
+        return false;
+
+    if(!_white_list.empty() && txWhiteListBatch<HCI_LE_AddDeviceToWhiteList>(_white_list) != Tx_Success)
+        restored = false;
+
+    if(_scan_profile_set && txApplyScanProfile(_scan_profile) != Tx_Success)
+        restored = false;
+
+    pthread_mutex_lock(&_links_mutex);
+    std::vector<LinkInfo> previouslinks = _links;
+    _links.clear();
+    Metrics::setGauge(Gauge_Links, 0);
+    pthread_mutex_unlock(&_links_mutex);
+    for(size_t i = 0; i < previouslinks.size(); i++)
+    {
+        if(!txEstablishLink(previouslinks[i].dev_address, previouslinks[i].dev_addr_type).link_set)
+            restored = false;
+    }
+
+    if(_discovery_active)
+        txDeviceDiscovery(_discovery_mode, _discovery_active_scan, _discovery_white_list);
+
+    return restored;
+}
+
+bool CC2540Communicator::fastStart(const std::string& cachePath, uint16_t vendor, uint16_t product, int interface, uint8_t recv_endpoint_addr, uint8_t send_endpoint_addr)
+{
+    StartupCache    cache;
+    bool            cached = cache.load(cachePath) && cache.vendor == vendor && cache.product == product;
+    bool            opened = false;
+
+    // Straight to where the dongle was last time. If something else is there, enumerate everything.
+    if(cached)
+        opened = initAt(cache.bus, cache.ports, vendor, product, interface, recv_endpoint_addr, send_endpoint_addr);
+
+    #ifdef CC2540_DEBUGMODE
+    std::cout << (opened ? "Opened the device at its cached location." : "No usable startup cache. Enumerating USB devices.") << std::endl;
+    #endif
+
+    if(!opened && !init(vendor, product, interface, recv_endpoint_addr, send_endpoint_addr))
+        return false;
+
+    if(txInitCommand(_profile_role) != Tx_Success)
+        return false;
+
+    // The identity GAP_DeviceInitDone just gave is checked against the one from the last run.
+    bool stale = !opened || !cache.identity_valid ||
+                 memcmp(_device_mac_reversed, cache.device_mac_reversed, 6) != 0 ||
+                 memcmp(_device_irk, cache.device_irk, 16) != 0 ||
+                 memcmp(_device_csrk, cache.device_csrk, 16) != 0;
+
+    if(stale)
+    {
+        cache.vendor            = vendor;
+        cache.product           = product;
+        cache.identity_valid    = true;
+        memcpy(cache.device_mac_reversed, _device_mac_reversed, 6);
+        memcpy(cache.device_irk, _device_irk, 16);
+        memcpy(cache.device_csrk, _device_csrk, 16);
+
+        // A cache without the location can't be loaded: nothing is saved if it's not known.
+        bool located = getDeviceLocation(&(cache.bus), &(cache.ports));
+        if(located)
+            cache.save(cachePath);
+    }
+
+    return true;
+}
+
+MacAddress CC2540Communicator::getDeviceAddress() const
+{
+    MacAddress retval;
+    memcpy(retval.addr, _device_mac_reversed, 6);
+    return retval;
+}
+
+void CC2540Communicator::getDeviceKeys(unsigned char* irk, unsigned char* csrk) const
+{
+    if(irk)
+        memcpy(irk, _device_irk, 16);
+    if(csrk)
+        memcpy(csrk, _device_csrk, 16);
+}
+
+void CC2540Communicator::setEventWorkerPool(EventWorkerPool* pool)
+{
+    _worker_pool = pool;
+}
+
+void CC2540Communicator::setRssiStore(RssiStore* store)
+{
+    _rssi_store = store;
+}
+
+void CC2540Communicator::setIrkResolver(IrkResolver* resolver)
+{
+    _irk_resolver = resolver;
+}
+
+void CC2540Communicator::setDiscoveryExporter(DiscoveryExporter* exporter)
+{
+    _discovery_exporter = exporter;
 }
@@ -2,13 +2,20 @@
 #define CC2540COMMUNICATOR_H
 
 #include "serialcommunicator.h"
+#include "gapschema.h"
 
 #include <vector>
+#include <map>
+#include <set>
+#include <string>
 #include <cstdio>
+#include <pthread.h>
+#include <time.h>
 
-#define TX_TYPE_COMMAND     0x01
-#define RX_TYPE_EVENT       0x04
-#define RX_HCI_LE_EXTEVENT  0xFF
+class EventWorkerPool;
+class RssiStore;
+class IrkResolver;
+class DiscoveryExporter;
 
 #define CC2540_DEBUGMODE
 
@@ -20,43 +27,95 @@ enum TxErrors
     Tx_Success              = 0,
     Tx_TxUnsuccessful       = -1,
     Tx_RxMalformed          = -2,
-    Tx_RxTooShort           = -3
+    Tx_RxTooShort           = -3,
+    Tx_ParamMismatch        = -4
+};
+
+struct MacAddress
+{
+    unsigned char addr[6];
+    std::string toString() const;
+
+    static const char hexDigits[17];    // "0123456789ABCDEF", for formatting addresses and data without streams.
+
+    /**
+     * Packs an address (as it comes in the packets, reversed) into an integer key, for sets and maps.
+     */
+    static uint64_t keyOf(const unsigned char* addr);
+    uint64_t        key() const { return keyOf(addr); }
+};
+
+struct WhiteListEntry
+{
+    unsigned char   addr_type;
+    MacAddress      address;
 };
 
 /**
- * Transmission Opcodes.
+ * Host-side filter for GAP_DeviceInformation events. It's checked against the raw packet, before anything is copied or stored,
+ * so rejected advertisers cost nothing more than reading the header.
  */
-enum TxOpcode
+struct DiscoveryFilter
 {
-    GAP_DeviceInit                      = 0xFE00,
-    GAP_ConfigureDeviceAddress          = 0xFE03,
-    GAP_DeviceDiscoveryRequest          = 0xFE04,
-    GAP_MakeDiscoverable                = 0xFE06,
-    GAP_UpdateAdvertisingData           = 0xFE07,
-    GAP_EndDiscoverable                 = 0xFE08,
-    GAP_EstablishLinkRequest            = 0xFE09,
-    GAP_TerminateLinkRequest            = 0xFE0A,
-    GAP_GetParam                        = 0xFE31
+    bool                        enabled;
+    std::vector<unsigned int>   oui_prefixes;       // 24-bit OUIs (e.g. 0x001830). Empty means any.
+    unsigned char               addr_type_mask;     // Bit (1 << AddressType) set for every accepted type.
+    signed char                 rssi_floor;         // Advertisers weaker than this (dBm) are dropped.
+
+    DiscoveryFilter();
+};
+
+struct GapParamSetting
+{
+    GapParamId      id;
+    unsigned short  value;
+
+    GapParamSetting(GapParamId paramId = TGAP_GEN_DISC_SCAN, unsigned short paramValue = 0) : id(paramId), value(paramValue) {}
 };
 
 /**
- * Received event codes.
+ * Named set of scan parameters, applied to both general and limited discovery. Interval and window are in 0.625 ms units:
+ * the radio listens window / interval of the time, for duration_ms.
  */
-enum RxEvent
+struct ScanProfile
 {
-    GAP_DeviceInitDone                  = 0x0600,
-    GAP_DeviceDiscoveryDone             = 0x0601,
-    GAP_EstablishLink                   = 0x0605,
-    GAP_TerminateLink                   = 0x0606,
-    GAP_LinkParamUpdate                 = 0x0607,
-    GAP_DeviceInformation               = 0x060D,
-    GAP_HCI_ExtentionCommandStatus      = 0x067F
+    std::string     name;
+    unsigned short  duration_ms;
+    unsigned short  scan_interval;
+    unsigned short  scan_window;
+    bool            filter_duplicates;
+
+    /// Scans all the time, for a short while: the first advertiser shows up as soon as possible.
+    static ScanProfile  fastFirstResult();
+    /// 30 % duty cycle, for about five seconds.
+    static ScanProfile  balanced();
+    /// Under 1 % duty cycle, for the full ten seconds. Only catches frequent advertisers quickly.
+    static ScanProfile  lowDuty();
+
+    std::vector<GapParamSetting>    toSettings() const;
 };
 
-struct MacAddress
+/**
+ * Time from sending a discovery request to the first reported device, for the discoveries done under one profile.
+ */
+struct ScanProfileStats
 {
-    unsigned char addr[6];
-    std::string toString() const;
+    unsigned long   scans;
+    unsigned long   scans_with_devices;
+    double          first_device_avg_ms, first_device_min_ms, first_device_max_ms;
+};
+
+/**
+ * Outcome of txBulkWrite(). The time runs from the first chunk sent until the controller gave back the buffer of the last,
+ * or until giving up waiting for it (a second at most, once every chunk was taken).
+ */
+struct BulkWriteResult
+{
+    size_t          bytes_written;
+    size_t          chunks;
+    size_t          retries;            // Chunks sent again because the controller had no buffer for them.
+    double          seconds;
+    double          bytes_per_second;
 };
 
 struct LinkInfo
@@ -67,6 +126,51 @@ struct LinkInfo
     unsigned short  conn_handle, conn_interval, conn_latency, conn_timeout;
 };
 
+/**
+ * One ATT Handle Value Notification or Indication. value points straight into the received frame, and frame keeps it
+ * alive: to keep a notification after the callback returns, keep a copy of it (which shares the frame), not of value.
+ */
+struct GattNotification
+{
+    unsigned short          conn_handle;
+    unsigned short          attr_handle;
+    bool                    indication;
+    const unsigned char*    value;
+    unsigned char           length;
+    FrameRef                frame;
+};
+
+/**
+ * Receives the notifications and indications of every link. Each call has the pending ones of a single link, oldest
+ * first. Indications are confirmed before being delivered. Don't call flushNotifications() from here.
+ */
+class NotificationListener
+{
+public:
+    virtual ~NotificationListener() {}
+    virtual void    atNotifications(unsigned short connHandle, const GattNotification* batch, size_t count) = 0;
+};
+
+/**
+ * Decides which advertiser txAutoConnect() connects to. It's asked for every connectable advertising report, from the
+ * receive path, so it should be quick. data is the advertising (or scan response) data.
+ */
+class AutoConnectPredicate
+{
+public:
+    virtual ~AutoConnectPredicate() {}
+    virtual bool    matches(const MacAddress& address, unsigned char addrType, signed char rssi, const unsigned char* data, size_t length) = 0;
+};
+
+/**
+ * When txAutoConnect() got there, in milliseconds from the discovery request.
+ */
+struct AutoConnectTiming
+{
+    double          sighting_ms;        // The matching advertisement arrived.
+    double          link_ms;            // GAP_EstablishLink arrived.
+};
+
 class CC2540Communicator : public SerialCommunicator
 {
 private:
@@ -75,14 +179,119 @@ private:
 
     unsigned char                   _device_mac_reversed[6];
 
+    unsigned short                  _data_pkt_len;
+    unsigned char                   _num_data_pkts;
+
+    /// Data packets the controller still has a buffer for. Taken by every ATT write sent, given back by Number Of Completed Packets.
+    unsigned char                   _data_credits;
+
     std::vector<MacAddress>         _discovered_devices;
 
-    void            rxInterpretDeviceInit(std::vector<unsigned char> data);
-    void            rxInterpretDeviceInformation(std::vector<unsigned char> data);
-    void            rxInterpretEstablishLink(std::vector<unsigned char> data, LinkInfo *linforeturner);
+    DiscoveryFilter                 _discovery_filter;
+    unsigned int                    _filtered_devices;
+
+    unsigned char                   _hci_cmd_credits;
+
+    /// What restoreSession() needs to bring the device back to where it was.
+    unsigned char                   _profile_role;
+    std::vector<WhiteListEntry>     _white_list;
+    std::vector<LinkInfo>           _links;             // Also changed by the receiver thread: under _links_mutex.
+    mutable pthread_mutex_t         _links_mutex;
+    bool                            _discovery_active;
+    DiscoveryMode                   _discovery_mode;
+    bool                            _discovery_active_scan, _discovery_white_list;
+    bool                            _scan_profile_set;
+    ScanProfile                     _scan_profile;
+
+    std::map<std::string, ScanProfileStats> _scan_profile_stats;
+    timespec                        _discovery_started;
+    bool                            _first_device_seen;
+
+    void            forgetLink(unsigned short connHandle);
+    int             rxInterpret(FrameRef recvframe, std::vector<unsigned char>* rxdata);    // rxPacket() for a frame already received.
+
+    /// Auto-connect: watching the advertisers, then cancelling the discovery once one matched, then connecting to it.
+    enum AutoConnectState
+    {
+        AutoConnect_Off,
+        AutoConnect_Watching,
+        AutoConnect_Cancelling,
+        AutoConnect_Linking
+    };
+
+    AutoConnectState                _autoconnect_state;
+    std::set<uint64_t>              _autoconnect_targets;
+    AutoConnectPredicate*           _autoconnect_predicate;
+    MacAddress                      _autoconnect_address;
+    unsigned char                   _autoconnect_addr_type;
+    LinkInfo                        _autoconnect_link;
+    AutoConnectTiming               _autoconnect_timing;
+
+    LinkInfo        txAutoConnectRun(DiscoveryMode mode, bool activeScan, AutoConnectTiming* timing);
+    std::vector<MacAddress> txDeviceDiscoveryRun(DiscoveryMode mode, bool activeScan, bool useWhiteList);
+    bool            rxAutoConnectMatches(const unsigned char* packet, size_t length);
+    double          msSinceDiscoveryStarted() const;
+
+    EventWorkerPool*                _worker_pool;
+    RssiStore*                      _rssi_store;
+    IrkResolver*                    _irk_resolver;
+    DiscoveryExporter*              _discovery_exporter;
+
+    /// Notifications waiting to be delivered, one batch per link. The vectors keep their capacity between batches.
+    struct NotificationBatch
+    {
+        unsigned short                  conn_handle;
+        std::vector<GattNotification>   items;
+        timespec                        first;
+    };
+
+    NotificationListener*           _notification_listener;
+    unsigned int                    _notification_batch_size;
+    unsigned int                    _notification_max_delay_ms;
+    std::vector<NotificationBatch>  _notification_batches;
+    pthread_mutex_t                 _notification_mutex;
+    bool                            _notification_streaming;
+
+    /// Hands over the batches that waited maxDelayMs when no further notification comes to do it.
+    pthread_t                       _notification_flusher;
+    bool                            _notification_flusher_running;
+    pthread_cond_t                  _notification_cond;
+
+    bool            rxDeliverNotification(const FrameRef& frame, bool indication);
+    void            flushBatch(NotificationBatch& batch);
+    void            notificationFlushMethod();
+
+    friend void*    __notificationFlushEntry(void* castedCommunicator);
+
+    template <TxOpcode Opcode>
+    int             txWhiteListBatch(const std::vector<WhiteListEntry>& entries);
+    template <class Batch>
+    int             txPipelined(Batch& batch, size_t count, const char* errormessage);
+    bool            passesDiscoveryFilter(const unsigned char* packet, size_t length) const;
+
+    /**
+     * Sends a packet built with HciCommandFrame, setting an error if nothing could be sent.
+     */
+    template <typename Command>
+    bool            txSendFrame(HciCommandFrame<Command>& frame, const char* errormessage);
+
+    int             txBulkWriteNoRsp(unsigned short connHandle, unsigned short attrHandle, const unsigned char* data, size_t length, BulkWriteResult* result);
+    int             txBulkWriteLong(unsigned short connHandle, unsigned short attrHandle, const unsigned char* data, size_t length, BulkWriteResult* result);
+
+    void            rxInterpretDeviceInit(const unsigned char* packet, size_t length);
+    void            rxInterpretDeviceInformation(const unsigned char* packet, size_t length);
+    void            rxInterpretEstablishLink(const unsigned char* packet, size_t length, LinkInfo *linforeturner);
+    bool            rxInterpretLinkParamUpdate(const unsigned char* packet, size_t length);
+
+protected:
+    /**
+     * Replays the initialization, white list, scan profile, links and running discovery after the device came back (see enableHotplugRecovery()).
+     */
+    virtual bool    restoreSession();
 
 public:
     CC2540Communicator();
+    ~CC2540Communicator();
 
     /**
      * Low level function to send a packet. Its more intended for internal use, or if there is a function not programmed in this class yet.
@@ -95,22 +304,223 @@ public:
     int             rxPacket();
     int             rxPacket(std::vector<unsigned char>* rxdata);
 
+    /**
+     * Same as above, waiting at most deadlineMs for the packet instead of recv_deadline_ms (see UsbRecoveryConfig). Throws
+     * if none comes in time.
+     */
+    int             rxPacket(std::vector<unsigned char>* rxdata, unsigned int deadlineMs);
+
     /**
      * High level function to signal the CC2540 to start operating.
      */
     int             txInitCommand();
 
+    /**
+     * Same as above, with a given GAP role (see ProfileRole). txInitCommand() uses Role_Central.
+     */
+    int             txInitCommand(unsigned char profileRole);
+
+    /**
+     * init() plus txInitCommand(), starting from what was cached in cachePath by the last run: the device is opened straight
+     * at its last bus/port location (falling back to a full enumeration if it's not there). The cache is rewritten whenever
+     * the location or the identity GAP_DeviceInitDone reports turn out to be stale.
+     */
+    bool            fastStart(const std::string& cachePath, uint16_t vendor, uint16_t product, int interface, uint8_t recv_endpoint_addr, uint8_t send_endpoint_addr);
+
+    /**
+     * The controller identity reported by GAP_DeviceInitDone. Keys are 16 bytes each.
+     */
+    MacAddress      getDeviceAddress() const;
+    void            getDeviceKeys(unsigned char* irk, unsigned char* csrk) const;
+
     /**
      * Searches discoverable BLE devices for a while and stores their addresses internally. To view them, use getDiscoveredDevices().
      */
     std::vector<MacAddress> txDeviceDiscovery();
 
+    /**
+     * Same as above, but lets you choose the discovery mode, and whether the controller should only report white-listed advertisers.
+     */
+    std::vector<MacAddress> txDeviceDiscovery(DiscoveryMode mode, bool activeScan, bool useWhiteList);
+
     /**
      * Establishes a communication Link with a remote device.
      */
     LinkInfo        txEstablishLink(MacAddress remoteDevice);
+    LinkInfo        txEstablishLink(MacAddress remoteDevice, unsigned char addrType);
     int             txTerminateLinkRequest(LinkInfo remoteLink);
 
+    /**
+     * Asks for new connection parameters on a link: interval in 1.25 ms units (7.5 ms to 4 s), slave latency in connection
+     * events, supervision timeout in 10 ms units. The tracked link (see getLinks()) is updated once the change is done.
+     */
+    int             txUpdateLinkParams(unsigned short connHandle, unsigned short intervalMin, unsigned short intervalMax, unsigned short connLatency, unsigned short connTimeout);
+
+    /**
+     * Writes a characteristic value on the peer (GATT_WriteCharValue), waiting for its Write Response.
+     */
+    int             txWriteCharValue(unsigned short connHandle, unsigned short attrHandle, const unsigned char* value, unsigned char length);
+
+    /**
+     * Turns notifications (or indications) on or off by writing the Client Characteristic Configuration descriptor at
+     * cccdHandle. They're delivered to the NotificationListener (see setNotificationListener()).
+     */
+    int             txSubscribe(unsigned short connHandle, unsigned short cccdHandle, bool indications = false);
+    int             txUnsubscribe(unsigned short connHandle, unsigned short cccdHandle);
+
+    /**
+     * Writes a long payload to a characteristic, split in Write Without Response chunks (20 bytes, or what the controller's
+     * data packets allow). Chunks are sent without waiting for each other, as many as the controller has data buffers for
+     * (NumDataPkts of GAP_DeviceInitDone), so the link is the only limit. Chunks the controller had no room for are sent
+     * again, in order. Returns once the controller sent every chunk.
+     *
+     * With reliable set, the payload goes with prepared writes instead (GATT_WriteLongCharValue), each part acknowledged by
+     * the peer, and written at its offset in the attribute: at most 512 bytes then.
+     */
+    int             txBulkWrite(unsigned short connHandle, unsigned short attrHandle, const unsigned char* data, size_t length,
+                                BulkWriteResult* result = NULL, bool reliable = false);
+
+    /**
+     * Discovers and connects to the first advertiser among targets (or accepted by predicate), as soon as it's heard: the
+     * discovery is cancelled from the receive path, and the link requested when the controller is done cancelling, with
+     * the address type the advertisement came with. Only one discovery is run; the returned link isn't set if no
+     * advertiser matched by its end. timing, if given, says when the advertiser was seen and the link was up.
+     */
+    LinkInfo        txAutoConnect(const std::vector<MacAddress>& targets, DiscoveryMode mode = Discovery_All, bool activeScan = false,
+                                  AutoConnectTiming* timing = NULL);
+    LinkInfo        txAutoConnect(AutoConnectPredicate* predicate, DiscoveryMode mode = Discovery_All, bool activeScan = false,
+                                  AutoConnectTiming* timing = NULL);
+
+    /**
+     * Lets the controller connect to the first white-listed device it hears from.
+     */
+    LinkInfo        txEstablishLinkWhiteList();
+
+    /**
+     * Controller white list management. Entries are sent back to back, as many at a time as the controller accepts commands,
+     * and the first error returned by the device is given back.
+     */
+    int             txWhiteListAdd(const std::vector<WhiteListEntry>& entries);
+    int             txWhiteListRemove(const std::vector<WhiteListEntry>& entries);
+    int             txWhiteListClear();
+
+    /**
+     * Sets the address the device will use: 0x00 Public, 0x01 Static, 0x02 Private non-resolvable, 0x03 Private resolvable.
+     * The address is only used for the Static mode.
+     */
+    int             txConfigureDeviceAddress(unsigned char addrMode, MacAddress address);
+
+    /**
+     * Starts advertising. Event type: 0x00 connectable undirected, 0x02 scannable undirected, 0x03 non-connectable undirected.
+     * Channel map 0x07 uses the three advertising channels.
+     */
+    int             txMakeDiscoverable(unsigned char eventType, unsigned char channelMap, unsigned char filterPolicy);
+
+    /**
+     * Changes the advertising (adType 0x01) or scan response (adType 0x00) data. At most 31 bytes.
+     */
+    int             txUpdateAdvertisingData(unsigned char adType, const unsigned char* data, unsigned char length);
+
+    /**
+     * Only sends the Update Advertising Data command, without waiting for GAP_AdvertDataUpdateDone. Each call should be matched
+     * later by one rxPacket(), which returns when the next GAP_AdvertDataUpdateDone arrives. Used to pipeline updates.
+     */
+    bool            txQueueAdvertisingData(unsigned char adType, const unsigned char* data, unsigned char length);
+
+    /**
+     * Stops advertising.
+     */
+    int             txEndDiscoverable();
+
+    /**
+     * Reads or writes one of the GAP parameters (TGAP_ values in TI's gap.h).
+     */
+    int             txGetParam(GapParamId paramId, unsigned short* value);
+    int             txSetParam(GapParamId paramId, unsigned short value);
+
+    /**
+     * Same, for several parameters at once: the commands are sent back to back and answered together. txGetParams()
+     * fills in the values of the given settings.
+     */
+    int             txSetParams(const std::vector<GapParamSetting>& settings);
+    int             txGetParams(std::vector<GapParamSetting>* settings);
+
+    /**
+     * Sets the scan parameters of a profile, reads them back, and returns Tx_ParamMismatch if the controller didn't take
+     * them. Discoveries from then on are timed under the profile name (see getScanProfileStats()), and the profile is
+     * applied again if the device has to be restored.
+     */
+    int             txApplyScanProfile(const ScanProfile& profile);
+
+    /**
+     * Time-to-first-device measurements, by profile name. Discoveries done before any profile was applied are under "default".
+     */
+    std::map<std::string, ScanProfileStats> getScanProfileStats() const;
+
+    /**
+     * Sets the host-side filter applied to discovery events. Disabled by default.
+     */
+    void            setDiscoveryFilter(const DiscoveryFilter& filter);
+    DiscoveryFilter getDiscoveryFilter() const;
+
+    /**
+     * How many advertisers the host-side filter dropped since the last discovery started.
+     */
+    unsigned int    getFilteredDeviceCount() const;
+
+    /**
+     * Also hands every link event (keyed by connection handle) and discovery event (keyed by advertiser address) to the
+     * given pool, so the application can handle them on several threads. NULL, the default, turns it off.
+     */
+    void            setEventWorkerPool(EventWorkerPool* pool);
+
+    /**
+     * Records the RSSI of every advertisement seen while discovering, keyed by the advertiser address packed the same
+     * way as the worker pool keys (without bit 48). NULL, the default, turns it off.
+     */
+    void            setRssiStore(RssiStore* store);
+
+    /**
+     * Resolves the resolvable private addresses of the advertisers as they're seen, so the cache is warm when the
+     * application asks, and the RSSI of a bonded device is recorded under its identity address across address changes.
+     * NULL, the default, turns it off.
+     */
+    void            setIrkResolver(IrkResolver* resolver);
+
+    /**
+     * Hands every advertisement and scan response seen while discovering to the exporter, which streams them out.
+     * NULL, the default, turns it off.
+     */
+    void            setDiscoveryExporter(DiscoveryExporter* exporter);
+
+    /**
+     * Where notifications and indications go. They're decoded in place in the received frame and handed over in batches of
+     * up to batchSize per link, or sooner when the oldest has waited maxDelayMs, another kind of event comes, or
+     * flushNotifications() is called. Without a listener they're dropped (indications are still confirmed). Batches that
+     * time out are handed over from a thread of their own, so the listener may be called from it too, one batch at a time.
+     */
+    void            setNotificationListener(NotificationListener* listener, unsigned int batchSize = 4, unsigned int maxDelayMs = 10);
+    void            flushNotifications();
+
+    /**
+     * Streaming mode: the receiver thread takes every packet and delivers notifications as they come, instead of only
+     * while a tx function waits for its answer. While streaming, the tx functions that wait for an answer must not be used.
+     */
+    bool            startNotificationStream();
+    void            stopNotificationStream();
+
+    virtual void    atReceiving(const FrameRef& frame);
+
+    /**
+     * Gets the links currently established.
+     */
+    std::vector<LinkInfo>   getLinks() const;
+
+    /**
+     * Gets one link by connection handle. Returns false if there's no such link.
+     */
+    bool            getLink(unsigned short connHandle, LinkInfo* link) const;
+
     /**
      * Gets the addresses of the BLE devices discovered previously with txDeviceDiscovery().
      */
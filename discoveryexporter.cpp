@@ -0,0 +1,339 @@
+#include "discoveryexporter.h"
+
+#include <cstring>
+#include <ctime>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define EXPORT_FORMAT_VERSION   1
+#define EXPORT_RECORD_FIXED     18      // Record bytes after the length and before the data.
+#define EXPORT_MAX_LINE         (160 + 2 * 255)
+
+void* __exporterThreadEntry(void* castedExporter)
+{
+    static_cast<DiscoveryExporter*>(castedExporter)->threadMethod();
+    return NULL;
+}
+
+static inline char* appendText(char* out, const char* text)
+{
+    while(*text)
+        *(out++) = *(text++);
+    return out;
+}
+
+static inline char* appendDecimal(char* out, uint64_t value)
+{
+    char    digits[20];
+    int     count = 0;
+
+    do
+    {
+        digits[count++] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while(value > 0);
+
+    while(count > 0)
+        *(out++) = digits[--count];
+    return out;
+}
+
+static inline char* appendHex(char* out, const unsigned char* data, size_t length)
+{
+    for(size_t i = 0; i < length; i++)
+    {
+        *(out++) = MacAddress::hexDigits[data[i] >> 4];
+        *(out++) = MacAddress::hexDigits[data[i] & 0x0F];
+    }
+    return out;
+}
+
+static inline uint64_t readLE(const unsigned char* data, int bytes)
+{
+    uint64_t value = 0;
+    for(int i = bytes - 1; i >= 0; i--)
+        value = (value << 8) | data[i];
+    return value;
+}
+
+DiscoveryExporter::DiscoveryExporter(size_t bufferSize, unsigned int flushMs) :
+    _fd                 (-1),
+    _close_fd           (false),
+    _format             (Export_Binary),
+    _flush_ms           (flushMs),
+    _capacity           (bufferSize),
+    _filling_events     (0),
+    _running            (false),
+    _flush_requested    (false)
+{
+    memset(&_stats, 0, sizeof(_stats));
+
+    // Reserved once: records are appended without allocating, and the swap keeps both capacities.
+    _filling.reserve(_capacity);
+    _writing.reserve(_capacity);
+
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+}
+
+DiscoveryExporter::~DiscoveryExporter()
+{
+    stop();
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+bool DiscoveryExporter::open(const std::string& path, ExportFormat format)
+{
+    if(_running)
+        return false;
+
+    // A named pipe blocks here until the reader opens it.
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return false;
+
+    if(!start(fd, true, format))
+    {
+        close(fd);
+        return false;
+    }
+    return true;
+}
+
+bool DiscoveryExporter::open(int fd, ExportFormat format)
+{
+    if(_running || fd < 0)
+        return false;
+
+    return start(fd, false, format);
+}
+
+bool DiscoveryExporter::start(int fd, bool closeFd, ExportFormat format)
+{
+    _fd         = fd;
+    _close_fd   = closeFd;
+    _format     = format;
+    memset(&_stats, 0, sizeof(_stats));
+
+    if(_format == Export_Binary)
+    {
+        const unsigned char header[5] = { 'C', 'C', 'D', 'X', EXPORT_FORMAT_VERSION };
+        if(!writeAll(header, sizeof(header)))
+            return false;
+    }
+
+    _filling.clear();
+    _filling_events     = 0;
+    _flush_requested    = false;
+    _running            = true;
+    pthread_create(&_thread, NULL, __exporterThreadEntry, this);
+    return true;
+}
+
+void DiscoveryExporter::stop()
+{
+    pthread_mutex_lock(&_mutex);
+    if(!_running)
+    {
+        pthread_mutex_unlock(&_mutex);
+        return;
+    }
+    _running = false;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+
+    pthread_join(_thread, NULL);
+
+    if(_close_fd)
+        close(_fd);
+    _fd = -1;
+}
+
+void DiscoveryExporter::flush()
+{
+    pthread_mutex_lock(&_mutex);
+    _flush_requested = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void DiscoveryExporter::push(unsigned char eventType, unsigned char addrType, const MacAddress& address, signed char rssi,
+                             const unsigned char* data, size_t dataLength)
+{
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t timestamp = static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+
+    if(dataLength > 255)
+        dataLength = 255;
+    size_t recordlength = EXPORT_RECORD_FIXED + dataLength;
+
+    pthread_mutex_lock(&_mutex);
+
+    if(!_running || _stats.failed || _filling.size() + 2 + recordlength > _capacity)
+    {
+        _stats.dropped++;
+        pthread_mutex_unlock(&_mutex);
+        return;
+    }
+
+    size_t at = _filling.size();
+    _filling.resize(at + 2 + recordlength);
+    unsigned char* record = &(_filling[at]);
+
+    record[0] = recordlength & 0xFF;
+    record[1] = (recordlength >> 8) & 0xFF;
+    for(int i = 0; i < 8; i++)
+        record[2 + i] = (timestamp >> (8 * i)) & 0xFF;
+    record[10] = eventType;
+    record[11] = addrType;
+    memcpy(record + 12, address.addr, 6);
+    record[18] = static_cast<unsigned char>(rssi);
+    record[19] = static_cast<unsigned char>(dataLength);
+    if(dataLength > 0)
+        memcpy(record + 20, data, dataLength);
+
+    _filling_events++;
+    if(_filling.size() >= _capacity / 2)
+        pthread_cond_signal(&_cond);
+
+    pthread_mutex_unlock(&_mutex);
+}
+
+void DiscoveryExporter::threadMethod()
+{
+    // A closed pipe then fails the write() with EPIPE, instead of killing the process.
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+    pthread_mutex_lock(&_mutex);
+    for(;;)
+    {
+        if(_running && !_flush_requested && _filling.size() < _capacity / 2)
+        {
+            timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec    += _flush_ms / 1000;
+            deadline.tv_nsec   += (_flush_ms % 1000) * 1000000L;
+            if(deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&_cond, &_mutex, &deadline);
+        }
+
+        bool stopping = !_running;
+        unsigned long events = _filling_events;
+
+        _filling.swap(_writing);
+        _filling_events     = 0;
+        _flush_requested    = false;
+        pthread_mutex_unlock(&_mutex);
+
+        bool written = true;
+        if(!_writing.empty())
+        {
+            if(_format == Export_NDJson)
+            {
+                formatNDJson(&(_writing[0]), _writing.size());
+                written = _text.empty() || writeAll(&(_text[0]), _text.size());
+            }
+            else
+            {
+                written = writeAll(&(_writing[0]), _writing.size());
+            }
+        }
+        _writing.clear();
+
+        pthread_mutex_lock(&_mutex);
+        if(written)
+        {
+            _stats.exported += events;
+        }
+        else
+        {
+            _stats.failed    = true;
+            _stats.dropped  += events;
+        }
+
+        if(stopping)
+            break;
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+bool DiscoveryExporter::writeAll(const void* data, size_t length)
+{
+    const char* next = static_cast<const char*>(data);
+
+    // Only the writer thread writes, after start(): the stats are updated without the lock.
+    while(length > 0)
+    {
+        ssize_t done = write(_fd, next, length);
+        if(done < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+
+        __sync_fetch_and_add(&_stats.writes, 1);
+        __sync_fetch_and_add(&_stats.bytes_written, static_cast<unsigned long>(done));
+        next    += done;
+        length  -= done;
+    }
+    return true;
+}
+
+void DiscoveryExporter::formatNDJson(const unsigned char* records, size_t length)
+{
+    char line[EXPORT_MAX_LINE];
+
+    _text.clear();
+    for(size_t at = 0; at + 2 <= length; )
+    {
+        size_t                  recordlength = readLE(records + at, 2);
+        const unsigned char*    record = records + at + 2;
+        at += 2 + recordlength;
+
+        char* out = line;
+        out = appendText(out, "{\"ts\":");
+        out = appendDecimal(out, readLE(record, 8));
+        out = appendText(out, ",\"addr\":\"");
+        for(int i = 5; i >= 0; i--)
+        {
+            *(out++) = MacAddress::hexDigits[record[10 + i] >> 4];
+            *(out++) = MacAddress::hexDigits[record[10 + i] & 0x0F];
+            if(i > 0)
+                *(out++) = ':';
+        }
+        out = appendText(out, "\",\"addr_type\":");
+        out = appendDecimal(out, record[9]);
+        out = appendText(out, ",\"event_type\":");
+        out = appendDecimal(out, record[8]);
+        out = appendText(out, ",\"rssi\":");
+        signed char rssi = static_cast<signed char>(record[16]);
+        if(rssi < 0)
+            *(out++) = '-';
+        out = appendDecimal(out, (rssi < 0) ? -rssi : rssi);
+        out = appendText(out, ",\"data\":\"");
+        out = appendHex(out, record + 18, record[17]);
+        out = appendText(out, "\"}\n");
+
+        _text.insert(_text.end(), line, out);
+    }
+}
+
+DiscoveryExporterStats DiscoveryExporter::getStats()
+{
+    pthread_mutex_lock(&_mutex);
+    DiscoveryExporterStats retval = _stats;
+    pthread_mutex_unlock(&_mutex);
+    return retval;
+}
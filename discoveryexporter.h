@@ -0,0 +1,108 @@
+#ifndef DISCOVERYEXPORTER_H
+#define DISCOVERYEXPORTER_H
+
+#include "cc2540communicator.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+enum ExportFormat
+{
+    Export_Binary,
+    Export_NDJson
+};
+
+struct DiscoveryExporterStats
+{
+    unsigned long   exported;           // Events written out.
+    unsigned long   dropped;            // Events that found the buffer full, or came after a write failed.
+    unsigned long   writes;             // write() calls.
+    unsigned long   bytes_written;
+    bool            failed;             // Writing failed (a closed pipe, a full disk): nothing more is written.
+};
+
+/**
+ * Streams the advertisers seen while discovering to a file or a pipe, for a downstream pipeline.
+ *
+ * Every GAP_DeviceInformation event is appended as a compact record to a buffer, with no allocation or formatting on the
+ * receive path, and a thread writes the buffer out with a single write() when it's half full or every flushMs, while the
+ * events go to the other buffer. If the writer falls behind and both buffers fill up, events are dropped and counted:
+ * the receive path never waits for the disk.
+ *
+ * Export_Binary is a stream header ("CCDX", then the version, 1, as one byte) followed by records, little-endian:
+ *   u16 record length (what follows), u64 timestamp (microseconds since the epoch), u8 event type, u8 address type,
+ *   u8[6] address (least significant byte first, as the controller gives it), i8 RSSI, u8 data length, data.
+ * Export_NDJson is one JSON object per line: {"ts":...,"addr":"AA:BB:CC:DD:EE:FF","addr_type":0,"event_type":0,
+ *   "rssi":-60,"data":"0201..."}.
+ */
+class DiscoveryExporter
+{
+private:
+    int                         _fd;
+    bool                        _close_fd;
+    ExportFormat                _format;
+    unsigned int                _flush_ms;
+
+    std::vector<unsigned char>  _filling;           // Where new records go.
+    std::vector<unsigned char>  _writing;           // What the thread is writing out. Swapped with _filling.
+    std::vector<char>           _text;              // NDJSON, formatted on the writer thread.
+    size_t                      _capacity;
+    unsigned long               _filling_events;
+    DiscoveryExporterStats      _stats;
+
+    bool                        _running;
+    bool                        _flush_requested;
+    pthread_t                   _thread;
+    pthread_mutex_t             _mutex;
+    pthread_cond_t              _cond;
+
+    void            threadMethod();
+    bool            writeAll(const void* data, size_t length);
+    void            formatNDJson(const unsigned char* records, size_t length);
+
+    bool            start(int fd, bool closeFd, ExportFormat format);
+
+    friend void*    __exporterThreadEntry(void* castedExporter);
+
+    DiscoveryExporter(const DiscoveryExporter&);
+    DiscoveryExporter& operator = (const DiscoveryExporter&);
+
+public:
+    /**
+     * bufferSize is the size of each of the two buffers; at 30 to 60 bytes an event, the default holds tens of thousands.
+     */
+    DiscoveryExporter(size_t bufferSize = 1024 * 1024, unsigned int flushMs = 200);
+    ~DiscoveryExporter();
+
+    /**
+     * Opens (creating or truncating) a file, or a named pipe, and starts the writer thread.
+     */
+    bool            open(const std::string& path, ExportFormat format = Export_Binary);
+
+    /**
+     * Writes to a descriptor already open, like a pipe to another process, or 1 for stdout. It's left open at stop().
+     */
+    bool            open(int fd, ExportFormat format = Export_Binary);
+
+    /**
+     * Writes out what's buffered and stops the thread.
+     */
+    void            stop();
+
+    /**
+     * Asks for what's buffered to be written out now, without waiting for it.
+     */
+    void            flush();
+
+    /**
+     * Appends an event. Called from the receive path (see CC2540Communicator::setDiscoveryExporter()).
+     */
+    void            push(unsigned char eventType, unsigned char addrType, const MacAddress& address, signed char rssi,
+                         const unsigned char* data, size_t dataLength);
+
+    DiscoveryExporterStats getStats();
+};
+
+#endif // DISCOVERYEXPORTER_H
@@ -0,0 +1,228 @@
+#include "eventworkerpool.h"
+#include "metrics.h"
+
+void* __eventWorkerEntry(void* castedShard)
+{
+    EventWorkerPool::Shard* shard = static_cast<EventWorkerPool::Shard*>(castedShard);
+    shard->pool->workerMethod(shard);
+    return NULL;
+}
+
+EventWorkerPool::EventWorkerPool(EventHandler* handler, unsigned int workers, unsigned int batch) :
+    _handler    (handler),
+    _batch      (batch > 0 ? batch : 1)
+{
+    if(workers == 0)
+        workers = 1;
+
+    for(unsigned int i = 0; i < workers; i++)
+    {
+        Shard* shard        = new Shard;
+        shard->pool         = this;
+        shard->index        = i;
+        shard->mutex        = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+        shard->cond         = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+        shard->idle         = false;
+        shard->steal_hint   = false;
+        shard->stop         = false;
+        _shards.push_back(shard);
+    }
+
+    // Only once every shard exists, since workers look at each other's.
+    for(size_t i = 0; i < _shards.size(); i++)
+        pthread_create(&(_shards[i]->thread), NULL, __eventWorkerEntry, _shards[i]);
+}
+
+EventWorkerPool::~EventWorkerPool()
+{
+    for(size_t i = 0; i < _shards.size(); i++)
+    {
+        pthread_mutex_lock(&(_shards[i]->mutex));
+        _shards[i]->stop = true;
+        pthread_cond_broadcast(&(_shards[i]->cond));
+        pthread_mutex_unlock(&(_shards[i]->mutex));
+    }
+
+    for(size_t i = 0; i < _shards.size(); i++)
+        pthread_join(_shards[i]->thread, NULL);
+
+    for(size_t i = 0; i < _shards.size(); i++)
+    {
+        std::map<uint64_t, Mailbox*>::iterator it;
+        for(it = _shards[i]->mailboxes.begin(); it != _shards[i]->mailboxes.end(); ++it)
+            delete it->second;
+        delete _shards[i];
+    }
+}
+
+size_t EventWorkerPool::getWorkerCount() const
+{
+    return _shards.size();
+}
+
+EventWorkerPool::Shard* EventWorkerPool::homeShard(uint64_t key)
+{
+    // Fibonacci hashing: MAC addresses and handles are far from uniformly spread.
+    uint64_t hash = key * 0x9E3779B97F4A7C15ULL;
+    return _shards[(hash >> 32) % _shards.size()];
+}
+
+void EventWorkerPool::post(uint64_t key, const FrameRef& frame)
+{
+    Shard*  home = homeShard(key);
+    bool    needhelp;
+
+    pthread_mutex_lock(&(home->mutex));
+
+    Mailbox*& mailbox = home->mailboxes[key];
+    if(mailbox == NULL)
+    {
+        mailbox             = new Mailbox;
+        mailbox->key        = key;
+        mailbox->scheduled  = false;
+    }
+
+    mailbox->items.push_back(frame);
+    Metrics::addGauge(Gauge_EventQueueDepth, 1);
+    if(!mailbox->scheduled)
+    {
+        mailbox->scheduled = true;
+        home->ready.push_back(mailbox);
+        pthread_cond_signal(&(home->cond));
+    }
+
+    // The home worker is busy and keys are piling up: someone idle could take one.
+    needhelp = !home->idle && home->ready.size() > 1;
+    pthread_mutex_unlock(&(home->mutex));
+
+    if(needhelp)
+        wakeIdleWorker(home->index);
+}
+
+void EventWorkerPool::wakeIdleWorker(size_t busyshard)
+{
+    // One lock at a time, so this can't deadlock with a worker that is stealing.
+    for(size_t i = 1; i < _shards.size(); i++)
+    {
+        Shard* shard = _shards[(busyshard + i) % _shards.size()];
+
+        pthread_mutex_lock(&(shard->mutex));
+        bool wasidle = shard->idle;
+        if(wasidle)
+        {
+            shard->steal_hint = true;
+            pthread_cond_signal(&(shard->cond));
+        }
+        pthread_mutex_unlock(&(shard->mutex));
+
+        if(wasidle)
+            return;
+    }
+}
+
+EventWorkerPool::Mailbox* EventWorkerPool::steal(size_t thief, Shard** home)
+{
+    for(size_t i = 1; i < _shards.size(); i++)
+    {
+        Shard*      victim  = _shards[(thief + i) % _shards.size()];
+        Mailbox*    mailbox = NULL;
+
+        // Only from busy workers: an idle one is about to take its own keys anyway.
+        pthread_mutex_lock(&(victim->mutex));
+        if(!victim->idle && !victim->ready.empty())
+        {
+            mailbox = victim->ready.back();
+            victim->ready.pop_back();
+        }
+        pthread_mutex_unlock(&(victim->mutex));
+
+        if(mailbox)
+        {
+            *home = victim;
+            return mailbox;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Handles up to _batch events of one key. The mailbox stays guarded by its home shard's mutex, whoever runs it.
+ */
+void EventWorkerPool::runMailbox(Mailbox* mailbox, Shard* home)
+{
+    for(unsigned int handled = 0; handled < _batch; handled++)
+    {
+        FrameRef frame;
+
+        pthread_mutex_lock(&(home->mutex));
+        if(mailbox->items.empty())
+        {
+            // Done with this key for now. Forgotten, so that keys seen once don't pile up.
+            home->mailboxes.erase(mailbox->key);
+            pthread_cond_signal(&(home->cond));
+            pthread_mutex_unlock(&(home->mutex));
+            delete mailbox;
+            return;
+        }
+        frame = mailbox->items.front();
+        mailbox->items.pop_front();
+        pthread_mutex_unlock(&(home->mutex));
+        Metrics::addGauge(Gauge_EventQueueDepth, -1);
+
+        _handler->handleEvent(mailbox->key, frame);
+    }
+
+    // Batch used up. Back to the end of its home queue, still scheduled, so nobody else runs it meanwhile.
+    pthread_mutex_lock(&(home->mutex));
+    home->ready.push_back(mailbox);
+    pthread_cond_signal(&(home->cond));
+    pthread_mutex_unlock(&(home->mutex));
+}
+
+/**
+ * Main loop for a worker: its own keys first, then other workers' waiting keys, then sleep.
+ */
+void EventWorkerPool::workerMethod(Shard* shard)
+{
+    bool stole = false;
+
+    for(;;)
+    {
+        Mailbox*    mailbox = NULL;
+        Shard*      home    = shard;
+
+        // After a successful steal, look for more before going to sleep. When stopping, keys run by other workers are
+        // waited for too, since they come back to this queue if their batch runs out.
+        pthread_mutex_lock(&(shard->mutex));
+        while((!shard->stop || !shard->mailboxes.empty()) && shard->ready.empty() && !shard->steal_hint && !stole)
+        {
+            shard->idle = true;
+            pthread_cond_wait(&(shard->cond), &(shard->mutex));
+        }
+        shard->idle         = false;
+        shard->steal_hint   = false;
+
+        if(shard->stop && shard->ready.empty() && shard->mailboxes.empty())
+        {
+            pthread_mutex_unlock(&(shard->mutex));
+            break;
+        }
+
+        if(!shard->ready.empty())
+        {
+            mailbox = shard->ready.front();
+            shard->ready.pop_front();
+        }
+        pthread_mutex_unlock(&(shard->mutex));
+
+        stole = false;
+        if(mailbox == NULL)
+        {
+            mailbox = steal(shard->index, &home);
+            stole   = (mailbox != NULL);
+        }
+
+        if(mailbox)
+            runMailbox(mailbox, home);
+    }
+}
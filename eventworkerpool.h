@@ -0,0 +1,87 @@
+#ifndef EVENTWORKERPOOL_H
+#define EVENTWORKERPOOL_H
+
+#include "framepool.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <vector>
+
+/**
+ * Application side of the EventWorkerPool. handleEvent() is called from the worker threads, never for two events with the
+ * same key at once, and always in the order the events were posted for that key.
+ */
+class EventHandler
+{
+public:
+    virtual ~EventHandler() {}
+    virtual void    handleEvent(uint64_t key, const FrameRef& frame) = 0;
+};
+
+/**
+ * Fixed pool of worker threads for event handling, so a slow handler for one link doesn't hold up all the others.
+ * Events are queued per key (a connection handle, or an advertiser address), and each key has a home worker picked by
+ * hashing. A worker with nothing to do takes a whole waiting key from a busy worker: never single events, so the order
+ * within a key is kept.
+ */
+class EventWorkerPool
+{
+private:
+    struct Mailbox
+    {
+        uint64_t                key;
+        std::deque<FrameRef>    items;
+        bool                    scheduled;      // Waiting in a ready list, or being run by some worker.
+    };
+
+    struct Shard
+    {
+        EventWorkerPool*                pool;
+        size_t                          index;
+        pthread_t                       thread;
+        pthread_mutex_t                 mutex;
+        pthread_cond_t                  cond;
+        std::map<uint64_t, Mailbox*>    mailboxes;
+        std::deque<Mailbox*>            ready;
+        bool                            idle;
+        bool                            steal_hint;
+        bool                            stop;
+    };
+
+    EventHandler*           _handler;
+    std::vector<Shard*>     _shards;
+    unsigned int            _batch;
+
+    Shard*          homeShard(uint64_t key);
+    void            wakeIdleWorker(size_t busyshard);
+    Mailbox*        steal(size_t thief, Shard** home);
+    void            runMailbox(Mailbox* mailbox, Shard* home);
+    void            workerMethod(Shard* shard);
+
+    friend void*    __eventWorkerEntry(void* castedShard);
+
+    EventWorkerPool(const EventWorkerPool&);
+    EventWorkerPool& operator = (const EventWorkerPool&);
+
+public:
+    /**
+     * Starts the workers. batch is how many events of one key a worker handles before giving other keys a turn.
+     */
+    EventWorkerPool(EventHandler* handler, unsigned int workers, unsigned int batch = 16);
+
+    /**
+     * Handles what's already queued, then stops the workers.
+     */
+    ~EventWorkerPool();
+
+    /**
+     * Queues an event. The frame is shared, not copied.
+     */
+    void            post(uint64_t key, const FrameRef& frame);
+
+    size_t          getWorkerCount() const;
+};
+
+#endif // EVENTWORKERPOOL_H
@@ -0,0 +1,147 @@
+#include "framepool.h"
+#include "metrics.h"
+
+#include <cstring>
+
+FrameRef::FrameRef() :
+    _slot   (NULL)
+{
+}
+
+FrameRef::FrameRef(FrameSlot* slot) :
+    _slot   (slot)
+{
+}
+
+FrameRef::FrameRef(const FrameRef& other) :
+    _slot   (other._slot)
+{
+    if(_slot)
+        __sync_add_and_fetch(&(_slot->refcount), 1);
+}
+
+FrameRef::~FrameRef()
+{
+    release();
+}
+
+FrameRef& FrameRef::operator = (const FrameRef& other)
+{
+    if(other._slot)
+        __sync_add_and_fetch(&(other._slot->refcount), 1);
+
+    release();
+    _slot = other._slot;
+    return *this;
+}
+
+void FrameRef::release()
+{
+    if(_slot == NULL)
+        return;
+
+    if(__sync_sub_and_fetch(&(_slot->refcount), 1) == 0)
+    {
+        Metrics::addGauge(Gauge_FramesInUse, -1);
+        if(_slot->pool)
+            _slot->pool->giveBack(_slot);
+        else
+            delete _slot;
+    }
+    _slot = NULL;
+}
+
+FramePool::FramePool(size_t count) :
+    _slots      (new FrameSlot[count]),
+    _count      (count),
+    _free       (NULL),
+    _available  (count),
+    _overflow   (0)
+{
+    _mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        _slots[i].length    = 0;
+        _slots[i].refcount  = 0;
+        _slots[i].pool      = this;
+        _slots[i].next_free = _free;
+        _free               = &(_slots[i]);
+    }
+}
+
+FramePool::~FramePool()
+{
+    delete[] _slots;
+}
+
+FrameRef FramePool::acquire()
+{
+    FrameSlot* slot;
+
+    pthread_mutex_lock(&_mutex);
+    slot = _free;
+    if(slot)
+    {
+        _free = slot->next_free;
+        _available--;
+    }
+    else
+    {
+        _overflow++;
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    // Exhausted. Better an allocation than a lost frame.
+    if(slot == NULL)
+    {
+        slot        = new FrameSlot;
+        slot->pool  = NULL;
+    }
+
+    slot->length    = 0;
+    slot->refcount  = 1;
+    Metrics::addGauge(Gauge_FramesInUse, 1);
+    return FrameRef(slot);
+}
+
+void FramePool::giveBack(FrameSlot* slot)
+{
+    pthread_mutex_lock(&_mutex);
+    slot->next_free = _free;
+    _free           = slot;
+    _available++;
+    pthread_mutex_unlock(&_mutex);
+}
+
+void FramePool::prefault()
+{
+    // Only the free slots: the others belong to whoever holds them, and have been written already anyway.
+    pthread_mutex_lock(&_mutex);
+    for(FrameSlot* slot = _free; slot != NULL; slot = slot->next_free)
+        memset(slot->data, 0, FRAME_BUFFER_SIZE);
+    pthread_mutex_unlock(&_mutex);
+}
+
+size_t FramePool::getCount() const
+{
+    return _count;
+}
+
+size_t FramePool::getAvailable()
+{
+    size_t retval;
+    pthread_mutex_lock(&_mutex);
+    retval = _available;
+    pthread_mutex_unlock(&_mutex);
+    return retval;
+}
+
+unsigned long FramePool::getOverflowCount()
+{
+    unsigned long retval;
+    pthread_mutex_lock(&_mutex);
+    retval = _overflow;
+    pthread_mutex_unlock(&_mutex);
+    return retval;
+}
@@ -0,0 +1,97 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define FRAME_BUFFER_SIZE       260
+
+class FramePool;
+
+/**
+ * One preallocated frame buffer. Only FramePool and FrameRef touch these.
+ */
+struct FrameSlot
+{
+    unsigned char   data[FRAME_BUFFER_SIZE];
+    size_t          length;
+    int             refcount;
+    FramePool*      pool;           // NULL when it was allocated because the pool was exhausted.
+    FrameSlot*      next_free;
+};
+
+/**
+ * Refcounted handle to a frame buffer. Copying a FrameRef shares the buffer, and the buffer goes back to its pool when the
+ * last handle is released, so the same bytes can be passed from the USB transfer to the parser and callbacks without copies.
+ */
+class FrameRef
+{
+private:
+    FrameSlot*      _slot;
+
+public:
+    FrameRef();
+    explicit FrameRef(FrameSlot* slot);
+    FrameRef(const FrameRef& other);
+    ~FrameRef();
+
+    FrameRef&       operator = (const FrameRef& other);
+
+    /**
+     * Drops this handle. The buffer is returned to the pool if nobody else holds it.
+     */
+    void            release();
+
+    bool            valid() const           { return _slot != NULL; }
+
+    unsigned char*  data()                  { return _slot->data; }
+    const unsigned char* data() const       { return _slot->data; }
+
+    size_t          size() const            { return _slot ? _slot->length : 0; }
+    void            setSize(size_t length)  { _slot->length = length; }
+
+    size_t          capacity() const        { return FRAME_BUFFER_SIZE; }
+};
+
+/**
+ * Slab of fixed-size frame buffers, all allocated at construction. acquire() and release never allocate while there are
+ * free slots; when the pool runs dry, a buffer is taken from the heap instead and counted in getOverflowCount().
+ */
+class FramePool
+{
+friend class FrameRef;
+
+private:
+    FrameSlot*              _slots;
+    size_t                  _count;
+    FrameSlot*              _free;
+    size_t                  _available;
+    unsigned long           _overflow;
+    pthread_mutex_t         _mutex;
+
+    void            giveBack(FrameSlot* slot);
+
+    FramePool(const FramePool&);
+    FramePool&      operator = (const FramePool&);
+
+public:
+    FramePool(size_t count);
+    ~FramePool();
+
+    /**
+     * Takes an empty frame from the pool, with a single reference.
+     */
+    FrameRef        acquire();
+
+    /**
+     * Writes every free slot, so all of the pool is mapped before the first frame needs it (see
+     * SerialCommunicator::setRealtimeMode()). Frames in use are left alone, so it's safe while receiving.
+     */
+    void            prefault();
+
+    size_t          getCount() const;
+    size_t          getAvailable();
+    unsigned long   getOverflowCount();
+};
+
+#endif // FRAMEPOOL_H
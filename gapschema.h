@@ -0,0 +1,509 @@
+#ifndef GAPSCHEMA_H
+#define GAPSCHEMA_H
+
+#include "hcischema.h"
+
+/**
+ * Transmission Opcodes.
+ */
+enum TxOpcode
+{
+    GAP_DeviceInit                      = 0xFE00,
+    GAP_ConfigureDeviceAddress          = 0xFE03,
+    GAP_DeviceDiscoveryRequest          = 0xFE04,
+    GAP_DeviceDiscoveryCancel           = 0xFE05,
+    GAP_MakeDiscoverable                = 0xFE06,
+    GAP_UpdateAdvertisingData           = 0xFE07,
+    GAP_EndDiscoverable                 = 0xFE08,
+    GAP_EstablishLinkRequest            = 0xFE09,
+    GAP_TerminateLinkRequest            = 0xFE0A,
+    GAP_UpdateLinkParamReq              = 0xFE11,
+    GAP_SetParam                        = 0xFE30,
+    GAP_GetParam                        = 0xFE31,
+
+    ATT_HandleValueConfirmation         = 0xFD1E,
+    GATT_WriteCharValue                 = 0xFD92,
+    GATT_WriteLongCharValue             = 0xFD96,
+    GATT_WriteNoRsp                     = 0xFDB6,
+
+    HCI_LE_ClearWhiteList               = 0x2010,
+    HCI_LE_AddDeviceToWhiteList         = 0x2011,
+    HCI_LE_RemoveDeviceFromWhiteList    = 0x2012
+};
+
+/**
+ * Received event codes.
+ */
+enum RxEvent
+{
+    GAP_DeviceInitDone                  = 0x0600,
+    GAP_DeviceDiscoveryDone             = 0x0601,
+    GAP_AdvertDataUpdateDone            = 0x0602,
+    GAP_MakeDiscoverableDone            = 0x0603,
+    GAP_EndDiscoverableDone             = 0x0604,
+    GAP_EstablishLink                   = 0x0605,
+    GAP_TerminateLink                   = 0x0606,
+    GAP_LinkParamUpdate                 = 0x0607,
+    GAP_RandomAddressChanged            = 0x0608,
+    GAP_DeviceInformation               = 0x060D,
+    GAP_HCI_ExtentionCommandStatus      = 0x067F,
+
+    ATT_WriteRsp                        = 0x0513,
+    ATT_PrepareWriteRsp                 = 0x0517,
+    ATT_ExecuteWriteRsp                 = 0x0519,
+    ATT_HandleValueNotification         = 0x051B,
+    ATT_HandleValueIndication           = 0x051D
+};
+
+/**
+ * GAP roles for GAP_DeviceInit. They can be OR'ed together.
+ */
+enum ProfileRole
+{
+    Role_Broadcaster                    = 0x01,
+    Role_Observer                       = 0x02,
+    Role_Peripheral                     = 0x04,
+    Role_Central                        = 0x08
+};
+
+/**
+ * Advertising event types for GAP_MakeDiscoverable.
+ */
+enum AdvertisingEventType
+{
+    Adv_ConnectableUndirected           = 0x00,
+    Adv_ConnectableDirected             = 0x01,
+    Adv_ScannableUndirected             = 0x02,
+    Adv_NonConnectableUndirected        = 0x03
+};
+
+/**
+ * Which advertisers a Device Discovery request should report.
+ */
+enum DiscoveryMode
+{
+    Discovery_NonDiscoverable           = 0x00,
+    Discovery_General                   = 0x01,
+    Discovery_Limited                   = 0x02,
+    Discovery_All                       = 0x03
+};
+
+/**
+ * Address types, as reported by GAP_DeviceInformation and GAP_EstablishLink.
+ */
+enum AddressType
+{
+    Addr_Public                         = 0x00,
+    Addr_Static                         = 0x01,
+    Addr_PrivateNonResolvable           = 0x02,
+    Addr_PrivateResolvable              = 0x03
+};
+
+/**
+ * GAP parameters for GAP_SetParam / GAP_GetParam, as in TI's gap.h. Durations are in milliseconds, scan and advertising
+ * intervals and windows in 0.625 ms units, connection intervals in 1.25 ms units.
+ */
+enum GapParamId
+{
+    TGAP_GEN_DISC_ADV_MIN               = 0,
+    TGAP_LIM_ADV_TIMEOUT                = 1,
+    TGAP_GEN_DISC_SCAN                  = 2,        // General discovery scan duration.
+    TGAP_LIM_DISC_SCAN                  = 3,        // Limited discovery scan duration.
+    TGAP_CONN_EST_ADV_TIMEOUT           = 4,
+    TGAP_CONN_PARAM_TIMEOUT             = 5,
+    TGAP_LIM_DISC_ADV_INT_MIN           = 6,
+    TGAP_LIM_DISC_ADV_INT_MAX           = 7,
+    TGAP_GEN_DISC_ADV_INT_MIN           = 8,
+    TGAP_GEN_DISC_ADV_INT_MAX           = 9,
+    TGAP_CONN_ADV_INT_MIN               = 10,
+    TGAP_CONN_ADV_INT_MAX               = 11,
+    TGAP_CONN_SCAN_INT                  = 12,
+    TGAP_CONN_SCAN_WIND                 = 13,
+    TGAP_CONN_HIGH_SCAN_INT             = 14,
+    TGAP_CONN_HIGH_SCAN_WIND            = 15,
+    TGAP_GEN_DISC_SCAN_INT              = 16,
+    TGAP_GEN_DISC_SCAN_WIND             = 17,
+    TGAP_LIM_DISC_SCAN_INT              = 18,
+    TGAP_LIM_DISC_SCAN_WIND             = 19,
+    TGAP_CONN_EST_ADV                   = 20,
+    TGAP_CONN_EST_INT_MIN               = 21,
+    TGAP_CONN_EST_INT_MAX               = 22,
+    TGAP_CONN_EST_SCAN_INT              = 23,
+    TGAP_CONN_EST_SCAN_WIND             = 24,
+    TGAP_CONN_EST_SUPERV_TIMEOUT        = 25,
+    TGAP_CONN_EST_LATENCY               = 26,
+    TGAP_CONN_EST_MIN_CE_LEN            = 27,
+    TGAP_CONN_EST_MAX_CE_LEN            = 28,
+    TGAP_PRIVATE_ADDR_INT               = 29,
+    TGAP_CONN_PAUSE_CENTRAL             = 30,
+    TGAP_CONN_PAUSE_PERIPHERAL          = 31,
+    TGAP_SM_TIMEOUT                     = 32,
+    TGAP_SM_MIN_KEY_LEN                 = 33,
+    TGAP_SM_MAX_KEY_LEN                 = 34,
+    TGAP_FILTER_ADV_REPORTS             = 35,       // 1: one report per advertiser and scan.
+    TGAP_SCAN_RSP_RSSI_MIN              = 36,
+    TGAP_REJECT_CONN_PARAMS             = 37
+};
+
+/*
+ * Packet layouts. Each command and event is described once here, and HciCommandFrame / HciEventView (hcischema.h) do the
+ * encoding and decoding from these descriptions. To add a command: list its fields in order, each one naming the previous,
+ * and set length to where the last one ends.
+ */
+
+// ---------------------------------------------------------------- Commands (offsets relative to the first parameter)
+
+struct GapDeviceInitCmd
+{
+    enum { opcode = GAP_DeviceInit };
+
+    typedef HciField<uint8_t,       0>                      ProfileRole;
+    typedef HciField<uint8_t,       1,  ProfileRole>        MaxScanRsps;
+    typedef HciField<uint8_t[16],   2,  MaxScanRsps>        IRK;
+    typedef HciField<uint8_t[16],   18, IRK>                CSRK;
+    typedef HciField<uint32_t,      34, CSRK>               SignCounter;
+
+    enum { length = SignCounter::end, max_length = length };
+};
+
+struct GapConfigureDeviceAddressCmd
+{
+    enum { opcode = GAP_ConfigureDeviceAddress };
+
+    typedef HciField<uint8_t,       0>                      AddrMode;
+    typedef HciField<uint8_t[6],    1,  AddrMode>           Addr;
+
+    enum { length = Addr::end, max_length = length };
+};
+
+struct GapDeviceDiscoveryRequestCmd
+{
+    enum { opcode = GAP_DeviceDiscoveryRequest };
+
+    typedef HciField<uint8_t,       0>                      Mode;
+    typedef HciField<uint8_t,       1,  Mode>               ActiveScan;
+    typedef HciField<uint8_t,       2,  ActiveScan>         WhiteList;
+
+    enum { length = WhiteList::end, max_length = length };
+};
+
+struct GapDeviceDiscoveryCancelCmd
+{
+    enum { opcode = GAP_DeviceDiscoveryCancel, length = 0, max_length = 0 };
+};
+
+struct GapMakeDiscoverableCmd
+{
+    enum { opcode = GAP_MakeDiscoverable };
+
+    typedef HciField<uint8_t,       0>                      EventType;
+    typedef HciField<uint8_t,       1,  EventType>          InitiatorAddrType;
+    typedef HciField<uint8_t[6],    2,  InitiatorAddrType>  InitiatorAddr;
+    typedef HciField<uint8_t,       8,  InitiatorAddr>      ChannelMap;
+    typedef HciField<uint8_t,       9,  ChannelMap>         FilterPolicy;
+
+    enum { length = FilterPolicy::end, max_length = length };
+};
+
+struct GapUpdateAdvertisingDataCmd
+{
+    enum { opcode = GAP_UpdateAdvertisingData };
+
+    typedef HciField<uint8_t,       0>                      AdType;
+    typedef HciField<uint8_t,       1,  AdType>             DataLength;
+    typedef HciTail<2, 31,              DataLength>         AdvertData;
+
+    enum { length = AdvertData::offset, max_length = length + AdvertData::max_size };
+};
+
+struct GapEndDiscoverableCmd
+{
+    enum { opcode = GAP_EndDiscoverable, length = 0, max_length = 0 };
+};
+
+struct GapEstablishLinkRequestCmd
+{
+    enum { opcode = GAP_EstablishLinkRequest };
+
+    typedef HciField<uint8_t,       0>                      HighDutyCycle;
+    typedef HciField<uint8_t,       1,  HighDutyCycle>      WhiteList;
+    typedef HciField<uint8_t,       2,  WhiteList>          AddrTypePeer;
+    typedef HciField<uint8_t[6],    3,  AddrTypePeer>       PeerAddr;
+
+    enum { length = PeerAddr::end, max_length = length };
+};
+
+struct GapTerminateLinkRequestCmd
+{
+    enum { opcode = GAP_TerminateLinkRequest };
+
+    typedef HciField<uint16_t,      0>                      ConnHandle;
+    typedef HciField<uint8_t,       2,  ConnHandle>         Reason;
+
+    enum { length = Reason::end, max_length = length };
+};
+
+struct GapUpdateLinkParamReqCmd
+{
+    enum { opcode = GAP_UpdateLinkParamReq };
+
+    typedef HciField<uint16_t,      0>                      ConnHandle;
+    typedef HciField<uint16_t,      2,  ConnHandle>         IntervalMin;
+    typedef HciField<uint16_t,      4,  IntervalMin>        IntervalMax;
+    typedef HciField<uint16_t,      6,  IntervalMax>        ConnLatency;
+    typedef HciField<uint16_t,      8,  ConnLatency>        ConnTimeout;
+
+    enum { length = ConnTimeout::end, max_length = length };
+};
+
+struct GapSetParamCmd
+{
+    enum { opcode = GAP_SetParam };
+
+    typedef HciField<uint8_t,       0>                      ParamID;
+    typedef HciField<uint16_t,      1,  ParamID>            ParamValue;
+
+    enum { length = ParamValue::end, max_length = length };
+};
+
+struct GapGetParamCmd
+{
+    enum { opcode = GAP_GetParam };
+
+    typedef HciField<uint8_t,       0>                      ParamID;
+
+    enum { length = ParamID::end, max_length = length };
+};
+
+struct HciLeClearWhiteListCmd
+{
+    enum { opcode = HCI_LE_ClearWhiteList, length = 0, max_length = 0 };
+};
+
+/**
+ * Add and Remove share the same layout.
+ */
+template <TxOpcode Opcode>
+struct HciLeWhiteListCmd
+{
+    enum { opcode = Opcode };
+
+    typedef HciField<uint8_t,       0>                      AddrType;       // 0x00 Public, 0x01 Random
+    typedef HciField<uint8_t[6],    1,  AddrType>           Addr;
+
+    enum { length = Addr::end, max_length = length };
+};
+
+struct AttHandleValueConfirmationCmd
+{
+    enum { opcode = ATT_HandleValueConfirmation };
+
+    typedef HciField<uint16_t,      0>                      ConnHandle;
+
+    enum { length = ConnHandle::end, max_length = length };
+};
+
+struct GattWriteCharValueCmd
+{
+    enum { opcode = GATT_WriteCharValue };
+
+    typedef HciField<uint16_t,      0>                      ConnHandle;
+    typedef HciField<uint16_t,      2,  ConnHandle>         Handle;
+    typedef HciTail<4, 251,             Handle>             Value;
+
+    enum { length = Value::offset, max_length = length + Value::max_size };
+};
+
+struct GattWriteNoRspCmd
+{
+    enum { opcode = GATT_WriteNoRsp };
+
+    typedef HciField<uint16_t,      0>                      ConnHandle;
+    typedef HciField<uint16_t,      2,  ConnHandle>         Handle;
+    typedef HciTail<4, 251,             Handle>             Value;
+
+    enum { length = Value::offset, max_length = length + Value::max_size };
+};
+
+/**
+ * Prepared (long) write: the controller splits the value in Prepare Write requests and executes them at the end.
+ */
+struct GattWriteLongCharValueCmd
+{
+    enum { opcode = GATT_WriteLongCharValue };
+
+    typedef HciField<uint16_t,      0>                      ConnHandle;
+    typedef HciField<uint16_t,      2,  ConnHandle>         Handle;
+    typedef HciField<uint16_t,      4,  Handle>             Offset;
+    typedef HciTail<6, 249,             Offset>             Value;
+
+    enum { length = Value::offset, max_length = length + Value::max_size };
+};
+
+// ---------------------------------------------------------------- Events (offsets relative to the packet Type byte)
+
+struct HciEventHeader
+{
+    typedef HciField<uint8_t,       0>                      Type;
+    typedef HciField<uint8_t,       1,  Type>               EventCode;
+    typedef HciField<uint8_t,       2,  EventCode>          DataLength;
+
+    enum { length = DataLength::end };
+};
+
+/**
+ * Common beginning of every HCI_LE_ExtEvent (vendor event).
+ */
+struct GapEventHeader
+{
+    typedef HciField<uint16_t,      3,  HciEventHeader::DataLength>     Event;
+    typedef HciField<uint8_t,       5,  Event>                          Status;
+
+    enum { length = Status::end };
+};
+
+struct HciCommandCompleteEvt
+{
+    typedef HciField<uint8_t,       3,  HciEventHeader::DataLength>     NumHciCmdPkts;
+    typedef HciField<uint16_t,      4,  NumHciCmdPkts>                  CommandOpcode;
+    typedef HciField<uint8_t,       6,  CommandOpcode>                  Status;
+
+    enum { length = Status::end };
+};
+
+/**
+ * Standard HCI Number Of Completed Packets: data packets the controller is done with, giving their buffers back.
+ * Each entry is a connection handle and a count (2 bytes each).
+ */
+struct HciNumCompletedPacketsEvt
+{
+    typedef HciField<uint8_t,       3,  HciEventHeader::DataLength>     NumHandles;
+    typedef HciTail<4, 252,             NumHandles>                     Entries;
+
+    enum { length = Entries::offset };
+};
+
+struct GapHciExtCommandStatusEvt
+{
+    typedef GapEventHeader::Status                                      Status;
+    typedef HciField<uint16_t,      6,  Status>                         OpCode;
+    typedef HciField<uint8_t,       8,  OpCode>                         DataLength;
+    typedef HciTail<9, 246,             DataLength>                     Data;
+
+    enum { length = Data::offset };
+};
+
+struct GapDeviceInitDoneEvt
+{
+    typedef GapEventHeader::Status                                      Status;
+    typedef HciField<uint8_t[6],    6,  Status>                         DevAddr;
+    typedef HciField<uint16_t,      12, DevAddr>                        DataPktLen;
+    typedef HciField<uint8_t,       14, DataPktLen>                     NumDataPkts;
+    typedef HciField<uint8_t[16],   15, NumDataPkts>                    IRK;
+    typedef HciField<uint8_t[16],   31, IRK>                            CSRK;
+
+    enum { length = CSRK::end };
+};
+
+struct GapDeviceDiscoveryDoneEvt
+{
+    typedef GapEventHeader::Status                                      Status;
+    typedef HciField<uint8_t,       6,  Status>                         NumDevs;
+    typedef HciTail<7, 248,             NumDevs>                        Devices;        // EventType, AddrType, Addr (8 bytes each)
+
+    enum { length = Devices::offset };
+};
+
+struct GapAdvertDataUpdateDoneEvt
+{
+    typedef GapEventHeader::Status                                      Status;
+    typedef HciField<uint8_t,       6,  Status>                         AdType;
+
+    enum { length = AdType::end };
+};
+
+struct GapMakeDiscoverableDoneEvt
+{
+    typedef GapEventHeader::Status                                      Status;
+
+    enum { length = Status::end };
+};
+
+struct GapEndDiscoverableDoneEvt
+{
+    typedef GapEventHeader::Status                                      Status;
+
+    enum { length = Status::end };
+};
+
+struct GapEstablishLinkEvt
+{
+    typedef GapEventHeader::Status                                      Status;
+    typedef HciField<uint8_t,       6,  Status>                         DevAddrType;
+    typedef HciField<uint8_t[6],    7,  DevAddrType>                    DevAddr;
+    typedef HciField<uint16_t,      13, DevAddr>                        ConnHandle;
+    typedef HciField<uint16_t,      15, ConnHandle>                     ConnInterval;
+    typedef HciField<uint16_t,      17, ConnInterval>                   ConnLatency;
+    typedef HciField<uint16_t,      19, ConnLatency>                    ConnTimeout;
+    typedef HciField<uint8_t,       21, ConnTimeout>                    ClockAccuracy;
+
+    enum { length = ClockAccuracy::end };
+};
+
+struct GapTerminateLinkEvt
+{
+    typedef GapEventHeader::Status                                      Status;
+    typedef HciField<uint16_t,      6,  Status>                         ConnHandle;
+    typedef HciField<uint8_t,       8,  ConnHandle>                     Reason;
+
+    enum { length = Reason::end };
+};
+
+struct GapLinkParamUpdateEvt
+{
+    typedef GapEventHeader::Status                                      Status;
+    typedef HciField<uint16_t,      6,  Status>                         ConnHandle;
+    typedef HciField<uint16_t,      8,  ConnHandle>                     ConnInterval;
+    typedef HciField<uint16_t,      10, ConnInterval>                   ConnLatency;
+    typedef HciField<uint16_t,      12, ConnLatency>                    ConnTimeout;
+
+    enum { length = ConnTimeout::end };
+};
+
+struct GapDeviceInformationEvt
+{
+    typedef GapEventHeader::Status                                      Status;
+    typedef HciField<uint8_t,       6,  Status>                         EventType;
+    typedef HciField<uint8_t,       7,  EventType>                      AddrType;
+    typedef HciField<uint8_t[6],    8,  AddrType>                       Addr;
+    typedef HciField<int8_t,        14, Addr>                           Rssi;
+    typedef HciField<uint8_t,       15, Rssi>                           DataLength;
+    typedef HciTail<16, 31,             DataLength>                     Data;
+
+    enum { length = Data::offset };
+};
+
+struct AttWriteRspEvt
+{
+    typedef GapEventHeader::Status                                      Status;
+    typedef HciField<uint16_t,      6,  Status>                         ConnHandle;
+    typedef HciField<uint8_t,       8,  ConnHandle>                     PduLength;
+
+    enum { length = PduLength::end };
+};
+
+/**
+ * Same layout for notifications and indications.
+ */
+struct AttHandleValueEvt
+{
+    typedef GapEventHeader::Status                                      Status;
+    typedef HciField<uint16_t,      6,  Status>                         ConnHandle;
+    typedef HciField<uint8_t,       8,  ConnHandle>                     PduLength;
+    typedef HciField<uint16_t,      9,  PduLength>                      Handle;
+    typedef HciTail<11, 249,            Handle>                         Value;
+
+    enum { length = Value::offset };
+};
+
+#endif // GAPSCHEMA_H
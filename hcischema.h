@@ -0,0 +1,176 @@
+#ifndef HCISCHEMA_H
+#define HCISCHEMA_H
+
+#include <cstring>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TX_TYPE_COMMAND         0x01
+#define RX_TYPE_EVENT           0x04
+#define RX_HCI_LE_EXTEVENT      0xFF
+#define RX_HCI_CMDCOMPLETE      0x0E
+#define RX_HCI_NUMCOMPLETEDPKTS 0x13
+
+#define TX_HEADER_LENGTH        4           // Type, Opcode (2), Data Length
+#define HCI_MAX_PARAMS_LENGTH   255
+#define HCI_MAX_PACKET_LENGTH   260
+
+#ifdef __GNUC__
+    #define HCI_UNUSED              __attribute__((unused))
+#else
+    #define HCI_UNUSED
+#endif
+
+/// C++98 has no static_assert, so a negative array size is what stops the compilation.
+#define HCI_STATIC_CHECK(condition, name)   typedef char name[(condition) ? 1 : -1] HCI_UNUSED
+
+/**
+ * Placeholder preceding the first field of a command's parameters.
+ */
+struct HciNoField
+{
+    enum { offset = 0, size = 0, end = 0 };
+};
+
+/**
+ * A fixed-position field of a packet.
+ * Command offsets are counted from the first parameter byte, and event offsets from the packet Type byte, the same way
+ * BTool dumps show them. Every field names the one before it, and its offset is checked against where that one ends,
+ * so a layout with holes or overlaps won't compile.
+ */
+template <typename T, unsigned int Offset, typename Previous = HciNoField>
+struct HciField
+{
+    typedef T type;
+    enum { offset = Offset, size = sizeof(T), end = Offset + sizeof(T) };
+
+    HCI_STATIC_CHECK(static_cast<int>(Offset) == static_cast<int>(Previous::end), field_offset_does_not_follow_previous_field);
+
+    static void write(unsigned char* base, const T& value)
+    {
+        memcpy(base + Offset, &value, sizeof(T));
+    }
+
+    static void read(const unsigned char* base, T* value)
+    {
+        memcpy(value, base + Offset, sizeof(T));
+    }
+};
+
+/**
+ * Variable length trailing data (advertising data, attribute values...). Always the last thing in a packet.
+ */
+template <unsigned int Offset, unsigned int MaxSize, typename Previous>
+struct HciTail
+{
+    enum { offset = Offset, max_size = MaxSize, end = Offset };
+
+    HCI_STATIC_CHECK(static_cast<int>(Offset) == static_cast<int>(Previous::end), tail_offset_does_not_follow_previous_field);
+};
+
+/**
+ * Builds a command packet described by a schema (see gapschema.h) in a fixed buffer, without any allocation.
+ * The header is filled in by the constructor, and every parameter not set is left as zero.
+ */
+template <typename Command>
+class HciCommandFrame
+{
+private:
+    HCI_STATIC_CHECK(static_cast<int>(Command::max_length) <= HCI_MAX_PARAMS_LENGTH, command_does_not_fit_in_a_packet);
+
+    unsigned char   _frame[TX_HEADER_LENGTH + Command::max_length];
+    unsigned int    _length;
+
+public:
+    HciCommandFrame() :
+        _length     (Command::length)
+    {
+        memset(_frame, 0, sizeof(_frame));
+        _frame[0] = TX_TYPE_COMMAND;
+        _frame[1] = static_cast<unsigned char>(Command::opcode & 0xFF);
+        _frame[2] = static_cast<unsigned char>((Command::opcode >> 8) & 0xFF);
+        _frame[3] = static_cast<unsigned char>(Command::length);
+    }
+
+    template <typename Field>
+    HciCommandFrame& set(const typename Field::type& value)
+    {
+        HCI_STATIC_CHECK(static_cast<int>(Field::end) <= static_cast<int>(Command::length), field_is_outside_the_command);
+        Field::write(&(_frame[TX_HEADER_LENGTH]), value);
+        return *this;
+    }
+
+    /**
+     * Appends the variable part of the command. Data longer than the tail allows is cut.
+     */
+    template <typename Tail>
+    HciCommandFrame& setTail(const unsigned char* data, unsigned int length)
+    {
+        HCI_STATIC_CHECK(static_cast<int>(Tail::offset) == static_cast<int>(Command::length), tail_must_follow_the_fixed_part);
+        if(length > Tail::max_size)
+            length = Tail::max_size;
+
+        memcpy(&(_frame[TX_HEADER_LENGTH + Tail::offset]), data, length);
+        _length     = Tail::offset + length;
+        _frame[3]   = static_cast<unsigned char>(_length);
+        return *this;
+    }
+
+    unsigned char*  data()              { return _frame; }
+    size_t          size() const        { return TX_HEADER_LENGTH + _length; }
+};
+
+/**
+ * Reads the fields of a received event described by a schema, straight from the packet buffer.
+ */
+template <typename Event>
+class HciEventView
+{
+private:
+    HCI_STATIC_CHECK(static_cast<int>(Event::length) <= HCI_MAX_PACKET_LENGTH, event_does_not_fit_in_a_packet);
+
+    const unsigned char*    _packet;
+    size_t                  _length;
+
+public:
+    HciEventView(const unsigned char* packet, size_t length) :
+        _packet     (packet),
+        _length     (length)
+    {
+    }
+
+    /**
+     * True if the packet is long enough to hold every fixed field of the event.
+     */
+    bool            complete() const    { return _length >= static_cast<size_t>(Event::length); }
+
+    template <typename Field>
+    void            get(typename Field::type* destination) const
+    {
+        HCI_STATIC_CHECK(static_cast<int>(Field::end) <= static_cast<int>(Event::length), field_is_outside_the_event);
+        Field::read(_packet, destination);
+    }
+
+    template <typename Field>
+    typename Field::type value() const
+    {
+        typename Field::type retval;
+        get<Field>(&retval);
+        return retval;
+    }
+
+    template <typename Tail>
+    const unsigned char* tail() const
+    {
+        HCI_STATIC_CHECK(static_cast<int>(Tail::offset) == static_cast<int>(Event::length), tail_must_follow_the_fixed_part);
+        return &(_packet[Tail::offset]);
+    }
+
+    template <typename Tail>
+    size_t          tailLength() const
+    {
+        return (_length > static_cast<size_t>(Tail::offset)) ? _length - Tail::offset : 0;
+    }
+};
+
+#endif // HCISCHEMA_H
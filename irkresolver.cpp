@@ -0,0 +1,444 @@
+#include "irkresolver.h"
+
+#include <cstring>
+#include <ctime>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IRK_AESNI_POSSIBLE
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif
+
+#define IRK_GROUP       8       // IRKs evaluated side by side.
+#define IRK_CHUNK       32      // Addresses taken per pass over the keyring.
+
+static unsigned char    sbox[256];
+static uint32_t         te0[256], te1[256], te2[256], te3[256];
+static pthread_once_t   tablesOnce = PTHREAD_ONCE_INIT;
+
+static inline unsigned char xtime(unsigned char x)
+{
+    return static_cast<unsigned char>((x << 1) ^ ((x & 0x80) ? 0x1B : 0x00));
+}
+
+static inline unsigned char rotl8(unsigned char x, int shift)
+{
+    return static_cast<unsigned char>((x << shift) | (x >> (8 - shift)));
+}
+
+static inline uint32_t ror32(uint32_t x, int shift)
+{
+    return (x >> shift) | (x << (32 - shift));
+}
+
+/**
+ * The S-box, from walking GF(2^8) by powers of 3 and their inverses, and the round tables (SubBytes and MixColumns of
+ * one byte) from it.
+ */
+static void buildTables()
+{
+    unsigned char p = 1, q = 1;
+    do
+    {
+        p = p ^ xtime(p);
+        q ^= q << 1;
+        q ^= q << 2;
+        q ^= q << 4;
+        if(q & 0x80)
+            q ^= 0x09;
+        sbox[p] = q ^ rotl8(q, 1) ^ rotl8(q, 2) ^ rotl8(q, 3) ^ rotl8(q, 4) ^ 0x63;
+    } while(p != 1);
+    sbox[0] = 0x63;
+
+    for(int i = 0; i < 256; i++)
+    {
+        unsigned char s = sbox[i];
+        unsigned char s2 = xtime(s);
+        te0[i] = (static_cast<uint32_t>(s2) << 24) | (static_cast<uint32_t>(s) << 16) | (static_cast<uint32_t>(s) << 8) | (s2 ^ s);
+        te1[i] = ror32(te0[i], 8);
+        te2[i] = ror32(te0[i], 16);
+        te3[i] = ror32(te0[i], 24);
+    }
+}
+
+static void expandKey(const unsigned char* key, unsigned char* roundKeys)
+{
+    unsigned char rcon = 0x01;
+
+    memcpy(roundKeys, key, 16);
+    for(int i = 16; i < IRK_SCHEDULE_WORDS * 4; i += 4)
+    {
+        unsigned char t[4] = { roundKeys[i - 4], roundKeys[i - 3], roundKeys[i - 2], roundKeys[i - 1] };
+        if(i % 16 == 0)
+        {
+            unsigned char first = t[0];
+            t[0] = sbox[t[1]] ^ rcon;
+            t[1] = sbox[t[2]];
+            t[2] = sbox[t[3]];
+            t[3] = sbox[first];
+            rcon = xtime(rcon);
+        }
+        for(int j = 0; j < 4; j++)
+            roundKeys[i + j] = roundKeys[i - 16 + j] ^ t[j];
+    }
+}
+
+/**
+ * ah() with the T-tables, schedule as big-endian words. Only the last word of the output is computed: ah is its 24 low bits.
+ */
+static inline uint32_t ahTables(const uint32_t* rk, uint32_t prand)
+{
+    uint32_t s0 = rk[0], s1 = rk[1], s2 = rk[2], s3 = prand ^ rk[3];
+    uint32_t t0, t1, t2, t3;
+
+    for(int round = 1; round < 10; round++)
+    {
+        rk += 4;
+        t0 = te0[s0 >> 24] ^ te1[(s1 >> 16) & 0xFF] ^ te2[(s2 >> 8) & 0xFF] ^ te3[s3 & 0xFF] ^ rk[0];
+        t1 = te0[s1 >> 24] ^ te1[(s2 >> 16) & 0xFF] ^ te2[(s3 >> 8) & 0xFF] ^ te3[s0 & 0xFF] ^ rk[1];
+        t2 = te0[s2 >> 24] ^ te1[(s3 >> 16) & 0xFF] ^ te2[(s0 >> 8) & 0xFF] ^ te3[s1 & 0xFF] ^ rk[2];
+        t3 = te0[s3 >> 24] ^ te1[(s0 >> 16) & 0xFF] ^ te2[(s1 >> 8) & 0xFF] ^ te3[s2 & 0xFF] ^ rk[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+
+    uint32_t last = (static_cast<uint32_t>(sbox[(s0 >> 16) & 0xFF]) << 16) | (static_cast<uint32_t>(sbox[(s1 >> 8) & 0xFF]) << 8) | sbox[s2 & 0xFF];
+    return (last ^ rk[7]) & 0x00FFFFFF;
+}
+
+/**
+ * Finds, for every address not matched yet (matches[i] < 0), the first IRK whose ah() of its prand is its hash.
+ * The keyring is gone through once, a group of IRKs at a time against all the addresses. Returns the evaluations done.
+ */
+static unsigned long matchTables(const uint32_t* schedules, size_t keys, const uint32_t* prands, const uint32_t* hashes, size_t count, int* matches)
+{
+    unsigned long blocks = 0;
+
+    for(size_t k = 0; k < keys; k += IRK_GROUP)
+    {
+        size_t group = (keys - k < IRK_GROUP) ? keys - k : IRK_GROUP;
+        for(size_t a = 0; a < count; a++)
+        {
+            if(matches[a] >= 0)
+                continue;
+            for(size_t i = 0; i < group; i++)
+            {
+                if(ahTables(schedules + (k + i) * IRK_SCHEDULE_WORDS, prands[a]) == hashes[a])
+                {
+                    matches[a] = static_cast<int>(k + i);
+                    break;
+                }
+            }
+            blocks += group;
+        }
+    }
+    return blocks;
+}
+
+#ifdef IRK_AESNI_POSSIBLE
+static bool cpuHasAesNi()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ecx & bit_AES) && (edx & bit_SSE2);
+}
+
+/**
+ * Same as matchTables() with AES-NI, schedule in byte order. The IRKs of a group are evaluated interleaved: each aesenc
+ * takes several cycles to come out, but a new one can start every cycle.
+ */
+__attribute__((target("aes,sse2")))
+static unsigned long matchAesNi(const uint32_t* schedules, size_t keys, const uint32_t* prands, const uint32_t* hashes, size_t count, int* matches)
+{
+    unsigned long blocks = 0;
+
+    for(size_t k = 0; k < keys; k += IRK_GROUP)
+    {
+        size_t          group = (keys - k < IRK_GROUP) ? keys - k : IRK_GROUP;
+        const __m128i*  rk = reinterpret_cast<const __m128i*>(schedules + k * IRK_SCHEDULE_WORDS);
+
+        for(size_t a = 0; a < count; a++)
+        {
+            if(matches[a] >= 0)
+                continue;
+
+            // r' = 13 bytes of padding, then prand, most significant byte first.
+            __m128i plain = _mm_set_epi8(static_cast<char>(prands[a]), static_cast<char>(prands[a] >> 8), static_cast<char>(prands[a] >> 16),
+                                         0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+            __m128i state[IRK_GROUP];
+
+            for(size_t i = 0; i < group; i++)
+                state[i] = _mm_xor_si128(plain, _mm_loadu_si128(rk + i * 11));
+            for(int round = 1; round < 10; round++)
+            {
+                for(size_t i = 0; i < group; i++)
+                    state[i] = _mm_aesenc_si128(state[i], _mm_loadu_si128(rk + i * 11 + round));
+            }
+            for(size_t i = 0; i < group; i++)
+                state[i] = _mm_aesenclast_si128(state[i], _mm_loadu_si128(rk + i * 11 + 10));
+
+            blocks += group;
+            for(size_t i = 0; i < group; i++)
+            {
+                // Bytes 12 to 15 of the output, in little-endian order: ah is bytes 13 to 15, most significant first.
+                uint32_t last = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(state[i], 12)));
+                uint32_t ah = ((last >> 8) & 0xFF) << 16 | ((last >> 16) & 0xFF) << 8 | (last >> 24);
+                if(ah == hashes[a])
+                {
+                    matches[a] = static_cast<int>(k + i);
+                    break;
+                }
+            }
+        }
+    }
+    return blocks;
+}
+#endif
+
+IrkResolver::IrkResolver(size_t cacheCapacity, uint32_t addressLifetimeMs) :
+    _cache_capacity     (cacheCapacity),
+    _lifetime_ms        (addressLifetimeMs),
+    _aesni              (false)
+{
+    pthread_once(&tablesOnce, buildTables);
+    pthread_mutex_init(&_mutex, NULL);
+
+    #ifdef IRK_AESNI_POSSIBLE
+    _aesni = cpuHasAesNi();
+    #endif
+
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+IrkResolver::~IrkResolver()
+{
+    pthread_mutex_destroy(&_mutex);
+}
+
+uint32_t IrkResolver::nowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint32_t>(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+bool IrkResolver::isResolvable(const MacAddress& address)
+{
+    // The address comes reversed: the top bits are in its last byte.
+    return (address.addr[5] & 0xC0) == 0x40;
+}
+
+void IrkResolver::addIrk(const unsigned char* irk, const MacAddress& identity, unsigned char identityType)
+{
+    unsigned char key[16], roundkeys[IRK_SCHEDULE_WORDS * 4];
+    uint32_t      schedule[IRK_SCHEDULE_WORDS];
+
+    // AES takes the key most significant byte first.
+    for(int i = 0; i < 16; i++)
+        key[i] = irk[15 - i];
+    expandKey(key, roundkeys);
+
+    if(_aesni)
+    {
+        memcpy(schedule, roundkeys, sizeof(schedule));
+    }
+    else
+    {
+        for(int i = 0; i < IRK_SCHEDULE_WORDS; i++)
+            schedule[i] = (static_cast<uint32_t>(roundkeys[4 * i]) << 24) | (static_cast<uint32_t>(roundkeys[4 * i + 1]) << 16) |
+                          (static_cast<uint32_t>(roundkeys[4 * i + 2]) << 8) | roundkeys[4 * i + 3];
+    }
+
+    pthread_mutex_lock(&_mutex);
+
+    size_t slot = 0;
+    while(slot < _identities.size() && memcmp(_identities[slot].address.addr, identity.addr, 6) != 0)
+        slot++;
+
+    if(slot == _identities.size())
+    {
+        IrkIdentity entry;
+        entry.address   = identity;
+        entry.addr_type = identityType;
+        _identities.push_back(entry);
+        _schedules.resize(_schedules.size() + IRK_SCHEDULE_WORDS);
+    }
+    _identities[slot].addr_type = identityType;
+    memcpy(&(_schedules[slot * IRK_SCHEDULE_WORDS]), schedule, sizeof(schedule));
+
+    clearCache();
+    pthread_mutex_unlock(&_mutex);
+}
+
+bool IrkResolver::removeIrk(const MacAddress& identity)
+{
+    pthread_mutex_lock(&_mutex);
+
+    for(size_t i = 0; i < _identities.size(); i++)
+    {
+        if(memcmp(_identities[i].address.addr, identity.addr, 6) != 0)
+            continue;
+
+        // The last one takes its place.
+        size_t last = _identities.size() - 1;
+        _identities[i] = _identities[last];
+        memcpy(&(_schedules[i * IRK_SCHEDULE_WORDS]), &(_schedules[last * IRK_SCHEDULE_WORDS]), IRK_SCHEDULE_WORDS * sizeof(uint32_t));
+        _identities.pop_back();
+        _schedules.resize(last * IRK_SCHEDULE_WORDS);
+
+        clearCache();
+        pthread_mutex_unlock(&_mutex);
+        return true;
+    }
+
+    pthread_mutex_unlock(&_mutex);
+    return false;
+}
+
+size_t IrkResolver::size()
+{
+    pthread_mutex_lock(&_mutex);
+    size_t retval = _identities.size();
+    pthread_mutex_unlock(&_mutex);
+    return retval;
+}
+
+bool IrkResolver::cached(uint64_t key, uint32_t now, int* identity)
+{
+    // Whatever expired goes first. An entry put again since is newer than its old place in the order: that one stays.
+    while(!_cache_order.empty() && static_cast<int32_t>(_cache_order.front().second - now) <= 0)
+    {
+        std::map<uint64_t, CacheEntry>::iterator expired = _cache.find(_cache_order.front().first);
+        if(expired != _cache.end() && expired->second.expires_ms == _cache_order.front().second)
+            _cache.erase(expired);
+        _cache_order.pop_front();
+    }
+
+    std::map<uint64_t, CacheEntry>::iterator found = _cache.find(key);
+    if(found == _cache.end())
+        return false;
+
+    *identity = found->second.identity;
+    return true;
+}
+
+void IrkResolver::cache(uint64_t key, uint32_t now, int identity)
+{
+    if(_cache_capacity == 0)
+        return;
+
+    while(_cache.size() >= _cache_capacity && !_cache_order.empty())
+    {
+        std::map<uint64_t, CacheEntry>::iterator oldest = _cache.find(_cache_order.front().first);
+        if(oldest != _cache.end() && oldest->second.expires_ms == _cache_order.front().second)
+            _cache.erase(oldest);
+        _cache_order.pop_front();
+    }
+
+    CacheEntry entry;
+    entry.identity      = identity;
+    entry.expires_ms    = now + _lifetime_ms;
+    _cache[key] = entry;
+    _cache_order.push_back(std::make_pair(key, entry.expires_ms));
+}
+
+void IrkResolver::clearCache()
+{
+    _cache.clear();
+    _cache_order.clear();
+}
+
+bool IrkResolver::resolve(const MacAddress& address, IrkIdentity* identity)
+{
+    bool resolved = false;
+    resolveBatch(&address, 1, identity, &resolved);
+    return resolved;
+}
+
+size_t IrkResolver::resolveBatch(const MacAddress* addresses, size_t count, IrkIdentity* identities, bool* resolved)
+{
+    // Addresses not in the cache, a chunk at a time, so nothing is allocated on the receive path.
+    size_t      pending[IRK_CHUNK];
+    uint32_t    prands[IRK_CHUNK], hashes[IRK_CHUNK];
+    int         matches[IRK_CHUNK];
+    size_t      retval = 0;
+
+    pthread_mutex_lock(&_mutex);
+    uint32_t now = nowMs();
+
+    size_t next = 0;
+    while(next < count)
+    {
+        size_t waiting = 0;
+
+        for(; next < count && waiting < IRK_CHUNK; next++)
+        {
+            int identity;
+
+            resolved[next] = false;
+            if(!isResolvable(addresses[next]))
+                continue;
+
+            _stats.lookups++;
+            if(cached(addresses[next].key(), now, &identity))
+            {
+                _stats.cache_hits++;
+                if(identity >= 0)
+                {
+                    identities[next] = _identities[identity];
+                    resolved[next] = true;
+                    retval++;
+                }
+                continue;
+            }
+
+            const unsigned char* addr = addresses[next].addr;
+            pending[waiting]    = next;
+            hashes[waiting]     = (static_cast<uint32_t>(addr[2]) << 16) | (static_cast<uint32_t>(addr[1]) << 8) | addr[0];
+            prands[waiting]     = (static_cast<uint32_t>(addr[5]) << 16) | (static_cast<uint32_t>(addr[4]) << 8) | addr[3];
+            matches[waiting]    = -1;
+            waiting++;
+        }
+
+        if(waiting == 0)
+            continue;
+
+        if(!_identities.empty())
+        {
+            #ifdef IRK_AESNI_POSSIBLE
+            if(_aesni)
+                _stats.aes_blocks += matchAesNi(&(_schedules[0]), _identities.size(), prands, hashes, waiting, matches);
+            else
+            #endif
+                _stats.aes_blocks += matchTables(&(_schedules[0]), _identities.size(), prands, hashes, waiting, matches);
+        }
+
+        for(size_t i = 0; i < waiting; i++)
+        {
+            cache(addresses[pending[i]].key(), now, matches[i]);
+            if(matches[i] < 0)
+            {
+                _stats.unresolved++;
+                continue;
+            }
+            _stats.resolved++;
+            identities[pending[i]] = _identities[matches[i]];
+            resolved[pending[i]] = true;
+            retval++;
+        }
+    }
+
+    pthread_mutex_unlock(&_mutex);
+    return retval;
+}
+
+IrkResolverStats IrkResolver::getStats()
+{
+    pthread_mutex_lock(&_mutex);
+    IrkResolverStats retval = _stats;
+    retval.irks     = _identities.size();
+    retval.cached   = _cache.size();
+    retval.aesni    = _aesni;
+    pthread_mutex_unlock(&_mutex);
+    return retval;
+}
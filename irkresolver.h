@@ -0,0 +1,113 @@
+#ifndef IRKRESOLVER_H
+#define IRKRESOLVER_H
+
+#include "cc2540communicator.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <vector>
+
+#define IRK_SCHEDULE_WORDS      44      // AES-128 round keys: 11 of 16 bytes.
+
+/**
+ * Who is behind a resolvable private address: the identity address distributed with the IRK at bonding.
+ */
+struct IrkIdentity
+{
+    MacAddress      address;
+    unsigned char   addr_type;          // 0x00 public, 0x01 static random.
+};
+
+struct IrkResolverStats
+{
+    size_t          irks;
+    size_t          cached;             // Addresses in the cache, resolved or not.
+    unsigned long   lookups;
+    unsigned long   cache_hits;
+    unsigned long   resolved;           // Addresses resolved by computing, not counting the cache hits.
+    unsigned long   unresolved;
+    unsigned long   aes_blocks;         // AES-128 evaluations so far.
+    bool            aesni;              // The AES-NI version is in use.
+};
+
+/**
+ * Keyring of the peers' identity resolving keys (IRK), telling which bonded device is behind a resolvable private address.
+ *
+ * Resolving is ah(IRK, prand) == hash (Core spec, Vol 3, Part H, 2.2.2) for every IRK until one matches, which is one
+ * AES-128 evaluation per IRK. The key schedules are expanded once, when added, and stored one after the other; addresses
+ * to resolve are taken together, and the IRKs are gone through in groups of 8, every group against every address, so
+ * the AES pipeline is kept full (with AES-NI where the CPU has it, found at run time, and T-tables elsewhere). Results,
+ * unresolved addresses included, are cached for the lifetime of an address, so each one is computed once.
+ *
+ * With 24 bits of hash, an address of some other device matches one of N IRKs with a probability of N / 2^24.
+ */
+class IrkResolver
+{
+private:
+    struct CacheEntry
+    {
+        int             identity;       // Index in _identities, or -1 if no IRK resolves the address.
+        uint32_t        expires_ms;
+    };
+
+    std::vector<IrkIdentity>        _identities;
+    std::vector<uint32_t>           _schedules;         // IRK_SCHEDULE_WORDS per IRK, in the layout of the kernel in use.
+
+    std::map<uint64_t, CacheEntry>  _cache;
+    std::deque<std::pair<uint64_t, uint32_t> > _cache_order;    // Insertion order, which is also the expiry order.
+    size_t                          _cache_capacity;
+    uint32_t                        _lifetime_ms;
+
+    bool                            _aesni;
+    IrkResolverStats                _stats;
+
+    pthread_mutex_t                 _mutex;
+
+    static uint32_t     nowMs();
+
+    bool                cached(uint64_t key, uint32_t now, int* identity);
+    void                cache(uint64_t key, uint32_t now, int identity);
+    void                clearCache();
+
+    IrkResolver(const IrkResolver&);
+    IrkResolver& operator = (const IrkResolver&);
+
+public:
+    /**
+     * cacheCapacity is the most addresses remembered; the oldest go first. addressLifetimeMs is how long a result is
+     * trusted: the default is the 15 minutes the spec recommends for changing the address.
+     */
+    IrkResolver(size_t cacheCapacity = 4096, uint32_t addressLifetimeMs = 15 * 60 * 1000);
+    ~IrkResolver();
+
+    /**
+     * Adds an IRK, least significant byte first, like the controller reports keys (see
+     * CC2540Communicator::getDeviceKeys()). An identity already in the keyring gets the new IRK.
+     * Changing the keyring empties the cache.
+     */
+    void            addIrk(const unsigned char* irk, const MacAddress& identity, unsigned char identityType = 0x00);
+    bool            removeIrk(const MacAddress& identity);
+    size_t          size();
+
+    /**
+     * True for resolvable private addresses: random addresses (address type 0x01) with 01 as their two top bits.
+     */
+    static bool     isResolvable(const MacAddress& address);
+
+    /**
+     * Returns true and the identity if one of the IRKs resolves the address.
+     */
+    bool            resolve(const MacAddress& address, IrkIdentity* identity);
+
+    /**
+     * Resolves many addresses at once, which is cheaper than one by one. resolved[i] tells whether identities[i] is set.
+     * Returns how many were resolved.
+     */
+    size_t          resolveBatch(const MacAddress* addresses, size_t count, IrkIdentity* identities, bool* resolved);
+
+    IrkResolverStats getStats();
+};
+
+#endif // IRKRESOLVER_H
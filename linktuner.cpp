@@ -0,0 +1,195 @@
+#include "linktuner.h"
+
+#include <iostream>
+#include <cmath>
+
+// Connection events per second at a given interval (1.25 ms units).
+static double eventsPerSecond(double interval)
+{
+    return 800.0 / interval;
+}
+
+LinkTuner::LinkTuner(CC2540Communicator* communicator, const LinkTunerConfig& config) :
+    _communicator   (communicator),
+    _config         (config)
+{
+    _mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+    clock_gettime(CLOCK_MONOTONIC, &_round_started);
+}
+
+void LinkTuner::setConfig(const LinkTunerConfig& config)
+{
+    pthread_mutex_lock(&_mutex);
+    _config = config;
+    pthread_mutex_unlock(&_mutex);
+}
+
+LinkTunerConfig LinkTuner::getConfig()
+{
+    LinkTunerConfig retval;
+    pthread_mutex_lock(&_mutex);
+    retval = _config;
+    pthread_mutex_unlock(&_mutex);
+    return retval;
+}
+
+void LinkTuner::recordTransfer(unsigned short connHandle, size_t bytes, double latencyMs)
+{
+    pthread_mutex_lock(&_mutex);
+    Accumulator& acc = _accumulators[connHandle];
+    acc.bytes               += bytes;
+    acc.latency_total_ms    += latencyMs;
+    acc.transfers++;
+    pthread_mutex_unlock(&_mutex);
+}
+
+/**
+ * The supervision timeout must outlast the longest silence the parameters allow: (1 + latency) intervals, twice.
+ */
+unsigned short LinkTuner::supervisionTimeout(unsigned short interval, unsigned short latency, unsigned short current) const
+{
+    unsigned int minimum = static_cast<unsigned int>(std::ceil((1 + latency) * interval * 2.5 / 10.0)) + 1;
+    if(minimum < 10)
+        minimum = 10;           // 100 ms, the smallest one allowed.
+    if(minimum > 3200)
+        minimum = 3200;         // 32 s, the largest one.
+
+    return (current >= minimum) ? current : static_cast<unsigned short>(minimum);
+}
+
+int LinkTuner::tune(unsigned int* changedLinks)
+{
+    std::map<unsigned short, Accumulator>   accumulators;
+    LinkTunerConfig                         config;
+    timespec                                now;
+    double                                  elapsed;
+
+    pthread_mutex_lock(&_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - _round_started.tv_sec) + (now.tv_nsec - _round_started.tv_nsec) / 1e9;
+    _round_started = now;
+    accumulators.swap(_accumulators);
+    config = _config;
+    pthread_mutex_unlock(&_mutex);
+
+    if(changedLinks != NULL)
+        *changedLinks = 0;
+    if(elapsed <= 0)
+        return Tx_Success;
+
+    std::vector<LinkInfo>           links = _communicator->getLinks();
+    std::vector<LinkTunerSample>    round(links.size());
+    std::vector<double>             demand(links.size()), share(links.size(), 0.0);
+    std::vector<bool>               capped(links.size(), false);
+
+    const double floorrate  = eventsPerSecond(config.max_interval);
+    const double ceilrate   = eventsPerSecond(config.min_interval);
+
+    // Demand of each link, in connection events per second.
+    for(size_t i = 0; i < links.size(); i++)
+    {
+        LinkTunerSample& sample = round[i];
+        Accumulator acc = accumulators[links[i].conn_handle];
+
+        sample.conn_handle      = links[i].conn_handle;
+        sample.interval         = links[i].conn_interval;
+        sample.goodput_bps      = acc.bytes / elapsed;
+        sample.latency_avg_ms   = (acc.transfers > 0) ? acc.latency_total_ms / acc.transfers : 0.0;
+        sample.utilization      = sample.goodput_bps / (config.bytes_per_event * eventsPerSecond(sample.interval > 0 ? sample.interval : 1));
+
+        demand[i] = sample.goodput_bps / config.bytes_per_event;
+        if(sample.latency_avg_ms > config.target_latency_ms)
+            demand[i] *= sample.latency_avg_ms / config.target_latency_ms;
+        if(demand[i] < floorrate)
+            demand[i] = floorrate;
+    }
+
+    // Shares the budget in proportion to the demand. Links that hit the shortest interval give the rest back.
+    double budget = config.budget_events_per_second;
+    bool recapped = true;
+    while(recapped)
+    {
+        double total = 0;
+        recapped = false;
+
+        for(size_t i = 0; i < links.size(); i++)
+        {
+            if(!capped[i])
+                total += demand[i];
+        }
+        if(total <= 0)
+            break;
+
+        for(size_t i = 0; i < links.size(); i++)
+        {
+            if(capped[i])
+                continue;
+
+            share[i] = budget * demand[i] / total;
+            if(share[i] >= ceilrate)
+            {
+                share[i]    = ceilrate;
+                capped[i]   = true;
+                budget     -= ceilrate;
+                recapped    = true;
+            }
+        }
+    }
+
+    unsigned int changed = 0;
+    for(size_t i = 0; i < links.size(); i++)
+    {
+        LinkTunerSample& sample = round[i];
+
+        double target = (share[i] > 0) ? std::ceil(800.0 / share[i]) : config.max_interval;
+        if(target < config.min_interval)
+            target = config.min_interval;
+        if(target > config.max_interval)
+            target = config.max_interval;
+
+        // At most a factor of two per round.
+        double current = (sample.interval > 0) ? sample.interval : config.max_interval;
+        if(target < current / 2)
+            target = std::ceil(current / 2);
+        if(target > current * 2)
+            target = current * 2;
+
+        sample.target_interval = static_cast<unsigned short>(target);
+
+        if(std::fabs(target - current) / current < config.hysteresis)
+            continue;
+
+        #ifdef CC2540_DEBUGMODE
+        std::cout << "LinkTuner: link " << sample.conn_handle << " from interval " << sample.interval << " to " << sample.target_interval
+                  << " (goodput " << sample.goodput_bps << " B/s, utilization " << sample.utilization << ")" << std::endl;
+        #endif
+
+        int result = _communicator->txUpdateLinkParams(sample.conn_handle, sample.target_interval, sample.target_interval, links[i].conn_latency,
+                                                       supervisionTimeout(sample.target_interval, links[i].conn_latency, links[i].conn_timeout));
+        if(result != Tx_Success)
+        {
+            pthread_mutex_lock(&_mutex);
+            _last_round = round;
+            pthread_mutex_unlock(&_mutex);
+            return result;
+        }
+        changed++;
+        if(changedLinks != NULL)
+            *changedLinks = changed;
+    }
+
+    pthread_mutex_lock(&_mutex);
+    _last_round = round;
+    pthread_mutex_unlock(&_mutex);
+
+    return Tx_Success;
+}
+
+std::vector<LinkTunerSample> LinkTuner::getLastRound()
+{
+    std::vector<LinkTunerSample> retval;
+    pthread_mutex_lock(&_mutex);
+    retval = _last_round;
+    pthread_mutex_unlock(&_mutex);
+    return retval;
+}
@@ -0,0 +1,96 @@
+#ifndef LINKTUNER_H
+#define LINKTUNER_H
+
+#include "cc2540communicator.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <map>
+
+/**
+ * Limits for LinkTuner. Intervals are in 1.25 ms units.
+ */
+struct LinkTunerConfig
+{
+    double          budget_events_per_second;   // Connection events per second shared by all links.
+    unsigned short  min_interval, max_interval;
+    unsigned int    bytes_per_event;            // Payload one connection event can carry, to estimate how busy a link is.
+    double          target_latency_ms;          // Links slower than this get a bigger share.
+    double          hysteresis;                 // Relative change below which a link is left alone.
+
+    LinkTunerConfig() :
+        budget_events_per_second    (400),
+        min_interval                (6),        // 7.5 ms
+        max_interval                (400),      // 500 ms
+        bytes_per_event             (80),       // 4 packets of 20 bytes.
+        target_latency_ms           (50),
+        hysteresis                  (0.1)
+    {}
+};
+
+/**
+ * What LinkTuner measured for a link in its last round.
+ */
+struct LinkTunerSample
+{
+    unsigned short  conn_handle;
+    double          goodput_bps;                // Application bytes per second.
+    double          latency_avg_ms;
+    double          utilization;                // Goodput over what the link could carry at its interval.
+    unsigned short  interval, target_interval;
+};
+
+/**
+ * Moves the connection interval of every link toward the shortest one the overall budget allows.
+ *
+ * The application reports each transfer with recordTransfer(), from any thread. Each tune() turns the reports since the
+ * previous round into a goodput and a latency per link, shares the connection event budget among the links in proportion
+ * to their demand (no link getting more than min_interval allows), and sends GAP_UpdateLinkParamReq for the links whose
+ * interval should change. A link moves at most by a factor of two per round, so one burst doesn't reshuffle everything.
+ * tune() talks to the dongle, so it must be called from the thread that drives the communicator.
+ */
+class LinkTuner
+{
+private:
+    struct Accumulator
+    {
+        unsigned long long  bytes;
+        double              latency_total_ms;
+        unsigned long       transfers;
+    };
+
+    CC2540Communicator*                     _communicator;
+    LinkTunerConfig                         _config;
+
+    std::map<unsigned short, Accumulator>   _accumulators;
+    timespec                                _round_started;
+    std::vector<LinkTunerSample>            _last_round;
+
+    pthread_mutex_t                         _mutex;
+
+    unsigned short  supervisionTimeout(unsigned short interval, unsigned short latency, unsigned short current) const;
+
+public:
+    LinkTuner(CC2540Communicator* communicator, const LinkTunerConfig& config = LinkTunerConfig());
+
+    void            setConfig(const LinkTunerConfig& config);
+    LinkTunerConfig getConfig();
+
+    /**
+     * Reports bytes moved over a link, and how long they took from being queued to being acknowledged.
+     */
+    void            recordTransfer(unsigned short connHandle, size_t bytes, double latencyMs);
+
+    /**
+     * Ends a measuring round and updates the links. Returns Tx_Success, or the first error (a TxErrors code or the status
+     * of the controller); changedLinks, if given, says how many links were asked to change before it.
+     */
+    int             tune(unsigned int* changedLinks = NULL);
+
+    /**
+     * The measurements and targets of the last tune().
+     */
+    std::vector<LinkTunerSample>    getLastRound();
+};
+
+#endif // LINKTUNER_H
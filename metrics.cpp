@@ -0,0 +1,251 @@
+#include "metrics.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <errno.h>
+#include <sys/time.h>
+
+__thread Metrics::ThreadBlock* Metrics::_local = NULL;
+Metrics::ThreadBlock* Metrics::_blocks = NULL;
+Metrics::GaugeCell Metrics::_gauges[METRIC_GAUGE_COUNT];
+
+static pthread_mutex_t  metricsRegistryMutex    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t   metricsKeyOnce          = PTHREAD_ONCE_INIT;
+static pthread_key_t    metricsKey;
+
+static const char* counterNames[METRIC_COUNTER_COUNT] =
+{
+    "cc2540_frames_in_total",
+    "cc2540_frames_out_total",
+    "cc2540_bytes_in_total",
+    "cc2540_bytes_out_total",
+    "cc2540_usb_timeouts_total",
+    "cc2540_usb_pipe_errors_total",
+    "cc2540_usb_other_errors_total",
+    "cc2540_rx_malformed_total",
+    "cc2540_rx_too_short_total",
+    "cc2540_discovery_scans_total",
+    "cc2540_devices_discovered_total",
+    "cc2540_devices_filtered_total",
+    "cc2540_usb_halts_cleared_total",
+    "cc2540_usb_resets_total",
+    "cc2540_rx_resync_drops_total"
+};
+
+static const char* gaugeNames[METRIC_GAUGE_COUNT] =
+{
+    "cc2540_frames_in_use",
+    "cc2540_event_queue_depth",
+    "cc2540_hci_cmd_credits",
+    "cc2540_links",
+    "cc2540_last_scan_devices"
+};
+
+void Metrics::createKey()
+{
+    pthread_key_create(&metricsKey, unregisterThread);
+}
+
+Metrics::ThreadBlock* Metrics::registerThread()
+{
+    ThreadBlock* block;
+
+    pthread_once(&metricsKeyOnce, createKey);
+
+    pthread_mutex_lock(&metricsRegistryMutex);
+
+    // A block left by a finished thread keeps its counts, and goes on from there.
+    for(block = _blocks; block != NULL; block = block->next)
+    {
+        if(!block->in_use)
+            break;
+    }
+
+    if(block == NULL)
+    {
+        void* memory;
+        if(posix_memalign(&memory, METRICS_CACHE_LINE, sizeof(ThreadBlock)) != 0)
+            abort();
+
+        block = static_cast<ThreadBlock*>(memory);
+        memset(block, 0, sizeof(ThreadBlock));
+        block->next     = _blocks;
+        _blocks         = block;
+    }
+    block->in_use = true;
+
+    pthread_mutex_unlock(&metricsRegistryMutex);
+
+    // Key destructors only run for non-NULL values, so the block itself is the value.
+    pthread_setspecific(metricsKey, block);
+    _local = block;
+    return block;
+}
+
+void Metrics::unregisterThread(void* castedBlock)
+{
+    pthread_mutex_lock(&metricsRegistryMutex);
+    static_cast<ThreadBlock*>(castedBlock)->in_use = false;
+    pthread_mutex_unlock(&metricsRegistryMutex);
+}
+
+void Metrics::setGauge(MetricGauge which, int64_t value)
+{
+    __atomic_store_n(&(_gauges[which].value), value, __ATOMIC_RELAXED);
+}
+
+void Metrics::addGauge(MetricGauge which, int64_t delta)
+{
+    __atomic_fetch_add(&(_gauges[which].value), delta, __ATOMIC_RELAXED);
+}
+
+void Metrics::snapshot(MetricsSnapshot* out)
+{
+    struct timeval now;
+
+    memset(out->counters, 0, sizeof(out->counters));
+
+    pthread_mutex_lock(&metricsRegistryMutex);
+    for(ThreadBlock* block = _blocks; block != NULL; block = block->next)
+    {
+        for(int i = 0; i < METRIC_COUNTER_COUNT; i++)
+            out->counters[i] += __atomic_load_n(&(block->counters[i]), __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&metricsRegistryMutex);
+
+    for(int i = 0; i < METRIC_GAUGE_COUNT; i++)
+        out->gauges[i] = __atomic_load_n(&(_gauges[i].value), __ATOMIC_RELAXED);
+
+    gettimeofday(&now, NULL);
+    out->timestamp_ms = static_cast<uint64_t>(now.tv_sec) * 1000 + now.tv_usec / 1000;
+}
+
+const char* Metrics::counterName(MetricCounter which)
+{
+    return counterNames[which];
+}
+
+const char* Metrics::gaugeName(MetricGauge which)
+{
+    return gaugeNames[which];
+}
+
+bool Metrics::writePrometheus(const std::string& path)
+{
+    MetricsSnapshot snap;
+    std::string     temppath = path + ".tmp";
+    FILE*           file;
+
+    snapshot(&snap);
+
+    file = fopen(temppath.c_str(), "w");
+    if(file == NULL)
+        return false;
+
+    for(int i = 0; i < METRIC_COUNTER_COUNT; i++)
+    {
+        fprintf(file, "# TYPE %s counter\n", counterNames[i]);
+        fprintf(file, "%s %llu\n", counterNames[i], static_cast<unsigned long long>(snap.counters[i]));
+    }
+
+    for(int i = 0; i < METRIC_GAUGE_COUNT; i++)
+    {
+        fprintf(file, "# TYPE %s gauge\n", gaugeNames[i]);
+        fprintf(file, "%s %lld\n", gaugeNames[i], static_cast<long long>(snap.gauges[i]));
+    }
+
+    if(fclose(file) != 0)
+    {
+        remove(temppath.c_str());
+        return false;
+    }
+
+    return rename(temppath.c_str(), path.c_str()) == 0;
+}
+
+void* __metricsWriterEntry(void* castedWriter)
+{
+    static_cast<MetricsWriter*>(castedWriter)->writerMethod();
+    return NULL;
+}
+
+MetricsWriter::MetricsWriter(const std::string& path, unsigned int intervalMs) :
+    _path           (path),
+    _interval_ms    (intervalMs > 0 ? intervalMs : 1),
+    _running        (false)
+{
+    _mutex  = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+    _cond   = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+}
+
+MetricsWriter::~MetricsWriter()
+{
+    stop();
+}
+
+bool MetricsWriter::start()
+{
+    pthread_mutex_lock(&_mutex);
+    if(_running)
+    {
+        pthread_mutex_unlock(&_mutex);
+        return true;
+    }
+    _running = true;
+    pthread_mutex_unlock(&_mutex);
+
+    if(pthread_create(&_thread, NULL, __metricsWriterEntry, this) != 0)
+    {
+        _running = false;
+        return false;
+    }
+    return true;
+}
+
+void MetricsWriter::stop()
+{
+    pthread_mutex_lock(&_mutex);
+    if(!_running)
+    {
+        pthread_mutex_unlock(&_mutex);
+        return;
+    }
+    _running = false;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+
+    pthread_join(_thread, NULL);
+}
+
+void MetricsWriter::writerMethod()
+{
+    pthread_mutex_lock(&_mutex);
+    while(_running)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec     += _interval_ms / 1000;
+        deadline.tv_nsec    += (_interval_ms % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while(_running && pthread_cond_timedwait(&_cond, &_mutex, &deadline) != ETIMEDOUT)
+            ;
+
+        if(!_running)
+            break;
+
+        pthread_mutex_unlock(&_mutex);
+        Metrics::writePrometheus(_path);
+        pthread_mutex_lock(&_mutex);
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    // One last time, so the file shows the final counts.
+    Metrics::writePrometheus(_path);
+}
@@ -0,0 +1,135 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+
+#define METRICS_CACHE_LINE  64
+
+enum MetricCounter
+{
+    Metric_FramesIn         = 0,
+    Metric_FramesOut,
+    Metric_BytesIn,
+    Metric_BytesOut,
+    Metric_UsbTimeouts,
+    Metric_UsbPipeErrors,
+    Metric_UsbOtherErrors,
+    Metric_RxMalformed,
+    Metric_RxTooShort,
+    Metric_DiscoveryScans,
+    Metric_DevicesDiscovered,
+    Metric_DevicesFiltered,
+    Metric_UsbHaltsCleared,
+    Metric_UsbResets,
+    Metric_RxResyncDrops,
+
+    METRIC_COUNTER_COUNT
+};
+
+enum MetricGauge
+{
+    Gauge_FramesInUse       = 0,
+    Gauge_EventQueueDepth,
+    Gauge_HciCmdCredits,
+    Gauge_Links,
+    Gauge_LastScanDevices,
+
+    METRIC_GAUGE_COUNT
+};
+
+/**
+ * Sum of every thread's counters plus the gauges, at one point in time. Each value is read atomically; counters never
+ * go backwards from one snapshot to the next.
+ */
+struct MetricsSnapshot
+{
+    uint64_t    counters[METRIC_COUNTER_COUNT];
+    int64_t     gauges[METRIC_GAUGE_COUNT];
+    uint64_t    timestamp_ms;                   // CLOCK_REALTIME, as Prometheus wants it.
+};
+
+/**
+ * Process-wide counters and gauges, cheap enough to be left on in the receive path.
+ *
+ * Every thread counts into its own cache-line-aligned block, found through a thread-local pointer, so counting is a
+ * relaxed atomic add on a line no other thread writes. Gauges are shared (the last writer wins), one per cache line.
+ * Blocks of finished threads are kept, and reused by new threads, so nothing counted is ever lost.
+ */
+class Metrics
+{
+private:
+    struct ThreadBlock
+    {
+        uint64_t        counters[METRIC_COUNTER_COUNT];
+        ThreadBlock*    next;
+        bool            in_use;
+    } __attribute__((aligned(METRICS_CACHE_LINE)));
+
+    struct GaugeCell
+    {
+        int64_t         value;
+    } __attribute__((aligned(METRICS_CACHE_LINE)));
+
+    static __thread ThreadBlock*    _local;
+    static ThreadBlock*             _blocks;
+    static GaugeCell                _gauges[METRIC_GAUGE_COUNT];
+
+    static ThreadBlock* registerThread();
+    static void         createKey();
+    static void         unregisterThread(void* castedBlock);
+
+public:
+    static inline void  count(MetricCounter which, uint64_t amount = 1)
+    {
+        ThreadBlock* block = _local;
+        if(block == NULL)
+            block = registerThread();
+
+        __atomic_fetch_add(&(block->counters[which]), amount, __ATOMIC_RELAXED);
+    }
+
+    static void         setGauge(MetricGauge which, int64_t value);
+    static void         addGauge(MetricGauge which, int64_t delta);
+
+    static void         snapshot(MetricsSnapshot* out);
+
+    static const char*  counterName(MetricCounter which);
+    static const char*  gaugeName(MetricGauge which);
+
+    /**
+     * Writes a snapshot in the Prometheus text exposition format. The file is written aside and renamed over, so a
+     * scraper never reads half of it.
+     */
+    static bool         writePrometheus(const std::string& path);
+};
+
+/**
+ * Background thread that calls Metrics::writePrometheus() every few seconds, e.g. for node_exporter's textfile
+ * collector.
+ */
+class MetricsWriter
+{
+private:
+    std::string         _path;
+    unsigned int        _interval_ms;
+    bool                _running;
+
+    pthread_t           _thread;
+    pthread_mutex_t     _mutex;
+    pthread_cond_t      _cond;
+
+    void                writerMethod();
+
+    friend void*        __metricsWriterEntry(void* castedWriter);
+
+public:
+    MetricsWriter(const std::string& path, unsigned int intervalMs = 5000);
+    ~MetricsWriter();
+
+    bool                start();
+    void                stop();
+};
+
+#endif // METRICS_H
@@ -0,0 +1,187 @@
+#include "realtime.h"
+
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#define PREFAULT_STACK_SIZE     (64 * 1024)
+#define PREFAULT_PAGE_SIZE      4096
+
+JitterRecorder::JitterRecorder() :
+    _reset_requested    (0)
+{
+    clear();
+}
+
+void JitterRecorder::clear()
+{
+    memset(_buckets, 0, sizeof(_buckets));
+    _samples    = 0;
+    _sum_us     = 0;
+    _misses     = 0;
+    _min_us     = UINT32_MAX;
+    _max_us     = 0;
+}
+
+/**
+ * Values under 8 get a bucket each. Above, every power of two is split in 8 buckets, keyed by the 3 bits after the top one.
+ */
+unsigned int JitterRecorder::bucketOf(uint32_t us)
+{
+    if(us < 8)
+        return us;
+
+    unsigned int msb = 31 - __builtin_clz(us);
+    return (msb - 2) * 8 + ((us >> (msb - 3)) & 7);
+}
+
+uint32_t JitterRecorder::bucketUpperBound(unsigned int bucket)
+{
+    if(bucket < 8)
+        return bucket;
+
+    unsigned int    msb = bucket / 8 + 2;
+    uint64_t        width = 1ULL << (msb - 3);
+    return static_cast<uint32_t>((8 + bucket % 8) * width + width - 1);
+}
+
+void JitterRecorder::record(uint32_t us, uint32_t deadlineUs)
+{
+    if(__atomic_load_n(&_reset_requested, __ATOMIC_ACQUIRE))
+    {
+        clear();
+        __atomic_store_n(&_reset_requested, 0, __ATOMIC_RELEASE);
+    }
+
+    // Only this thread writes: plain stores are enough, atomic just so readers never see half of a value.
+    unsigned int bucket = bucketOf(us);
+    __atomic_store_n(&(_buckets[bucket]), _buckets[bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&_sum_us, _sum_us + us, __ATOMIC_RELAXED);
+    if(deadlineUs > 0 && us > deadlineUs)
+        __atomic_store_n(&_misses, _misses + 1, __ATOMIC_RELAXED);
+    if(us < _min_us)
+        __atomic_store_n(&_min_us, us, __ATOMIC_RELAXED);
+    if(us > _max_us)
+        __atomic_store_n(&_max_us, us, __ATOMIC_RELAXED);
+    __atomic_store_n(&_samples, _samples + 1, __ATOMIC_RELEASE);
+}
+
+JitterReport JitterRecorder::report(bool reset)
+{
+    JitterReport    retval;
+    uint64_t        counts[JITTER_BUCKETS];
+    uint64_t        total = 0;
+
+    retval.samples          = __atomic_load_n(&_samples, __ATOMIC_ACQUIRE);
+    retval.deadline_misses  = __atomic_load_n(&_misses, __ATOMIC_RELAXED);
+    retval.min_us           = __atomic_load_n(&_min_us, __ATOMIC_RELAXED);
+    retval.max_us           = __atomic_load_n(&_max_us, __ATOMIC_RELAXED);
+    uint64_t sum            = __atomic_load_n(&_sum_us, __ATOMIC_RELAXED);
+
+    for(unsigned int i = 0; i < JITTER_BUCKETS; i++)
+    {
+        counts[i]   = __atomic_load_n(&(_buckets[i]), __ATOMIC_RELAXED);
+        total      += counts[i];
+    }
+
+    if(retval.samples == 0)
+        retval.min_us = 0;
+    retval.avg_us = (retval.samples > 0) ? static_cast<double>(sum) / retval.samples : 0.0;
+
+    // The buckets may be a sample or two ahead of the totals read above: percentiles go by the buckets alone.
+    uint64_t targets[3] = { (total * 50 + 99) / 100, (total * 990 + 999) / 1000, (total * 999 + 999) / 1000 };
+    uint32_t* results[3] = { &retval.p50_us, &retval.p99_us, &retval.p999_us };
+    uint64_t seen = 0;
+    unsigned int next = 0;
+
+    for(unsigned int i = 0; i < JITTER_BUCKETS && next < 3; i++)
+    {
+        seen += counts[i];
+        while(next < 3 && total > 0 && seen >= targets[next])
+            *(results[next++]) = bucketUpperBound(i);
+    }
+    while(next < 3)
+        *(results[next++]) = 0;
+
+    if(reset)
+        __atomic_store_n(&_reset_requested, 1, __ATOMIC_RELEASE);
+    return retval;
+}
+
+uint32_t JitterRecorder::elapsedUs(const timespec& from, const timespec& to)
+{
+    int64_t us = (static_cast<int64_t>(to.tv_sec) - from.tv_sec) * 1000000 + (to.tv_nsec - from.tv_nsec) / 1000;
+    if(us < 0)
+        return 0;
+    if(us > UINT32_MAX)
+        return UINT32_MAX;
+    return static_cast<uint32_t>(us);
+}
+
+void applyThreadRealtime(const RealtimeConfig& config, bool* affinitySet, bool* schedulingSet, std::string* problems)
+{
+    char message[128];
+    int  err;
+
+    *affinitySet    = false;
+    *schedulingSet  = false;
+
+    if(config.cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(config.cpu, &cpus);
+
+        err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if(err == 0)
+        {
+            *affinitySet = true;
+        }
+        else
+        {
+            snprintf(message, sizeof(message), "Could not pin the receiver thread to CPU %d: %s.\n", config.cpu, strerror(err));
+            problems->append(message);
+        }
+    }
+
+    if(config.priority > 0)
+    {
+        sched_param param;
+        param.sched_priority = config.priority;
+        if(param.sched_priority > sched_get_priority_max(SCHED_FIFO))
+            param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+
+        // Without CAP_SYS_NICE (or an RLIMIT_RTPRIO allowing it) this fails with EPERM, and the thread stays as it was.
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if(err == 0)
+        {
+            *schedulingSet = true;
+        }
+        else
+        {
+            snprintf(message, sizeof(message), "Could not set SCHED_FIFO priority %d: %s.\n", param.sched_priority, strerror(err));
+            problems->append(message);
+        }
+    }
+
+    // Maps the stack the thread is going to use now, instead of on its first deep call.
+    if(config.lock_memory)
+    {
+        volatile unsigned char stack[PREFAULT_STACK_SIZE];
+        for(size_t i = 0; i < sizeof(stack); i += PREFAULT_PAGE_SIZE)
+            stack[i] = 0;
+    }
+}
+
+bool lockProcessMemory(std::string* problems)
+{
+    if(mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+        return true;
+
+    char message[128];
+    snprintf(message, sizeof(message), "Could not lock the process memory: %s.\n", strerror(errno));
+    problems->append(message);
+    return false;
+}
@@ -0,0 +1,105 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+#define JITTER_BUCKETS          240         // 8 per power of two, up to 2^32 us.
+
+/**
+ * Low-latency settings for the receiver thread (see SerialCommunicator::setRealtimeMode()). The default leaves everything
+ * as the system gives it.
+ */
+struct RealtimeConfig
+{
+    int             cpu;                // CPU the thread is pinned to, or -1 for any.
+    int             priority;           // SCHED_FIFO priority (1 to 99), or 0 to keep the normal scheduling.
+    bool            busy_poll;          // Spins on the transfer completion instead of sleeping in the kernel. Takes a whole CPU.
+    bool            lock_memory;        // Prefaults the frame pool and locks the process memory, so no page fault stalls a frame.
+    unsigned int    deadline_us;        // Dispatch latencies above this are counted as misses.
+
+    RealtimeConfig() :
+        cpu             (-1),
+        priority        (0),
+        busy_poll       (false),
+        lock_memory     (false),
+        deadline_us     (1000)
+    {}
+};
+
+/**
+ * Distribution of one latency, in microseconds. Percentiles are bucket upper bounds: at most 12.5 % above the real value.
+ */
+struct JitterReport
+{
+    uint64_t        samples;
+    uint64_t        deadline_misses;
+    uint32_t        min_us, max_us;
+    double          avg_us;
+    uint32_t        p50_us, p99_us, p999_us;
+};
+
+/**
+ * What the receiver thread got, and how it's doing. dispatch is the time from the USB transfer completing to atReceiving()
+ * being called; handler is how long atReceiving() took.
+ */
+struct RealtimeReport
+{
+    bool            affinity_set;
+    bool            scheduling_set;
+    bool            memory_locked;
+    std::string     problems;           // Why the settings that weren't applied weren't, usually missing privileges.
+
+    JitterReport    dispatch;
+    JitterReport    handler;
+};
+
+/**
+ * Log-linear latency histogram, written by one thread and read by any other without locks, so a real-time thread never
+ * waits on a reader. A reset asked by a reader is carried out by the writer, at its next sample.
+ */
+class JitterRecorder
+{
+private:
+    uint64_t                _buckets[JITTER_BUCKETS];
+    volatile uint64_t       _samples;
+    volatile uint64_t       _sum_us;
+    volatile uint64_t       _misses;
+    volatile uint32_t       _min_us, _max_us;
+    volatile int            _reset_requested;
+
+    static unsigned int     bucketOf(uint32_t us);
+    static uint32_t         bucketUpperBound(unsigned int bucket);
+
+    void            clear();
+
+public:
+    JitterRecorder();
+
+    /**
+     * Only from the thread that owns the recorder.
+     */
+    void            record(uint32_t us, uint32_t deadlineUs);
+
+    JitterReport    report(bool reset = false);
+
+    /**
+     * Microseconds from one CLOCK_MONOTONIC reading to another, saturated at 0 and UINT32_MAX.
+     */
+    static uint32_t elapsedUs(const timespec& from, const timespec& to);
+};
+
+/**
+ * Pins the calling thread and sets its scheduling as the config says, and touches its stack so that it's already mapped.
+ * Whatever couldn't be done is described in problems; nothing throws.
+ */
+void            applyThreadRealtime(const RealtimeConfig& config, bool* affinitySet, bool* schedulingSet, std::string* problems);
+
+/**
+ * mlockall() of everything mapped now and in the future. Usually needs CAP_IPC_LOCK, or a high enough RLIMIT_MEMLOCK.
+ */
+bool            lockProcessMemory(std::string* problems);
+
+#endif // REALTIME_H
@@ -0,0 +1,285 @@
+#include "rssistore.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Plain version of the window statistics. Used for windows not filled yet, and everywhere without SSE2.
+ */
+static void scalarWindowStats(const int8_t* window, unsigned int head, unsigned int count, RssiStats* out)
+{
+    // A window not filled yet hasn't wrapped: its oldest sample is the first one.
+    unsigned int    start = (count < RSSI_WINDOW) ? 0 : head;
+    int32_t         sum = 0, sumsq = 0, sumxy = 0;
+    int8_t          minval = 127, maxval = -128;
+
+    for(unsigned int i = 0; i < count; i++)
+    {
+        int8_t y = window[(start + i) % RSSI_WINDOW];
+        sum     += y;
+        sumsq   += y * y;
+        sumxy   += static_cast<int32_t>(i) * y;
+        if(y < minval) minval = y;
+        if(y > maxval) maxval = y;
+    }
+
+    out->samples    = count;
+    out->min        = (count > 0) ? minval : 0;
+    out->max        = (count > 0) ? maxval : 0;
+    out->mean       = (count > 0) ? static_cast<float>(sum) / count : 0.0f;
+    out->variance   = (count > 0) ? static_cast<float>(sumsq) / count - out->mean * out->mean : 0.0f;
+
+    // Least squares over x = 0..count-1.
+    float n = count, sumx = n * (n - 1) / 2, sumxx = (n - 1) * n * (2 * n - 1) / 6;
+    float denominator = n * sumxx - sumx * sumx;
+    out->slope      = (denominator != 0.0f) ? (n * sumxy - sumx * sum) / denominator : 0.0f;
+}
+
+#ifdef __SSE2__
+static inline int32_t horizontalSum32(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4E));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xB1));
+    return _mm_cvtsi128_si32(v);
+}
+
+static inline int16_t horizontalMin16(__m128i v)
+{
+    v = _mm_min_epi16(v, _mm_shuffle_epi32(v, 0x4E));
+    v = _mm_min_epi16(v, _mm_shuffle_epi32(v, 0xB1));
+    v = _mm_min_epi16(v, _mm_shufflelo_epi16(v, 0xB1));
+    return static_cast<int16_t>(_mm_extract_epi16(v, 0));
+}
+
+static inline int16_t horizontalMax16(__m128i v)
+{
+    v = _mm_max_epi16(v, _mm_shuffle_epi32(v, 0x4E));
+    v = _mm_max_epi16(v, _mm_shuffle_epi32(v, 0xB1));
+    v = _mm_max_epi16(v, _mm_shufflelo_epi16(v, 0xB1));
+    return static_cast<int16_t>(_mm_extract_epi16(v, 0));
+}
+
+/**
+ * Statistics of a full window (RSSI_WINDOW = 32 samples, 16-byte aligned) with SSE2. The samples are summed in storage
+ * order, and the trend is brought back to time order afterwards: the oldest sample is the one at head.
+ */
+static void sse2WindowStats(const int8_t* window, unsigned int head, RssiStats* out)
+{
+    const __m128i   ones = _mm_set1_epi16(1);
+    const __m128i   headvec = _mm_set1_epi16(static_cast<short>(head));
+    __m128i         y[4], index[4];
+
+    __m128i raw0 = _mm_load_si128(reinterpret_cast<const __m128i*>(window));
+    __m128i raw1 = _mm_load_si128(reinterpret_cast<const __m128i*>(window + 16));
+
+    // Sign extension to 16 bits: each byte into the high half, then an arithmetic shift down.
+    y[0] = _mm_srai_epi16(_mm_unpacklo_epi8(raw0, raw0), 8);
+    y[1] = _mm_srai_epi16(_mm_unpackhi_epi8(raw0, raw0), 8);
+    y[2] = _mm_srai_epi16(_mm_unpacklo_epi8(raw1, raw1), 8);
+    y[3] = _mm_srai_epi16(_mm_unpackhi_epi8(raw1, raw1), 8);
+
+    index[0] = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+    index[1] = _mm_add_epi16(index[0], _mm_set1_epi16(8));
+    index[2] = _mm_add_epi16(index[0], _mm_set1_epi16(16));
+    index[3] = _mm_add_epi16(index[0], _mm_set1_epi16(24));
+
+    __m128i sum16 = _mm_setzero_si128(), before16 = _mm_setzero_si128();
+    __m128i sumsq = _mm_setzero_si128(), sumjy = _mm_setzero_si128();
+    __m128i minval = y[0], maxval = y[0];
+
+    for(int k = 0; k < 4; k++)
+    {
+        sum16       = _mm_add_epi16(sum16, y[k]);
+        before16    = _mm_add_epi16(before16, _mm_and_si128(y[k], _mm_cmplt_epi16(index[k], headvec)));
+        sumsq       = _mm_add_epi32(sumsq, _mm_madd_epi16(y[k], y[k]));
+        sumjy       = _mm_add_epi32(sumjy, _mm_madd_epi16(y[k], index[k]));
+        minval      = _mm_min_epi16(minval, y[k]);
+        maxval      = _mm_max_epi16(maxval, y[k]);
+    }
+
+    int32_t sum     = horizontalSum32(_mm_madd_epi16(sum16, ones));
+    int32_t before  = horizontalSum32(_mm_madd_epi16(before16, ones));
+
+    // Storage slot j holds the sample of age order (j - head) mod W.
+    int32_t sumxy   = horizontalSum32(sumjy) - static_cast<int32_t>(head) * sum + RSSI_WINDOW * before;
+
+    const float n = RSSI_WINDOW, sumx = n * (n - 1) / 2, sumxx = (n - 1) * n * (2 * n - 1) / 6;
+
+    out->samples    = RSSI_WINDOW;
+    out->min        = static_cast<int8_t>(horizontalMin16(minval));
+    out->max        = static_cast<int8_t>(horizontalMax16(maxval));
+    out->mean       = static_cast<float>(sum) / n;
+    out->variance   = static_cast<float>(horizontalSum32(sumsq)) / n - out->mean * out->mean;
+    out->slope      = (n * sumxy - sumx * sum) / (n * sumxx - sumx * sumx);
+}
+#endif
+
+RssiStore::RssiStore(size_t capacity) :
+    _capacity   (capacity > 0 ? capacity : 1),
+    _used       (0),
+    _dropped    (0)
+{
+    void* memory = NULL;
+    if(posix_memalign(&memory, 64, _capacity * RSSI_WINDOW) != 0)
+        memory = NULL;
+
+    _samples    = static_cast<int8_t*>(memory);
+    _heads      = new uint8_t[_capacity];
+    _counts     = new uint16_t[_capacity];
+    _last_seen  = new uint32_t[_capacity];
+    _devices    = new uint64_t[_capacity];
+
+    _mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+}
+
+RssiStore::~RssiStore()
+{
+    free(_samples);
+    delete[] _heads;
+    delete[] _counts;
+    delete[] _last_seen;
+    delete[] _devices;
+}
+
+uint32_t RssiStore::nowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint32_t>(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+void RssiStore::ingest(uint64_t device, int8_t rssi)
+{
+    uint32_t slot;
+
+    pthread_mutex_lock(&_mutex);
+
+    std::map<uint64_t, uint32_t>::iterator it = _index.find(device);
+    if(it != _index.end())
+    {
+        slot = it->second;
+    }
+    else
+    {
+        if(_samples == NULL || _used == _capacity)
+        {
+            _dropped++;
+            pthread_mutex_unlock(&_mutex);
+            return;
+        }
+
+        slot                = _used++;
+        _index[device]      = slot;
+        _devices[slot]      = device;
+        _heads[slot]        = 0;
+        _counts[slot]       = 0;
+    }
+
+    _samples[slot * RSSI_WINDOW + _heads[slot]] = rssi;
+    _heads[slot]        = (_heads[slot] + 1) % RSSI_WINDOW;
+    if(_counts[slot] < RSSI_WINDOW)
+        _counts[slot]++;
+    _last_seen[slot]    = nowMs();
+
+    pthread_mutex_unlock(&_mutex);
+}
+
+void RssiStore::windowStats(size_t slot, RssiStats* out) const
+{
+    const int8_t* window = _samples + slot * RSSI_WINDOW;
+
+    #ifdef __SSE2__
+    if(_counts[slot] == RSSI_WINDOW)
+        sse2WindowStats(window, _heads[slot], out);
+    else
+    #endif
+        scalarWindowStats(window, _heads[slot], _counts[slot], out);
+
+    out->device         = _devices[slot];
+    out->last_seen_ms   = _last_seen[slot];
+}
+
+size_t RssiStore::aggregate(std::vector<RssiStats>* out)
+{
+    pthread_mutex_lock(&_mutex);
+
+    out->resize(_used);
+    for(size_t slot = 0; slot < _used; slot++)
+        windowStats(slot, &((*out)[slot]));
+
+    pthread_mutex_unlock(&_mutex);
+    return out->size();
+}
+
+bool RssiStore::getStats(uint64_t device, RssiStats* out)
+{
+    bool found;
+
+    pthread_mutex_lock(&_mutex);
+    std::map<uint64_t, uint32_t>::iterator it = _index.find(device);
+    found = (it != _index.end());
+    if(found)
+        windowStats(it->second, out);
+    pthread_mutex_unlock(&_mutex);
+
+    return found;
+}
+
+size_t RssiStore::expire(uint32_t maxAgeMs)
+{
+    uint32_t    now = nowMs();
+    size_t      forgotten = 0;
+
+    pthread_mutex_lock(&_mutex);
+
+    size_t slot = 0;
+    while(slot < _used)
+    {
+        if(now - _last_seen[slot] <= maxAgeMs)
+        {
+            slot++;
+            continue;
+        }
+
+        // The last device moves into the hole, so the arrays stay dense.
+        size_t last = _used - 1;
+        _index.erase(_devices[slot]);
+        if(slot != last)
+        {
+            memcpy(_samples + slot * RSSI_WINDOW, _samples + last * RSSI_WINDOW, RSSI_WINDOW);
+            _heads[slot]        = _heads[last];
+            _counts[slot]       = _counts[last];
+            _last_seen[slot]    = _last_seen[last];
+            _devices[slot]      = _devices[last];
+            _index[_devices[slot]] = slot;
+        }
+        _used--;
+        forgotten++;
+    }
+
+    pthread_mutex_unlock(&_mutex);
+    return forgotten;
+}
+
+size_t RssiStore::getDeviceCount()
+{
+    size_t retval;
+    pthread_mutex_lock(&_mutex);
+    retval = _used;
+    pthread_mutex_unlock(&_mutex);
+    return retval;
+}
+
+unsigned long RssiStore::getDroppedCount()
+{
+    unsigned long retval;
+    pthread_mutex_lock(&_mutex);
+    retval = _dropped;
+    pthread_mutex_unlock(&_mutex);
+    return retval;
+}
@@ -0,0 +1,87 @@
+#ifndef RSSISTORE_H
+#define RSSISTORE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+#define RSSI_WINDOW     32      // Samples kept per device. The SIMD kernel is written for exactly this many.
+
+/**
+ * Window statistics of one device. The slope is in dBm per sample, positive when the device is getting closer.
+ */
+struct RssiStats
+{
+    uint64_t        device;         // Advertiser address, as given to RssiStore::ingest().
+    uint16_t        samples;
+    int8_t          min, max;
+    float           mean;
+    float           variance;
+    float           slope;
+    uint32_t        last_seen_ms;
+};
+
+/**
+ * Rolling RSSI windows for many advertisers, for presence detection.
+ *
+ * Stored as a structure of arrays: the windows of every device one after the other in a single aligned block, and the
+ * ring heads, sample counts and timestamps in their own arrays. Ingesting a sample is a lookup plus a byte store, and
+ * aggregate() goes through the whole block with SSE2 (or plain C++ where SSE2 isn't there).
+ */
+class RssiStore
+{
+private:
+    size_t                          _capacity;
+    size_t                          _used;
+
+    int8_t*                         _samples;           // _capacity * RSSI_WINDOW, device-major.
+    uint8_t*                        _heads;             // Next slot to write in each window.
+    uint16_t*                       _counts;            // Samples seen, up to RSSI_WINDOW.
+    uint32_t*                       _last_seen;         // Milliseconds, CLOCK_MONOTONIC.
+    uint64_t*                       _devices;
+
+    std::map<uint64_t, uint32_t>    _index;
+    unsigned long                   _dropped;
+
+    pthread_mutex_t                 _mutex;
+
+    static uint32_t     nowMs();
+    void                windowStats(size_t slot, RssiStats* out) const;
+
+    RssiStore(const RssiStore&);
+    RssiStore& operator = (const RssiStore&);
+
+public:
+    /**
+     * capacity is the most devices tracked at once. Samples from further devices are dropped (and counted) until
+     * expire() makes room.
+     */
+    RssiStore(size_t capacity);
+    ~RssiStore();
+
+    /**
+     * Adds a sample. Called from the receive path.
+     */
+    void            ingest(uint64_t device, int8_t rssi);
+
+    /**
+     * Window statistics for every device, in no particular order. Returns how many there are.
+     */
+    size_t          aggregate(std::vector<RssiStats>* out);
+
+    /**
+     * Statistics of a single device. Returns false if it isn't tracked.
+     */
+    bool            getStats(uint64_t device, RssiStats* out);
+
+    /**
+     * Forgets the devices not heard for maxAgeMs. Returns how many were forgotten.
+     */
+    size_t          expire(uint32_t maxAgeMs);
+
+    size_t          getDeviceCount();
+    unsigned long   getDroppedCount();
+};
+
+#endif // RSSISTORE_H
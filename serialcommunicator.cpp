@@ -1,4 +1,6 @@
 #include "serialcommunicator.h"
+#include "hcischema.h"
+#include "metrics.h"
 
 #include <iostream>
 #include <stdio.h>
@@ -8,7 +10,37 @@
 
 //#define     LIBUSB_DEBUG_OUTPUT
 
-#define     RECV_BUFFER_SIZE        260
+#define     RECV_BUFFER_SIZE        FRAME_BUFFER_SIZE
+
+/**
+ * Where received bytes stand as an HCI event: whole (maybe with the start of the next one after it, when two events come
+ * in one transfer), cut short (the rest is still to come), or not an event at all.
+ */
+enum HciFrameState
+{
+    HciFrame_Complete,
+    HciFrame_Partial,
+    HciFrame_Garbage
+};
+
+static HciFrameState checkHciFrame(const unsigned char* data, size_t length, size_t* frameLength)
+{
+    if(length == 0)
+        return HciFrame_Partial;
+    if(data[0] != RX_TYPE_EVENT)
+        return HciFrame_Garbage;
+    if(length < 3)
+        return HciFrame_Partial;
+
+    *frameLength = 3 + data[2];
+    return (length < *frameLength) ? HciFrame_Partial : HciFrame_Complete;
+}
+
+static unsigned int elapsedMs(const timespec& from, const timespec& to)
+{
+    long ms = (to.tv_sec - from.tv_sec) * 1000 + (to.tv_nsec - from.tv_nsec) / 1000000;
+    return (ms > 0) ? static_cast<unsigned int>(ms) : 0;
+}
 
 SerialCommunicator::SerialCommunicator() :
     _usbctx         (NULL),
@@ -16,7 +48,29 @@ SerialCommunicator::SerialCommunicator() :
     _usbhandle      (NULL),
 
     _device_ready   (false),
-    _communicating  (false)
+    _communicating  (false),
+    _receiver_started   (false),
+
+    _frame_pool     (FRAME_POOL_SIZE),
+    _recvstack_head (0),
+
+    _recv_transfer      (NULL),
+    _recv_completed     (0),
+    _recv_stop          (0),
+
+    _rt_affinity_set    (false),
+    _rt_scheduling_set  (false),
+    _rt_memory_locked   (false),
+    _rt_applied         (false),
+
+    _hotplug_enabled    (false),
+    _hotplug_stop       (0),
+    _arrived_device     (NULL),
+    _device_left        (false),
+    _resume_receiving   (false),
+
+    _recovering         (0),
+    _halts_in_a_row     (0)
 {
     libusb_init(&_usbctx);
     #ifdef LIBUSB_DEBUG_OUTPUT
@@ -31,14 +85,22 @@ SerialCommunicator::SerialCommunicator() :
     _recvlock_mutex     = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
     _recvlock_cond      = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
 
-    //_recv_buffer_data   = new unsigned char[RECV_BUFFER_SIZE];
+    _hotplug_mutex      = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+    _receiver_control_mutex = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+    _realtime_mutex     = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+    _realtime_cond      = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+
+    _io_lock            = (pthread_rwlock_t) PTHREAD_RWLOCK_INITIALIZER;
 
     setNoProblem();
 }
 
 SerialCommunicator::~SerialCommunicator()
 {
+    disableHotplugRecovery();
     turnOffAutomaticReceiving();
+    if(_recv_transfer)
+        libusb_free_transfer(_recv_transfer);
     if(_usbhandle)
         libusb_close(_usbhandle);
     libusb_exit(_usbctx);
@@ -102,8 +164,92 @@ bool SerialCommunicator::init(uint16_t vendor, uint16_t product, int interface,
     if(found == false)
         return false;
 
+    if(!openAndClaim(_usbdev))
+        return false;
+
+    setNoProblem();
+    return true;
+}
+
+bool SerialCommunicator::initAt(uint8_t bus, const std::vector<uint8_t>& ports, uint16_t vendor, uint16_t product, int interface, uint8_t recv_endpoint_addr, uint8_t send_endpoint_addr)
+{
+    libusb_device **devlist         = NULL;
+    libusb_device_descriptor devdesc;
+    uint8_t devports[7];
+
+    _vendor                 = vendor;
+    _product                = product;
+    _sel_interface          = interface;
+    _recv_endpoint_addr     = recv_endpoint_addr;
+    _send_endpoint_addr     = send_endpoint_addr;
+
+    if(_communicating)
+    {
+        setError("Stop communication before attempting to init this USB again.");
+        return false;
+    }
+
+    if(_usbhandle)
+    {
+        libusb_close(_usbhandle);
+        _usbhandle = NULL;
+        _device_ready = false;
+    }
+
+    /// Only the device plugged at the given place gets its descriptor read.
+    int numdevices = libusb_get_device_list(_usbctx, &devlist);
+    libusb_device* found = NULL;
+
+    for(int devcnt = 0; devcnt < numdevices && found == NULL; devcnt++)
+    {
+        if(libusb_get_bus_number(devlist[devcnt]) != bus)
+            continue;
+
+        int numports = libusb_get_port_numbers(devlist[devcnt], devports, sizeof(devports));
+        if(numports != static_cast<int>(ports.size()) || memcmp(devports, &(ports[0]), numports) != 0)
+            continue;
+
+        if(libusb_get_device_descriptor(devlist[devcnt], &devdesc) == 0 &&
+           devdesc.idVendor == vendor && devdesc.idProduct == product)
+            found = libusb_ref_device(devlist[devcnt]);
+    }
+
+    libusb_free_device_list(devlist, 1);
+
+    /// Something else is plugged there now. Not an error: the caller goes for init() instead.
+    if(found == NULL)
+        return false;
+
+    _usbdev = found;
+    if(!openAndClaim(_usbdev))
+        return false;
+
+    setNoProblem();
+    return true;
+}
+
+bool SerialCommunicator::getDeviceLocation(uint8_t* bus, std::vector<uint8_t>* ports) const
+{
+    uint8_t devports[7];
+
+    if(_usbdev == NULL)
+        return false;
+
+    int numports = libusb_get_port_numbers(_usbdev, devports, sizeof(devports));
+    if(numports < 0)
+        return false;
+
+    *bus = libusb_get_bus_number(_usbdev);
+    ports->assign(devports, devports + numports);
+    return true;
+}
+
+bool SerialCommunicator::openAndClaim(libusb_device* device)
+{
+    int interface = _sel_interface;
+
     /// Now, let's open an interface for communication.
-    int devopen = libusb_open(_usbdev, &_usbhandle);
+    int devopen = libusb_open(device, &_usbhandle);
     switch (devopen)
     {
         case 0:
@@ -199,12 +345,176 @@ bool SerialCommunicator::init(uint16_t vendor, uint16_t product, int interface,
 
     _device_ready = true;
 
-    //libusb_fill_bulk_transfer(&_recv_transfer_template, _usbhandle, _recv_endpoint_addr, _recv_buffer_data, RECV_BUFFER_SIZE, __callbackExternalMethod<LibUSBReceiveCB>, this, 30000);
+    return true;
+}
+
+bool SerialCommunicator::enableHotplugRecovery()
+{
+    if(_hotplug_enabled)
+        return true;
 
-    setNoProblem();
+    if(!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+    {
+        setError("This platform's LibUSB doesn't support hotplug notifications.");
+        return false;
+    }
+
+    if(!_device_ready)
+    {
+        setError("Your device is not yet ready for serial communication. Use init() first, please.");
+        return false;
+    }
+
+    int regval = libusb_hotplug_register_callback(_usbctx,
+                    static_cast<libusb_hotplug_event>(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+                    LIBUSB_HOTPLUG_NO_FLAGS, _vendor, _product, LIBUSB_HOTPLUG_MATCH_ANY,
+                    hotplugCallback, this, &_hotplug_handle);
+
+    if(regval != LIBUSB_SUCCESS)
+    {
+        setError("Could not register the hotplug callback for the USB device %d.");
+        return false;
+    }
+
+    _hotplug_stop       = 0;
+    _hotplug_enabled    = true;
+    pthread_create(&_hotplugth, NULL, __callbackExternalMethod<HotplugThreadCB>, this);
     return true;
 }
 
+void SerialCommunicator::disableHotplugRecovery()
+{
+    if(!_hotplug_enabled)
+        return;
+
+    /// Deregistering wakes up the event handler, so the thread sees the stop flag at once.
+    _hotplug_stop = 1;
+    libusb_hotplug_deregister_callback(_usbctx, _hotplug_handle);
+    pthread_join(_hotplugth, NULL);
+    _hotplug_enabled = false;
+
+    pthread_mutex_lock(&_hotplug_mutex);
+    if(_arrived_device)
+    {
+        libusb_unref_device(_arrived_device);
+        _arrived_device = NULL;
+    }
+    pthread_mutex_unlock(&_hotplug_mutex);
+}
+
+bool SerialCommunicator::isDeviceReady() const
+{
+    return _device_ready;
+}
+
+/**
+ * Runs inside the LibUSB event handler. No synchronous I/O is allowed in here, so it only takes note of what happened,
+ * and the hotplug thread does the job once the event handler returns.
+ */
+int LIBUSB_CALL SerialCommunicator::hotplugCallback(libusb_context* /*ctx*/, libusb_device* device, libusb_hotplug_event event, void* castedSC)
+{
+    SerialCommunicator* sc = static_cast<SerialCommunicator*>(castedSC);
+
+    pthread_mutex_lock(&(sc->_hotplug_mutex));
+    if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+    {
+        if(device == sc->_usbdev)
+        {
+            sc->_device_ready   = false;
+            sc->_device_left    = true;
+        }
+    }
+    else if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED && sc->_arrived_device == NULL)
+    {
+        sc->_arrived_device = libusb_ref_device(device);
+    }
+    pthread_mutex_unlock(&(sc->_hotplug_mutex));
+
+    return 0;
+}
+
+/**
+ * Main loop for the Hotplug thread. It sleeps inside the LibUSB event handler until the device goes away or comes back.
+ */
+void SerialCommunicator::hotplugThreadMethod()
+{
+    while(!_hotplug_stop)
+    {
+        libusb_handle_events_completed(_usbctx, const_cast<int*>(&_hotplug_stop));
+
+        pthread_mutex_lock(&_hotplug_mutex);
+        bool            left    = _device_left;
+        libusb_device*  arrived = _arrived_device;
+        _device_left    = false;
+        _arrived_device = NULL;
+        pthread_mutex_unlock(&_hotplug_mutex);
+
+        if(left)
+        {
+            /// The receiver thread ends by itself when the device goes away. It's restarted after recovering.
+            /// resetAndRestore() may have stopped it already, and left _resume_receiving set.
+            _resume_receiving = _resume_receiving || _receiver_started;
+            if(_receiver_started)
+                turnOffAutomaticReceiving();
+
+            pthread_rwlock_wrlock(&_io_lock);
+            if(_usbhandle)
+            {
+                libusb_close(_usbhandle);
+                _usbhandle = NULL;
+            }
+            if(_usbdev)
+            {
+                libusb_unref_device(_usbdev);
+                _usbdev = NULL;
+            }
+            pthread_rwlock_unlock(&_io_lock);
+
+            atDeviceLost();
+        }
+
+        if(arrived)
+        {
+            bool opened = false, restored = false;
+
+            if(_usbdev == NULL)
+            {
+                // Transfers meanwhile find no handle, and fail as if the device were still away.
+                pthread_rwlock_wrlock(&_io_lock);
+                try
+                {
+                    _usbdev = arrived;
+                    opened = openAndClaim(_usbdev);
+                }
+                catch(std::string error)
+                {
+                    opened = false;
+                }
+                pthread_rwlock_unlock(&_io_lock);
+
+                try
+                {
+                    restored = opened && restoreSession();
+
+                    if(restored && _resume_receiving)
+                        turnOnAutomaticReceiving();
+                    _resume_receiving = false;
+                }
+                catch(std::string error)
+                {
+                    restored = false;
+                }
+                atDeviceRestored(restored);
+            }
+            else
+            {
+                /// Another matching device, while ours is still there. Not our business.
+                libusb_unref_device(arrived);
+            }
+        }
+    }
+}
+
 bool SerialCommunicator::turnOnAutomaticReceiving()
 {
     if(!_device_ready)
@@ -213,24 +523,110 @@ bool SerialCommunicator::turnOnAutomaticReceiving()
         return false;
     }
 
+    pthread_mutex_lock(&_receiver_control_mutex);
+    if(_receiver_started)
+    {
+        pthread_mutex_unlock(&_receiver_control_mutex);
+        return true;
+    }
+
+    if(_recv_transfer == NULL)
+        _recv_transfer = libusb_alloc_transfer(0);
+
+    pthread_mutex_lock(&_comm_bool_mutex);
     _communicating = true;
+    pthread_mutex_unlock(&_comm_bool_mutex);
+
+    _recv_stop          = 0;
+    _receiver_started   = true;
 
     //pthread_create(&_senderth, NULL, __callbackExternalMethod<SenderThreadCB>, this);
     pthread_create(&_receiverth, NULL, __callbackExternalMethod<ReceiverThreadCB>, this);
+    pthread_mutex_unlock(&_receiver_control_mutex);
     return true;
 }
 
 bool SerialCommunicator::turnOffAutomaticReceiving()
 {
+    pthread_mutex_lock(&_receiver_control_mutex);
+
     pthread_mutex_lock(&_comm_bool_mutex);
     _communicating = false;
     pthread_mutex_unlock(&_comm_bool_mutex);
 
     //pthread_join(_senderth, NULL);
-    pthread_join(_receiverth, NULL);
+    if(_receiver_started)
+    {
+        /// The transfer in flight is cancelled, and the event handler woken up, so the thread doesn't wait for anything.
+        __sync_lock_test_and_set(&_recv_stop, 1);
+        libusb_cancel_transfer(_recv_transfer);
+        libusb_interrupt_event_handler(_usbctx);
+
+        pthread_join(_receiverth, NULL);
+        _receiver_started = false;
+    }
+
+    pthread_mutex_unlock(&_receiver_control_mutex);
     return true;
 }
 
+bool SerialCommunicator::restartAutomaticReceiving()
+{
+    turnOffAutomaticReceiving();
+    return turnOnAutomaticReceiving();
+}
+
+bool SerialCommunicator::setRealtimeMode(const RealtimeConfig& config)
+{
+    bool restart;
+
+    pthread_mutex_lock(&_realtime_mutex);
+    _realtime_config = config;
+    _rt_problems.clear();
+
+    // The whole pool is written once and then locked with everything else, so receiving never takes a page fault.
+    if(config.lock_memory && !_rt_memory_locked)
+    {
+        _frame_pool.prefault();
+        _rt_memory_locked = lockProcessMemory(&_rt_problems);
+    }
+    pthread_mutex_unlock(&_realtime_mutex);
+
+    pthread_mutex_lock(&_receiver_control_mutex);
+    restart = _receiver_started;
+    pthread_mutex_unlock(&_receiver_control_mutex);
+
+    pthread_mutex_lock(&_realtime_mutex);
+    _rt_applied = false;
+    pthread_mutex_unlock(&_realtime_mutex);
+
+    // The thread applies the settings itself, once started: what it was refused is only known when it tells.
+    bool waitthread = restart && restartAutomaticReceiving();
+
+    pthread_mutex_lock(&_realtime_mutex);
+    while(waitthread && !_rt_applied)
+        pthread_cond_wait(&_realtime_cond, &_realtime_mutex);
+    bool retval = _rt_problems.empty();
+    pthread_mutex_unlock(&_realtime_mutex);
+    return retval;
+}
+
+RealtimeReport SerialCommunicator::getRealtimeReport(bool reset)
+{
+    RealtimeReport retval;
+
+    pthread_mutex_lock(&_realtime_mutex);
+    retval.affinity_set     = _rt_affinity_set;
+    retval.scheduling_set   = _rt_scheduling_set;
+    retval.memory_locked    = _rt_memory_locked;
+    retval.problems         = _rt_problems;
+    pthread_mutex_unlock(&_realtime_mutex);
+
+    retval.dispatch         = _dispatch_jitter.report(reset);
+    retval.handler          = _handler_jitter.report(reset);
+    return retval;
+}
+
 /**
  * Main loop for the Sender thread.
  */
@@ -243,44 +639,191 @@ void SerialCommunicator::senderThreadMethod()
     } while(checkIfItIsCommunicating());
 }
 
+/**
+ * Runs inside the LibUSB event handler, whichever thread that is. Only flags the transfer as done: the receiver thread
+ * looks at it once the event handler returns.
+ */
+void LIBUSB_CALL SerialCommunicator::recvTransferCallback(libusb_transfer* transfer)
+{
+    SerialCommunicator* sc = static_cast<SerialCommunicator*>(transfer->user_data);
+    clock_gettime(CLOCK_MONOTONIC, &(sc->_recv_completed_at));
+    __sync_lock_test_and_set(&(sc->_recv_completed), 1);
+}
+
 /**
  * Main loop for the Receiver thread. Each time this receives a packet, it's allocated in a stack.
+ * The transfer is asynchronous and without timeout, so the thread sleeps in the event handler until a packet comes or
+ * turnOffAutomaticReceiving() cancels it.
  */
 void SerialCommunicator::receiverThreadMethod()
 {
-    unsigned char* recvdata =   new unsigned char[RECV_BUFFER_SIZE];
-    int bytes_transferred;
-    int retval;
-
-    do
+    FrameRef recvframe;
+    int filled = 0;             // Bytes of an event split over several transfers, already in recvframe.
+    bool inflight = false;
+    bool affinityset, schedulingset;
+    std::string problems;
+
+    pthread_mutex_lock(&_realtime_mutex);
+    RealtimeConfig rtconfig = _realtime_config;
+    pthread_mutex_unlock(&_realtime_mutex);
+
+    applyThreadRealtime(rtconfig, &affinityset, &schedulingset, &problems);
+
+    pthread_mutex_lock(&_realtime_mutex);
+    _rt_affinity_set    = affinityset;
+    _rt_scheduling_set  = schedulingset;
+    _rt_problems.append(problems);
+    _rt_applied         = true;
+    pthread_cond_broadcast(&_realtime_cond);
+    pthread_mutex_unlock(&_realtime_mutex);
+
+    // Busy polling: the event handler only looks at what's already done, and returns at once.
+    timeval nowait;
+    nowait.tv_sec   = 0;
+    nowait.tv_usec  = 0;
+
+    for(;;)
     {
-        // Locks this thread until it receives some data or half a second is elapsed.
-        retval = libusb_bulk_transfer(_usbhandle, _recv_endpoint_addr, recvdata, RECV_BUFFER_SIZE, &bytes_transferred, 500);
+        if(!inflight)
+        {
+            if(_recv_stop || !checkIfItIsCommunicating())
+                break;
+
+            // A new frame is only needed once the last one has been handed over.
+            if(!recvframe.valid())
+                recvframe = _frame_pool.acquire();
+
+            // Waiting for the rest of an event is bounded: if it doesn't come, the start is dropped and the next event is a fresh start.
+            libusb_fill_bulk_transfer(_recv_transfer, _usbhandle, _recv_endpoint_addr, recvframe.data() + filled, RECV_BUFFER_SIZE - filled,
+                                      recvTransferCallback, this, (filled > 0) ? _recovery.frame_timeout_ms : 0);
+            _recv_completed = 0;
+
+            int retval = libusb_submit_transfer(_recv_transfer);
+            if(retval != 0)
+            {
+                Metrics::count(Metric_UsbOtherErrors);
+                /// Nobody would catch an exception in this thread. Just stop: the hotplug thread, if enabled, takes it from here.
+                pthread_mutex_lock(&_comm_bool_mutex);
+                _communicating = false;
+                pthread_mutex_unlock(&_comm_bool_mutex);
+                break;
+            }
+            inflight = true;
+        }
 
-        switch(retval)
+        if(rtconfig.busy_poll)
+            libusb_handle_events_timeout_completed(_usbctx, &nowait, const_cast<int*>(&_recv_completed));
+        else
+            libusb_handle_events_completed(_usbctx, const_cast<int*>(&_recv_completed));
+
+        if(!_recv_completed)
         {
-            case LIBUSB_ERROR_PIPE:
-            setError("There was a problem with the pipe communication.");
-            break;
-            case LIBUSB_ERROR_NO_DEVICE:
-            setError("The device was disconnected.");
+            /// Woken up without our transfer done: if stopping, the transfer may have been submitted after the cancel.
+            if(_recv_stop)
+                libusb_cancel_transfer(_recv_transfer);
+            continue;
+        }
+        inflight = false;
+
+        switch(_recv_transfer->status)
+        {
+            case LIBUSB_TRANSFER_COMPLETED:
             break;
+            case LIBUSB_TRANSFER_CANCELLED:
+            continue;
+            case LIBUSB_TRANSFER_TIMED_OUT:
+            Metrics::count(Metric_UsbTimeouts);
+            if(filled > 0)
+            {
+                Metrics::count(Metric_RxResyncDrops);
+                filled = 0;
+            }
+            continue;
+            case LIBUSB_TRANSFER_STALL:
+            Metrics::count(Metric_UsbPipeErrors);
+            filled = 0;
+            // The halt is cleared here. Resetting can't be done from this thread, since restoring needs it running.
+            if(clearHalt(_recv_endpoint_addr))
+                continue;
+            try
+            {
+                setError("The receiving endpoint stays halted. Receiving has stopped.");
+            }
+            catch(std::string error)
+            {
+                /// Only recorded (see getLastError()): nobody would catch it in this thread.
+            }
+            // Resubmitting into the halted endpoint would just spin: stop, as when the device is gone.
+            pthread_mutex_lock(&_comm_bool_mutex);
+            _communicating = false;
+            pthread_mutex_unlock(&_comm_bool_mutex);
+            continue;
+            case LIBUSB_TRANSFER_NO_DEVICE:
+            Metrics::count(Metric_UsbOtherErrors);
+            pthread_mutex_lock(&_comm_bool_mutex);
+            _communicating = false;
+            pthread_mutex_unlock(&_comm_bool_mutex);
+            continue;
+            default:
+            Metrics::count(Metric_UsbOtherErrors);
+            continue;
         }
 
-        // Mutexes and appends to the Received stack.
-        if(bytes_transferred != 0)
+        // One transfer may end in the middle of an event, or hold more than one: every whole event is delivered, and
+        // what's left starts the next frame.
+        size_t pending = filled + _recv_transfer->actual_length;
+        filled = 0;
+
+        while(pending > 0)
         {
+            size_t framelength = 0;
+            HciFrameState state = checkHciFrame(recvframe.data(), pending, &framelength);
+            if(state == HciFrame_Partial)
+            {
+                filled = pending;
+                break;
+            }
+            if(state == HciFrame_Garbage)
+            {
+                Metrics::count(Metric_RxResyncDrops);
+                break;
+            }
+            __sync_lock_test_and_set(&_halts_in_a_row, 0);
+
+            FrameRef next;
+            pending -= framelength;
+            if(pending > 0)
+            {
+                next = _frame_pool.acquire();
+                memcpy(next.data(), recvframe.data() + framelength, pending);
+            }
+
+            // Mutexes and appends to the Received stack. The stack and the callback share the same frame.
+            recvframe.setSize(framelength);
+            Metrics::count(Metric_FramesIn);
+            Metrics::count(Metric_BytesIn, framelength);
+
             pthread_mutex_lock(&_recvstack_mutex);
-            _recvstack.push_back(std::vector<unsigned char>(&(recvdata[0]), &(recvdata[bytes_transferred])));
+            _recvstack_head = (_recvstack_head + 1) % RECV_STACK_SIZE;
+            _recvstack[_recvstack_head] = recvframe;
             pthread_mutex_unlock(&_recvstack_mutex);
 
+            // And broadcasts the recvlock() methods.
+            pthread_mutex_lock(&_recvlock_mutex);
             pthread_cond_broadcast(&_recvlock_cond);
-            atReceiving(std::vector<unsigned char>(&(recvdata[0]), &(recvdata[bytes_transferred])));
-        }
-        // And broadcasts the recvlock() methods.
-    } while(checkIfItIsCommunicating());
+            pthread_mutex_unlock(&_recvlock_mutex);
+
+            timespec dispatched, handled;
+            clock_gettime(CLOCK_MONOTONIC, &dispatched);
+            _dispatch_jitter.record(JitterRecorder::elapsedUs(_recv_completed_at, dispatched), rtconfig.deadline_us);
+
+            atReceiving(recvframe);
 
-    delete recvdata;
+            clock_gettime(CLOCK_MONOTONIC, &handled);
+            _handler_jitter.record(JitterRecorder::elapsedUs(dispatched, handled), 0);
+            recvframe = next;
+        }
+    }
 }
 
 void SerialCommunicator::setError(std::string which)
@@ -339,76 +882,330 @@ size_t SerialCommunicator::send(std::vector<unsigned char> data)
 
 size_t SerialCommunicator::send(unsigned char *data, size_t length)
 {
-    int bytes_transferred;
-    int retval = libusb_bulk_transfer(_usbhandle, _send_endpoint_addr, data, length, &bytes_transferred, 0);
-    switch(retval)
+    size_t  sent = 0;
+    bool    timedout = false;
+
+    // A transfer cut short by a timeout or a halt may have sent part of the packet: the rest follows, so the framing holds.
+    while(sent < length)
     {
-        case 0:
-            return bytes_transferred;
-        break;
-        case LIBUSB_ERROR_PIPE:
-            setError("The endpoint halted when trying to send.");
-            return 0;
-        break;
-        case LIBUSB_ERROR_NO_DEVICE:
-            setError("The device has been disconnected. The communication has stopped.");
-            turnOffAutomaticReceiving();
-            return 0;
-        break;
-        default:
-            setError("Unknown error when trying to send data.");
-            return 0;
-        break;
+        int bytes_transferred = 0;
+        int retval = bulkTransfer(_send_endpoint_addr, data + sent, length - sent, &bytes_transferred, _recovery.send_timeout_ms);
+        sent += bytes_transferred;
+
+        switch(retval)
+        {
+            case 0:
+                __sync_lock_test_and_set(&_halts_in_a_row, 0);
+            break;
+            case LIBUSB_ERROR_TIMEOUT:
+                Metrics::count(Metric_UsbTimeouts);
+                if(bytes_transferred > 0 || !timedout)
+                {
+                    timedout = (bytes_transferred == 0);
+                    break;
+                }
+                // Twice in a row without taking a byte: the controller is wedged.
+                resetAndRestore();
+                setError("The device stopped taking data.");
+                return 0;
+            break;
+            case LIBUSB_ERROR_PIPE:
+                Metrics::count(Metric_UsbPipeErrors);
+                if(clearHalt(_send_endpoint_addr))
+                    break;
+                resetAndRestore();
+                setError("The endpoint halted when trying to send.");
+                return 0;
+            break;
+            case LIBUSB_ERROR_NO_DEVICE:
+                Metrics::count(Metric_UsbOtherErrors);
+                setError("The device has been disconnected. The communication has stopped.");
+                turnOffAutomaticReceiving();
+                return 0;
+            break;
+            default:
+                Metrics::count(Metric_UsbOtherErrors);
+                setError("Unknown error when trying to send data.");
+                return 0;
+            break;
+        }
     }
+
+    Metrics::count(Metric_FramesOut);
+    Metrics::count(Metric_BytesOut, sent);
+    return sent;
 }
 
 std::vector<unsigned char> SerialCommunicator::recv()
 {
-    unsigned char* recvdata =   new unsigned char[RECV_BUFFER_SIZE];
-    int bytes_transferred = 0;
-    int retusb;
+    FrameRef recvframe = recvFrame();
+    if(!recvframe.valid())
+        return std::vector<unsigned char>();
 
-    do
+    return std::vector<unsigned char>(recvframe.data(), recvframe.data() + recvframe.size());
+}
+
+FrameRef SerialCommunicator::recvFrame()
+{
+    return recvFrame(_recovery.recv_deadline_ms);
+}
+
+FrameRef SerialCommunicator::recvFrame(unsigned int deadlineMs, bool* timedOut)
+{
+    timespec started, now;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    for(;;)
     {
-        retusb = libusb_bulk_transfer(_usbhandle, _recv_endpoint_addr, recvdata, RECV_BUFFER_SIZE, &bytes_transferred, 500);
-    } while(retusb == LIBUSB_ERROR_TIMEOUT);
+        // The rest of the last transfer, when it held more than one event, goes first.
+        if(_recv_carry.valid())
+        {
+            FrameRef carried = recvRest(_recv_carry);
+            _recv_carry.release();
+            if(carried.valid())
+                return carried;
+        }
+
+        FrameRef recvframe = _frame_pool.acquire();
+        int bytes_transferred = 0;
+        int retusb;
+
+        do
+        {
+            retusb = bulkTransfer(_recv_endpoint_addr, recvframe.data(), RECV_BUFFER_SIZE, &bytes_transferred, _recovery.recv_timeout_ms);
+            if(retusb != LIBUSB_ERROR_TIMEOUT)
+                break;
+
+            Metrics::count(Metric_UsbTimeouts);
+            if(bytes_transferred > 0)
+            {
+                retusb = 0;     // Part of a frame: the framer waits for the rest.
+                break;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if(deadlineMs > 0 && elapsedMs(started, now) >= deadlineMs)
+            {
+                if(timedOut != NULL)
+                {
+                    *timedOut = true;
+                    return FrameRef();
+                }
+                setError("No packet arrived from the device in time.");
+                return FrameRef();
+            }
+        } while(true);
+
+        switch(retusb)
+        {
+            case 0:
+                //Success.
+                Metrics::count(Metric_FramesIn);
+                Metrics::count(Metric_BytesIn, bytes_transferred);
+            break;
+            case LIBUSB_ERROR_PIPE:
+                Metrics::count(Metric_UsbPipeErrors);
+                if(clearHalt(_recv_endpoint_addr))
+                    continue;
+                resetAndRestore();
+                setError("The endpoint halted when trying to receive.");
+                return FrameRef();
+            break;
+            case LIBUSB_ERROR_NO_DEVICE:
+                Metrics::count(Metric_UsbOtherErrors);
+                setError("The device has been disconnected. The communication has stopped.");
+                turnOffAutomaticReceiving();
+                return FrameRef();
+            break;
+            default:
+                Metrics::count(Metric_UsbOtherErrors);
+                setError("Unknown error when trying to send data.");
+                return FrameRef();
+            break;
+        }
+
+        recvframe.setSize(bytes_transferred);
+        recvframe = recvRest(recvframe);
+        if(recvframe.valid())
+        {
+            __sync_lock_test_and_set(&_halts_in_a_row, 0);
+            return recvframe;
+        }
+        // Dropped by the framer: the next frame is a fresh start.
+    }
+}
+
+/**
+ * HCI framer for recvFrame(): waits a little for the rest of an event split over several transfers, and drops whatever
+ * isn't a whole event. Returns an invalid frame if it was dropped. Bytes after the event are kept in _recv_carry.
+ */
+FrameRef SerialCommunicator::recvRest(FrameRef frame)
+{
+    timespec started, now;
+    clock_gettime(CLOCK_MONOTONIC, &started);
 
-    switch(retusb)
+    for(;;)
     {
-        case 0:
-            //Success.
-        break;
-        case LIBUSB_ERROR_PIPE:
-            setError("The endpoint halted when trying to send.");
-            return std::vector<unsigned char>();
-        break;
-        case LIBUSB_ERROR_NO_DEVICE:
-            setError("The device has been disconnected. The communication has stopped.");
-            turnOffAutomaticReceiving();
-            return std::vector<unsigned char>();
-        break;
-        default:
-            setError("Unknown error when trying to send data.");
-            return std::vector<unsigned char>();
-        break;
+        size_t framelength = 0;
+        switch(checkHciFrame(frame.data(), frame.size(), &framelength))
+        {
+            case HciFrame_Complete:
+                if(frame.size() > framelength)
+                {
+                    _recv_carry = _frame_pool.acquire();
+                    memcpy(_recv_carry.data(), frame.data() + framelength, frame.size() - framelength);
+                    _recv_carry.setSize(frame.size() - framelength);
+                    frame.setSize(framelength);
+                }
+                return frame;
+            case HciFrame_Garbage:
+                Metrics::count(Metric_RxResyncDrops);
+                return FrameRef();
+            default:
+            break;
+        }
+
+        if(frame.size() == 0)
+            return FrameRef();
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        unsigned int waited = elapsedMs(started, now);
+        if(waited >= _recovery.frame_timeout_ms)
+        {
+            Metrics::count(Metric_RxResyncDrops);
+            return FrameRef();
+        }
+
+        int more = 0;
+        int retusb = bulkTransfer(_recv_endpoint_addr, frame.data() + frame.size(), RECV_BUFFER_SIZE - frame.size(), &more,
+                                  _recovery.frame_timeout_ms - waited);
+        if(more > 0)
+        {
+            Metrics::count(Metric_BytesIn, more);
+            frame.setSize(frame.size() + more);
+        }
+        else if(retusb != 0 && retusb != LIBUSB_ERROR_TIMEOUT)
+        {
+            // Whatever went wrong shows up again at the next transfer, where it's handled.
+            Metrics::count(Metric_RxResyncDrops);
+            return FrameRef();
+        }
     }
+}
 
-    std::vector<unsigned char> retval = std::vector<unsigned char>(&(recvdata[0]), &(recvdata[bytes_transferred]));
+/**
+ * One synchronous transfer, under the read side of the I/O lock, so the hotplug thread can't close the handle under it.
+ * Without a handle (the device is away) it fails as if the device were gone.
+ */
+int SerialCommunicator::bulkTransfer(uint8_t endpoint, unsigned char* data, int length, int* transferred, unsigned int timeout)
+{
+    int retval = LIBUSB_ERROR_NO_DEVICE;
 
-    delete recvdata;
+    pthread_rwlock_rdlock(&_io_lock);
+    if(_usbhandle)
+        retval = libusb_bulk_transfer(_usbhandle, endpoint, data, length, transferred, timeout);
+    pthread_rwlock_unlock(&_io_lock);
     return retval;
 }
 
+/**
+ * Clears a halted endpoint, which also resets the data toggle on both ends, so the transfers are in step again.
+ * Returns false if it didn't work, or it has been done halt_retries times in a row already.
+ */
+bool SerialCommunicator::clearHalt(uint8_t endpoint)
+{
+    if(__sync_add_and_fetch(&_halts_in_a_row, 1) > _recovery.halt_retries)
+        return false;
+
+    pthread_rwlock_rdlock(&_io_lock);
+    int retval = _usbhandle ? libusb_clear_halt(_usbhandle, endpoint) : LIBUSB_ERROR_NO_DEVICE;
+    pthread_rwlock_unlock(&_io_lock);
+    if(retval != 0)
+        return false;
+
+    Metrics::count(Metric_UsbHaltsCleared);
+    #ifdef LIBUSB_DEBUG_OUTPUT
+    std::cout << "Cleared a halt on endpoint 0x" << std::hex << (int) endpoint << std::dec << std::endl;
+    #endif
+    return true;
+}
+
+/**
+ * Last resort: resets the device and has the session replayed. Not nested: a failure while restoring just fails.
+ * If the reset makes the device enumerate again, the handle is gone, and the hotplug thread (if enabled) takes over.
+ */
+bool SerialCommunicator::resetAndRestore()
+{
+    if(!_recovery.reset_on_failure || !__sync_bool_compare_and_swap(&_recovering, 0, 1))
+        return false;
+
+    // The receiver thread would take the replies restoring waits for, and its transfer can't stay submitted through the
+    // reset. It can't stop itself, so it doesn't reset: the halt or timeout shows up again in the caller.
+    if(_receiver_started && pthread_equal(pthread_self(), _receiverth))
+    {
+        __sync_lock_release(&_recovering);
+        return false;
+    }
+
+    bool wasreceiving = _receiver_started;
+    if(wasreceiving)
+        turnOffAutomaticReceiving();
+
+    Metrics::count(Metric_UsbResets);
+    bool restored = false;
+
+    pthread_rwlock_rdlock(&_io_lock);
+    int resetval = _usbhandle ? libusb_reset_device(_usbhandle) : LIBUSB_ERROR_NO_DEVICE;
+    pthread_rwlock_unlock(&_io_lock);
+
+    if(resetval == 0)
+    {
+        __sync_lock_test_and_set(&_halts_in_a_row, 0);
+        try
+        {
+            restored = restoreSession();
+            if(restored && wasreceiving)
+                turnOnAutomaticReceiving();
+        }
+        catch(std::string error)
+        {
+            restored = false;
+        }
+    }
+
+    // The device enumerated again, or restoring failed: the hotplug thread, if enabled, restarts receiving once it's back.
+    if(!restored && wasreceiving)
+        _resume_receiving = true;
+
+    __sync_lock_release(&_recovering);
+    return restored;
+}
+
+void SerialCommunicator::setRecoveryConfig(const UsbRecoveryConfig& config)
+{
+    _recovery = config;
+}
+
+UsbRecoveryConfig SerialCommunicator::getRecoveryConfig() const
+{
+    return _recovery;
+}
+
 std::vector<unsigned char> SerialCommunicator::recvlock()
 {
-    std::vector<unsigned char> retval;
+    FrameRef lastframe;
 
+    pthread_mutex_lock(&_recvlock_mutex);
     pthread_cond_wait(&_recvlock_cond, &_recvlock_mutex);
+    pthread_mutex_unlock(&_recvlock_mutex);
+
     pthread_mutex_lock(&_recvstack_mutex);
-    retval = std::vector<unsigned char>(_recvstack.back());
+    lastframe = _recvstack[_recvstack_head];
     pthread_mutex_unlock(&_recvstack_mutex);
 
-    return retval;
+    if(!lastframe.valid())
+        return std::vector<unsigned char>();
+    return std::vector<unsigned char>(lastframe.data(), lastframe.data() + lastframe.size());
 }
 
 template<CallbackType methodSelector>
@@ -426,6 +1223,10 @@ void* __callbackExternalMethod(void *castedSCParameter)
             sc = static_cast<SerialCommunicator*>(castedSCParameter);
             sc->receiverThreadMethod();
         break;
+        case HotplugThreadCB:
+            sc = static_cast<SerialCommunicator*>(castedSCParameter);
+            sc->hotplugThreadMethod();
+        break;
         case LibUSBReceiveCB:
 
         break;
@@ -1,11 +1,13 @@
 #ifndef SERIALCOMMUNICATOR_H
 #define SERIALCOMMUNICATOR_H
 
+#include "framepool.h"
+#include "realtime.h"
+
 #include <libusb.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <string>
-#include <deque>
 #include <vector>
 
 /// An ugly way to implement the Pthreads, but... so be it.
@@ -13,6 +15,7 @@ enum CallbackType
 {
     SenderThreadCB,
     ReceiverThreadCB,
+    HotplugThreadCB,
 
     LibUSBReceiveCB
 };
@@ -20,6 +23,31 @@ enum CallbackType
 template<CallbackType>
 static void* __callbackExternalMethod(void* castedSCParameter);
 
+#define     RECV_STACK_SIZE         16
+#define     FRAME_POOL_SIZE         64
+
+/**
+ * Bounds and recovery steps for the USB transfers (see SerialCommunicator::setRecoveryConfig()).
+ */
+struct UsbRecoveryConfig
+{
+    unsigned int    send_timeout_ms;        // Per bulk OUT transfer.
+    unsigned int    recv_timeout_ms;        // Per bulk IN transfer of recvFrame(), which tries again until recv_deadline_ms.
+    unsigned int    recv_deadline_ms;       // Longest recvFrame() waits for a frame. 0: no limit, events can be far apart.
+    unsigned int    frame_timeout_ms;       // Longest the rest of a frame split over several transfers is waited for.
+    unsigned int    halt_retries;           // Times a halted endpoint is cleared in a row before escalating.
+    bool            reset_on_failure;       // Escalation: USB reset of the device, and restoreSession().
+
+    UsbRecoveryConfig() :
+        send_timeout_ms     (1000),
+        recv_timeout_ms     (500),
+        recv_deadline_ms    (0),
+        frame_timeout_ms    (50),
+        halt_retries        (3),
+        reset_on_failure    (true)
+    {}
+};
+
 /**
  * Class intended for an IO-stream of USB serial data.
  */
@@ -42,23 +70,69 @@ private:
     bool                    _device_ready;
 
     bool                    _communicating;
+    bool                    _receiver_started;
     pthread_mutex_t         _comm_bool_mutex;
 
     std::string             _lasterror;
 
     pthread_t               _senderth, _receiverth;
 
-    std::deque<std::vector<unsigned char> >     _recvstack;
+    FramePool                                   _frame_pool;
+
+    /// The last frames received by the receiver thread. The oldest ones are dropped, so the pool never runs dry.
+    FrameRef                                    _recvstack[RECV_STACK_SIZE];
+    size_t                                      _recvstack_head;
     pthread_mutex_t                             _recvstack_mutex;
 
     pthread_mutex_t         _recvlock_mutex;
     pthread_cond_t          _recvlock_cond;
 
-    libusb_transfer         _recv_transfer_template;
-    char*                   _recv_buffer_data;
+    /// Asynchronous transfer used by the receiver thread, so stopping can cancel it instead of waiting for a timeout.
+    libusb_transfer*        _recv_transfer;
+    volatile int            _recv_completed;
+    volatile int            _recv_stop;
+    pthread_mutex_t         _receiver_control_mutex;
+
+    /// Low-latency mode of the receiver thread. The thread takes the config when it starts, and reports back what it got.
+    RealtimeConfig          _realtime_config;
+    bool                    _rt_affinity_set, _rt_scheduling_set, _rt_memory_locked;
+    bool                    _rt_applied;            // The receiver thread has applied _realtime_config and told how it went.
+    pthread_cond_t          _realtime_cond;
+    std::string             _rt_problems;
+    pthread_mutex_t         _realtime_mutex;
+    timespec                _recv_completed_at;
+    JitterRecorder          _dispatch_jitter, _handler_jitter;
+
+    bool                    _hotplug_enabled;
+    volatile int            _hotplug_stop;
+    pthread_t               _hotplugth;
+    libusb_hotplug_callback_handle  _hotplug_handle;
+    pthread_mutex_t         _hotplug_mutex;
+    libusb_device*          _arrived_device;
+    bool                    _device_left;
+    bool                    _resume_receiving;
+
+    /// Read side held for each synchronous transfer on the handle, write side by the hotplug thread while it replaces it.
+    pthread_rwlock_t        _io_lock;
 
     void                    senderThreadMethod();
     void                    receiverThreadMethod();
+    void                    hotplugThreadMethod();
+
+    bool                    openAndClaim(libusb_device* device);
+
+    UsbRecoveryConfig       _recovery;
+    volatile int            _recovering;
+    volatile unsigned int   _halts_in_a_row;        // Reset by the receiver thread too: changed with atomic builtins.
+
+    int                     bulkTransfer(uint8_t endpoint, unsigned char* data, int length, int* transferred, unsigned int timeout);
+    bool                    clearHalt(uint8_t endpoint);
+    bool                    resetAndRestore();
+    FrameRef                recvRest(FrameRef frame);
+    FrameRef                _recv_carry;            // Bytes received after the last event recvFrame() returned.
+
+    static int LIBUSB_CALL  hotplugCallback(libusb_context* ctx, libusb_device* device, libusb_hotplug_event event, void* castedSC);
+    static void LIBUSB_CALL recvTransferCallback(libusb_transfer* transfer);
 
     bool                    checkIfItIsCommunicating();
 
@@ -73,6 +147,12 @@ protected:
      */
     void            setNoProblem();
 
+    /**
+     * Called by the hotplug thread once the device came back and its interface was claimed again, to bring the device back
+     * to where it was. Inherited classes replay their initialization here. Returns false if that couldn't be done.
+     */
+    virtual bool    restoreSession() { return true; }
+
 public:
     /**
      * Constructor. Does nothing.
@@ -88,17 +168,69 @@ public:
      */
     bool            init(uint16_t vendor, uint16_t product, int interface, uint8_t recv_endpoint_addr, uint8_t send_endpoint_addr);
 
+    /**
+     * Same as init(), but only looks at the device plugged at the given bus and port path (see getDeviceLocation()),
+     * instead of reading the descriptor of every USB device on the system.
+     * Returns false without any exception if there's no such device there, so you can fall back to init().
+     */
+    bool            initAt(uint8_t bus, const std::vector<uint8_t>& ports, uint16_t vendor, uint16_t product, int interface, uint8_t recv_endpoint_addr, uint8_t send_endpoint_addr);
+
+    /**
+     * Where the device in use is plugged. Returns false if there's none.
+     */
+    bool            getDeviceLocation(uint8_t* bus, std::vector<uint8_t>* ports) const;
+
+    /**
+     * Watches the device with LibUSB hotplug notifications (no polling). If it's unplugged or resets, the interface is claimed
+     * again as soon as it comes back, restoreSession() is run, and atDeviceLost() / atDeviceRestored() are signaled.
+     * A call in progress when the device goes away still fails (throws) as usual.
+     */
+    bool            enableHotplugRecovery();
+    void            disableHotplugRecovery();
+
+    /**
+     * False between init() and the device being claimed, and while the device is away.
+     */
+    bool            isDeviceReady() const;
+
+    /**
+     * Hotplug signals. Use them in inherited classes. They're called from the hotplug thread.
+     */
+    virtual void    atDeviceLost() {}
+    virtual void    atDeviceRestored(bool /*restored*/) {}
+
     /**
      * Opens a thread for concurrent receiving packages. The received packages are stored in an internal buffer, but not processed
-     * (To be implemented)
+     * (To be implemented). Does nothing if it's already running.
      */
     bool            turnOnAutomaticReceiving();
 
     /**
-     * Closes the thread for concurrent receiving packages opened by turnOnAutomaticReceiving(). (To be implemented)
+     * Closes the thread for concurrent receiving packages opened by turnOnAutomaticReceiving(). The transfer in progress is
+     * cancelled, so this returns at once instead of waiting for it to time out. Does nothing if it's not running.
      */
     bool            turnOffAutomaticReceiving();
 
+    /**
+     * turnOffAutomaticReceiving() and turnOnAutomaticReceiving() in a row.
+     */
+    bool            restartAutomaticReceiving();
+
+    /**
+     * Low-latency mode for the receiver thread: CPU pinning, SCHED_FIFO, busy polling of the transfer instead of sleeping,
+     * and a prefaulted, locked frame pool (see RealtimeConfig). The receiver is restarted if it's running, so the thread
+     * picks the settings up. What the system refuses (usually for lack of privileges) is left as it was and told in
+     * getRealtimeReport(); returns false if anything was refused, after waiting for a restarted receiver thread to apply
+     * its settings. RealtimeConfig() turns it all off again, except for the memory lock, which stays until the process ends.
+     */
+    bool            setRealtimeMode(const RealtimeConfig& config);
+
+    /**
+     * Which settings are in effect, and the latency of every frame from its transfer completing to atReceiving() being
+     * called, and of atReceiving() itself. With reset, the next report starts over.
+     */
+    RealtimeReport  getRealtimeReport(bool reset = false);
+
     /**
      * Function to send data to the device. Returns the size of the data sent, or 0 if no data sent.
      */
@@ -114,6 +246,18 @@ public:
      */
     std::vector<unsigned char> recv();
 
+    /**
+     * Same as recv(), but the packet is received straight into a pooled frame buffer and nothing is copied or allocated.
+     * The returned frame is invalid if unsuccessful.
+     */
+    FrameRef                    recvFrame();
+
+    /**
+     * recvFrame() with its own deadline in place of recv_deadline_ms (0: no limit). If timedOut is given, running out of
+     * time sets it and returns an invalid frame instead of throwing; other failures throw as usual.
+     */
+    FrameRef                    recvFrame(unsigned int deadlineMs, bool* timedOut = NULL);
+
     /**
      * Locks the thread it's called in, until the USB device receives some data. The first just puts the retrieved data into the stack, and the second
      * makes you able to retrieve it immediatly. (To be implemented, if necessary)
@@ -121,9 +265,19 @@ public:
     std::vector<unsigned char>  recvlock();
 
     /**
-     * Signals when a package arrives. Use it in inherited classes. (To be implemented, if necessary)
+     * Signals when a package arrives. Use it in inherited classes. The frame is shared with the receive stack, not copied:
+     * keep a copy of the FrameRef if you need the data after returning.
+     */
+    virtual void                atReceiving(const FrameRef& /*frame*/){}
+
+    /**
+     * Timeouts and recovery of the transfers. Every blocking transfer has a timeout. A halted (stalled) endpoint is cleared and the
+     * transfer tried again, and the HCI framing is checked on every frame received: a frame split over transfers is put
+     * back together, and bytes that aren't a whole event (left over by a fault) are dropped. When clearing doesn't help,
+     * or sending times out twice, the device is reset and restoreSession() run; the call in progress still fails then.
      */
-    virtual void                atReceiving(std::vector<unsigned char> data){}
+    void                    setRecoveryConfig(const UsbRecoveryConfig& config);
+    UsbRecoveryConfig       getRecoveryConfig() const;
 
     /**
      * Gets a description of the last error.
@@ -0,0 +1,136 @@
+#include "shmdaemon.h"
+
+#include <iostream>
+#include <unistd.h>
+
+void* __shmRequestEntry(void* castedDaemon)
+{
+    static_cast<ShmDaemon*>(castedDaemon)->requestThreadMethod();
+    return NULL;
+}
+
+ShmDaemon::ShmDaemon() :
+    _serving        (false),
+    _stop           (0),
+    _published      (0),
+    _requests_sent  (0)
+{
+}
+
+ShmDaemon::~ShmDaemon()
+{
+    stopServing();
+}
+
+bool ShmDaemon::startServing(const std::string& name)
+{
+    if(_serving)
+        return false;
+
+    if(!_publisher.create(name))
+    {
+        try
+        {
+            setError("Could not create the shared memory object " + name + ".");
+        }
+        catch(std::string error)
+        {
+            /// Only recorded (see getLastError()): failing is told by the return value, like the other failures here.
+        }
+        return false;
+    }
+
+    _stop       = 0;
+    _serving    = true;
+    pthread_create(&_request_thread, NULL, __shmRequestEntry, this);
+
+    if(!turnOnAutomaticReceiving())
+    {
+        stopServing();
+        return false;
+    }
+
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Serving the dongle at " << name << std::endl;
+    #endif
+    return true;
+}
+
+void ShmDaemon::stopServing()
+{
+    if(!_serving)
+        return;
+
+    turnOffAutomaticReceiving();
+
+    __sync_lock_test_and_set(&_stop, 1);
+    pthread_join(_request_thread, NULL);
+
+    _serving = false;
+    _publisher.destroy();
+}
+
+void ShmDaemon::atReceiving(const FrameRef& frame)
+{
+    // Notification streaming and link bookkeeping go on as without the daemon.
+    CC2540Communicator::atReceiving(frame);
+
+    if(!_serving)
+        return;
+
+    _publisher.publish(frame.data(), frame.size());
+    _published++;
+}
+
+/**
+ * Sends what clients queue. Polls: the clients never make a system call to queue something, so there's nothing to wake
+ * this thread up with.
+ */
+void ShmDaemon::requestThreadMethod()
+{
+    unsigned char   command[HCI_MAX_PACKET_LENGTH];
+    size_t          length;
+    uint32_t        client, requestid;
+    unsigned int    idle = 0;
+
+    while(!_stop)
+    {
+        if(_publisher.takeRequest(command, &length, &client, &requestid))
+        {
+            idle = 0;
+            try
+            {
+                if(send(command, length) == length)
+                    _requests_sent++;
+            }
+            catch(std::string error)
+            {
+                #ifdef CC2540_DEBUGMODE
+                std::cout << "Request " << requestid << " of client " << client << " failed: " << error << std::endl;
+                #endif
+            }
+            continue;
+        }
+
+        // Roughly once a second, free the slots of clients that died.
+        if(++idle % 1000 == 0)
+            _publisher.reapClients();
+
+        usleep(1000);
+    }
+}
+
+unsigned long ShmDaemon::getPublishedCount() const
+{
+    return _published;
+}
+
+unsigned long ShmDaemon::getRequestCount() const
+{
+    return _requests_sent;
+}
+
+size_t ShmDaemon::getClientCount() const
+{
+    return _serving ? _publisher.getClientCount() : 0;
+}
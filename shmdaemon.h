@@ -0,0 +1,47 @@
+#ifndef SHMDAEMON_H
+#define SHMDAEMON_H
+
+#include "cc2540communicator.h"
+#include "shmring.h"
+
+#include <pthread.h>
+
+/**
+ * Daemon mode: this process owns the dongle, and other processes use it through shared memory (see ShmClient).
+ * Every packet received is published, header decoded, into a ring each client reads at its own pace; commands queued
+ * by clients are sent in the order they were queued.
+ *
+ * Init the dongle as usual (init(), txInitCommand(), ...) and then call startServing(). From then on the receiver thread
+ * takes every packet, so the synchronous tx functions, which wait for their own answers, must not be used any more:
+ * this process talks to the dongle through txSendCommand() or a ShmClient of its own, like everyone else.
+ */
+class ShmDaemon : public CC2540Communicator
+{
+private:
+    ShmPublisher        _publisher;
+    bool                _serving;
+    volatile int        _stop;
+    pthread_t           _request_thread;
+
+    unsigned long       _published;
+    unsigned long       _requests_sent;
+
+    void                requestThreadMethod();
+
+    friend void*        __shmRequestEntry(void* castedDaemon);
+
+public:
+    ShmDaemon();
+    ~ShmDaemon();
+
+    bool                startServing(const std::string& name = SHM_DEFAULT_NAME);
+    void                stopServing();
+
+    virtual void        atReceiving(const FrameRef& frame);
+
+    unsigned long       getPublishedCount() const;
+    unsigned long       getRequestCount() const;
+    size_t              getClientCount() const;
+};
+
+#endif // SHMDAEMON_H
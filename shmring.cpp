@@ -0,0 +1,373 @@
+#include "shmring.h"
+#include "gapschema.h"
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Whether the object under that name belongs to a daemon that's still running. A region too small, without the magic, or
+ * whose daemon is gone is a leftover.
+ */
+static bool daemonAlive(const std::string& name)
+{
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if(fd < 0)
+        return false;
+
+    struct stat info;
+    if(fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(ShmRegion))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void* memory = mmap(NULL, sizeof(ShmRegion), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(memory == MAP_FAILED)
+        return false;
+
+    const ShmRegion* region = static_cast<const ShmRegion*>(memory);
+    bool alive = false;
+    if(__atomic_load_n(&(region->magic), __ATOMIC_ACQUIRE) == SHM_RING_MAGIC && region->daemon_pid > 0)
+        alive = !(kill(region->daemon_pid, 0) != 0 && errno == ESRCH);
+
+    munmap(memory, sizeof(ShmRegion));
+    return alive;
+}
+
+ShmPublisher::ShmPublisher() :
+    _region (NULL)
+{
+}
+
+ShmPublisher::~ShmPublisher()
+{
+    destroy();
+}
+
+bool ShmPublisher::create(const std::string& name)
+{
+    if(_region != NULL)
+        return false;
+
+    // A leftover from a daemon that crashed is replaced. A daemon still running keeps its name and its clients.
+    if(daemonAlive(name))
+        return false;
+    shm_unlink(name.c_str());
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0660);
+    if(fd < 0)
+        return false;
+
+    if(ftruncate(fd, sizeof(ShmRegion)) != 0)
+    {
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    void* memory = mmap(NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(memory == MAP_FAILED)
+    {
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    _name   = name;
+    _region = static_cast<ShmRegion*>(memory);
+
+    memset(_region, 0, sizeof(ShmRegion));
+    for(uint64_t i = 0; i < SHM_REQUEST_SLOTS; i++)
+        _region->requests[i].seq = i;
+
+    _region->version    = SHM_RING_VERSION;
+    _region->daemon_pid = getpid();
+
+    // Clients only attach once the magic is there, so it goes last.
+    __atomic_store_n(&(_region->magic), SHM_RING_MAGIC, __ATOMIC_RELEASE);
+    return true;
+}
+
+void ShmPublisher::destroy()
+{
+    if(_region == NULL)
+        return;
+
+    __atomic_store_n(&(_region->magic), 0, __ATOMIC_RELEASE);
+    munmap(_region, sizeof(ShmRegion));
+    shm_unlink(_name.c_str());
+    _region = NULL;
+}
+
+void ShmPublisher::publish(const unsigned char* data, size_t length)
+{
+    if(length > FRAME_BUFFER_SIZE)
+        length = FRAME_BUFFER_SIZE;
+
+    uint64_t        seq  = _region->write_seq;
+    ShmEventSlot&   slot = _region->events[seq % SHM_EVENT_SLOTS];
+
+    // Seqlock: readers that catch the slot in between see seq change and drop what they read.
+    __atomic_store_n(&(slot.seq), 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(slot.data, data, length);
+    slot.length     = length;
+    slot.type       = (length > 0) ? data[0] : 0;
+    slot.event_code = (length > 1) ? data[1] : 0;
+    slot.event      = 0;
+    slot.status     = 0;
+
+    HciEventView<GapEventHeader> header(data, length);
+    if(header.complete() && slot.type == RX_TYPE_EVENT && slot.event_code == RX_HCI_LE_EXTEVENT)
+    {
+        slot.event  = header.value<GapEventHeader::Event>();
+        slot.status = header.value<GapEventHeader::Status>();
+    }
+
+    __atomic_store_n(&(slot.seq), seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&(_region->write_seq), seq + 1, __ATOMIC_RELEASE);
+}
+
+bool ShmPublisher::takeRequest(unsigned char* data, size_t* length, uint32_t* client, uint32_t* requestId)
+{
+    // Only the daemon dequeues, so no compare-and-swap is needed on this side.
+    uint64_t        pos  = _region->request_dequeue;
+    ShmRequestSlot& slot = _region->requests[pos % SHM_REQUEST_SLOTS];
+
+    if(__atomic_load_n(&(slot.seq), __ATOMIC_ACQUIRE) != pos + 1)
+        return false;
+
+    *length     = (slot.length <= HCI_MAX_PACKET_LENGTH) ? slot.length : HCI_MAX_PACKET_LENGTH;
+    *client     = slot.client;
+    *requestId  = slot.request_id;
+    memcpy(data, slot.data, *length);
+
+    // Free for the producer one lap later.
+    __atomic_store_n(&(slot.seq), pos + SHM_REQUEST_SLOTS, __ATOMIC_RELEASE);
+    _region->request_dequeue = pos + 1;
+    return true;
+}
+
+size_t ShmPublisher::reapClients()
+{
+    size_t reaped = 0;
+
+    for(int i = 0; i < SHM_MAX_CLIENTS; i++)
+    {
+        ShmClientSlot& client = _region->clients[i];
+        if(__atomic_load_n(&(client.in_use), __ATOMIC_ACQUIRE) == 0)
+            continue;
+
+        if(client.pid > 0 && kill(client.pid, 0) != 0 && errno == ESRCH)
+        {
+            __atomic_store_n(&(client.in_use), 0, __ATOMIC_RELEASE);
+            reaped++;
+        }
+    }
+    return reaped;
+}
+
+size_t ShmPublisher::getClientCount() const
+{
+    size_t count = 0;
+    for(int i = 0; i < SHM_MAX_CLIENTS; i++)
+    {
+        if(__atomic_load_n(&(_region->clients[i].in_use), __ATOMIC_ACQUIRE) != 0)
+            count++;
+    }
+    return count;
+}
+
+ShmClient::ShmClient() :
+    _region             (NULL),
+    _slot               (0),
+    _cursor             (0),
+    _next_request_id    (1)
+{
+}
+
+ShmClient::~ShmClient()
+{
+    close();
+}
+
+bool ShmClient::open(const std::string& name)
+{
+    if(_region != NULL)
+        return false;
+
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if(fd < 0)
+        return false;
+
+    void* memory = mmap(NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(memory == MAP_FAILED)
+        return false;
+
+    ShmRegion* region = static_cast<ShmRegion*>(memory);
+    if(__atomic_load_n(&(region->magic), __ATOMIC_ACQUIRE) != SHM_RING_MAGIC || region->version != SHM_RING_VERSION)
+    {
+        munmap(memory, sizeof(ShmRegion));
+        return false;
+    }
+
+    for(uint32_t i = 0; i < SHM_MAX_CLIENTS; i++)
+    {
+        ShmClientSlot& client = region->clients[i];
+        if(__sync_bool_compare_and_swap(&(client.in_use), 0, 1))
+        {
+            _region     = region;
+            _slot       = i;
+            _cursor     = __atomic_load_n(&(region->write_seq), __ATOMIC_ACQUIRE);
+
+            client.pid      = getpid();
+            client.lost     = 0;
+            client.read_seq = _cursor;
+            return true;
+        }
+    }
+
+    munmap(memory, sizeof(ShmRegion));
+    return false;
+}
+
+void ShmClient::close()
+{
+    if(_region == NULL)
+        return;
+
+    __atomic_store_n(&(_region->clients[_slot].in_use), 0, __ATOMIC_RELEASE);
+    munmap(_region, sizeof(ShmRegion));
+    _region = NULL;
+}
+
+/**
+ * Finds the slot of the event at the cursor, skipping whatever was overwritten before this client got to it.
+ */
+bool ShmClient::locate(const ShmEventSlot** slot)
+{
+    ShmClientSlot& client = _region->clients[_slot];
+
+    for(;;)
+    {
+        uint64_t head = __atomic_load_n(&(_region->write_seq), __ATOMIC_ACQUIRE);
+        if(_cursor >= head)
+            return false;
+
+        // Lapped: everything older than one ring behind is gone.
+        if(head - _cursor > SHM_EVENT_SLOTS)
+        {
+            client.lost += head - SHM_EVENT_SLOTS - _cursor;
+            _cursor = head - SHM_EVENT_SLOTS;
+        }
+
+        const ShmEventSlot* candidate = &(_region->events[_cursor % SHM_EVENT_SLOTS]);
+        if(__atomic_load_n(&(candidate->seq), __ATOMIC_ACQUIRE) == _cursor + 1)
+        {
+            *slot = candidate;
+            return true;
+        }
+
+        // Being overwritten right now.
+        client.lost++;
+        _cursor++;
+    }
+}
+
+const ShmEventSlot* ShmClient::peek()
+{
+    const ShmEventSlot* slot = NULL;
+
+    if(_region == NULL || !locate(&slot))
+        return NULL;
+    return slot;
+}
+
+bool ShmClient::consume()
+{
+    // Nothing to move past: peek() found no event.
+    if(_region == NULL || _cursor >= __atomic_load_n(&(_region->write_seq), __ATOMIC_ACQUIRE))
+        return false;
+
+    const ShmEventSlot* slot = &(_region->events[_cursor % SHM_EVENT_SLOTS]);
+
+    // Whatever was read from the slot must have been read before checking it's still the same event.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    bool intact = (__atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) == _cursor + 1);
+
+    ShmClientSlot& client = _region->clients[_slot];
+    if(!intact)
+        client.lost++;
+
+    _cursor++;
+    __atomic_store_n(&(client.read_seq), _cursor, __ATOMIC_RELAXED);
+    return intact;
+}
+
+size_t ShmClient::read(unsigned char* buffer, uint16_t* event)
+{
+    for(;;)
+    {
+        const ShmEventSlot* slot = peek();
+        if(slot == NULL)
+            return 0;
+
+        size_t      length  = (slot->length <= FRAME_BUFFER_SIZE) ? slot->length : FRAME_BUFFER_SIZE;
+        uint16_t    evnum   = slot->event;
+        memcpy(buffer, slot->data, length);
+
+        if(consume())
+        {
+            if(event != NULL)
+                *event = evnum;
+            return length;
+        }
+    }
+}
+
+uint32_t ShmClient::submit(const unsigned char* command, size_t length)
+{
+    if(_region == NULL || length > HCI_MAX_PACKET_LENGTH)
+        return 0;
+
+    for(;;)
+    {
+        uint64_t        pos  = __atomic_load_n(&(_region->request_enqueue), __ATOMIC_RELAXED);
+        ShmRequestSlot& slot = _region->requests[pos % SHM_REQUEST_SLOTS];
+        uint64_t        seq  = __atomic_load_n(&(slot.seq), __ATOMIC_ACQUIRE);
+
+        if(seq < pos)
+            return 0;           // Full: the daemon hasn't taken the request one lap ago yet.
+
+        if(seq == pos && __sync_bool_compare_and_swap(&(_region->request_enqueue), pos, pos + 1))
+        {
+            uint32_t requestid = _next_request_id++;
+            if(_next_request_id == 0)
+                _next_request_id = 1;
+
+            slot.client     = _slot;
+            slot.request_id = requestid;
+            slot.length     = length;
+            memcpy(slot.data, command, length);
+
+            __atomic_store_n(&(slot.seq), pos + 1, __ATOMIC_RELEASE);
+            return requestid;
+        }
+        // Another client took this position: try the next one.
+    }
+}
+
+uint64_t ShmClient::getLostCount() const
+{
+    if(_region == NULL)
+        return 0;
+    return _region->clients[_slot].lost;
+}
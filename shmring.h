@@ -0,0 +1,161 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include "framepool.h"
+#include "hcischema.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+
+#define SHM_DEFAULT_NAME        "/cc2540d"
+#define SHM_RING_MAGIC          0x43433235      // "CC25"
+#define SHM_RING_VERSION        1
+
+#define SHM_EVENT_SLOTS         1024            // Powers of two.
+#define SHM_REQUEST_SLOTS       64
+#define SHM_MAX_CLIENTS         16
+
+/**
+ * One event published by the daemon: the raw packet, and its header already decoded.
+ * seq is the event's sequence number plus one once it's fully written, and 0 while it's being overwritten.
+ */
+struct ShmEventSlot
+{
+    volatile uint64_t       seq;
+    uint16_t                length;
+    uint16_t                event;          // GAP event (0x06xx), or 0 for other packets.
+    uint8_t                 type, event_code, status;
+    uint8_t                 data[FRAME_BUFFER_SIZE];
+} __attribute__((aligned(64)));
+
+/**
+ * A raw HCI command sent by a client, in a bounded multi-producer queue: seq says whose turn the slot is.
+ */
+struct ShmRequestSlot
+{
+    volatile uint64_t       seq;
+    uint32_t                client;
+    uint32_t                request_id;
+    uint16_t                length;
+    uint8_t                 data[HCI_MAX_PACKET_LENGTH];
+} __attribute__((aligned(64)));
+
+struct ShmClientSlot
+{
+    volatile uint32_t       in_use;
+    volatile int32_t        pid;
+    volatile uint64_t       read_seq;       // Where this client's cursor is, so the daemon can tell who lags.
+    volatile uint64_t       lost;           // Events overwritten before this client read them.
+} __attribute__((aligned(64)));
+
+/**
+ * Everything in the shared memory object. Only the daemon writes events; any client may queue requests.
+ */
+struct ShmRegion
+{
+    volatile uint32_t       magic;
+    uint32_t                version;
+    volatile int32_t        daemon_pid;
+
+    volatile uint64_t       write_seq       __attribute__((aligned(64)));
+    volatile uint64_t       request_enqueue __attribute__((aligned(64)));
+    volatile uint64_t       request_dequeue __attribute__((aligned(64)));
+
+    ShmClientSlot           clients[SHM_MAX_CLIENTS];
+    ShmRequestSlot          requests[SHM_REQUEST_SLOTS];
+    ShmEventSlot            events[SHM_EVENT_SLOTS];
+};
+
+/**
+ * Daemon side of the shared memory: creates the object, publishes events and takes requests. Used by ShmDaemon.
+ */
+class ShmPublisher
+{
+private:
+    std::string     _name;
+    ShmRegion*      _region;
+
+    ShmPublisher(const ShmPublisher&);
+    ShmPublisher& operator = (const ShmPublisher&);
+
+public:
+    ShmPublisher();
+    ~ShmPublisher();
+
+    /**
+     * Returns false if another daemon that's still running serves under that name. A leftover from one that died is replaced.
+     */
+    bool            create(const std::string& name);
+    void            destroy();
+
+    /**
+     * Writes an event over the oldest one. Never waits for clients: a client too far behind loses events, and is told so.
+     */
+    void            publish(const unsigned char* data, size_t length);
+
+    /**
+     * Takes the next queued request, if any. length gets the size of the command copied into data.
+     */
+    bool            takeRequest(unsigned char* data, size_t* length, uint32_t* client, uint32_t* requestId);
+
+    /**
+     * Frees the client slots of processes that died without closing.
+     */
+    size_t          reapClients();
+    size_t          getClientCount() const;
+};
+
+/**
+ * Client side: attaches to a running daemon, reads the event stream from its own cursor and queues commands.
+ * Reading is plain memory access, without any system call. Each client starts from the newest event.
+ */
+class ShmClient
+{
+private:
+    ShmRegion*      _region;
+    uint32_t        _slot;
+    uint64_t        _cursor;
+    uint32_t        _next_request_id;
+
+    bool            locate(const ShmEventSlot** slot);
+
+    ShmClient(const ShmClient&);
+    ShmClient& operator = (const ShmClient&);
+
+public:
+    ShmClient();
+    ~ShmClient();
+
+    /**
+     * Returns false if there's no daemon serving under that name, or it has no free client slot.
+     */
+    bool            open(const std::string& name = SHM_DEFAULT_NAME);
+    void            close();
+
+    /**
+     * Zero-copy reading: peek() points straight at the next event in shared memory (NULL if there's none yet), and
+     * consume() moves past it, returning false if the daemon overwrote it meanwhile, in which case what was read must be
+     * thrown away.
+     */
+    const ShmEventSlot*     peek();
+    bool                    consume();
+
+    /**
+     * Copying reading: the next event into buffer (FRAME_BUFFER_SIZE bytes). Returns its length, or 0 if there's none yet.
+     */
+    size_t          read(unsigned char* buffer, uint16_t* event = NULL);
+
+    /**
+     * Queues a raw HCI command (type byte included) for the daemon to send. Returns the request id, or 0 if the queue is
+     * full. Answers come through the event stream, like any other event.
+     */
+    uint32_t        submit(const unsigned char* command, size_t length);
+
+    /**
+     * Events this client missed because it read too slowly.
+     */
+    uint64_t        getLostCount() const;
+};
+
+#endif // SHMRING_H
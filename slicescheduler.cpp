@@ -0,0 +1,445 @@
+#include "slicescheduler.h"
+
+#include <iostream>
+#include <cstring>
+
+#define SLICE_IDLE_WAIT_MS      100
+#define SLICE_ADAPT_MIN         0.25
+#define SLICE_ADAPT_MAX         4.0
+
+static double elapsedMilliseconds(const timespec& from, const timespec& to)
+{
+    return (to.tv_sec - from.tv_sec) * 1000.0 + (to.tv_nsec - from.tv_nsec) / 1000000.0;
+}
+
+void* __sliceThreadEntry(void* castedScheduler)
+{
+    static_cast<SliceScheduler*>(castedScheduler)->threadMethod();
+    return NULL;
+}
+
+SliceScheduler::SliceScheduler(CC2540Communicator* communicator, const SliceSchedulerConfig& config) :
+    _communicator       (communicator),
+    _config             (config),
+    _active             (config),
+    _worker             (NULL),
+    _next_link          (0),
+    _running            (false)
+{
+    _mutex  = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+    _cond   = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+
+    memset(&_stats, 0, sizeof(_stats));
+    for(int i = 0; i < SLICE_KIND_COUNT; i++)
+    {
+        _used_ms[i]     = 0;
+        _virtual_ms[i]  = 0;
+        _adapt[i]       = 1.0;
+    }
+}
+
+SliceScheduler::~SliceScheduler()
+{
+    stop();
+}
+
+bool SliceScheduler::start()
+{
+    if(_running)
+        return false;
+
+    memset(&_stats, 0, sizeof(_stats));
+    _advertisers.clear();
+    clock_gettime(CLOCK_MONOTONIC, &_started);
+    for(int i = 0; i < SLICE_KIND_COUNT; i++)
+    {
+        _used_ms[i]     = 0;
+        _virtual_ms[i]  = 0;
+        _adapt[i]       = 1.0;
+        _last_run[i]    = _started;
+    }
+
+    _running = true;
+    pthread_create(&_thread, NULL, __sliceThreadEntry, this);
+    return true;
+}
+
+bool SliceScheduler::stop()
+{
+    pthread_mutex_lock(&_mutex);
+    if(!_running)
+    {
+        pthread_mutex_unlock(&_mutex);
+        return false;
+    }
+    _running = false;
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+
+    pthread_join(_thread, NULL);
+    return true;
+}
+
+void SliceScheduler::setConfig(const SliceSchedulerConfig& config)
+{
+    pthread_mutex_lock(&_mutex);
+    _config = config;
+    pthread_mutex_unlock(&_mutex);
+}
+
+void SliceScheduler::setLinkWorker(LinkWorker* worker)
+{
+    pthread_mutex_lock(&_mutex);
+    _worker = worker;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void SliceScheduler::requestConnect(const MacAddress& address)
+{
+    ConnectRequest request;
+    request.address     = address;
+    request.attempts    = 0;
+
+    pthread_mutex_lock(&_mutex);
+    _connects.push_back(request);
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+SliceSchedulerStats SliceScheduler::getStats()
+{
+    SliceSchedulerStats retval;
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&_mutex);
+    retval = _stats;
+    double elapsed = elapsedMilliseconds(_started, now);
+    for(int i = 0; i < SLICE_KIND_COUNT; i++)
+    {
+        retval.duty_cycle[i]        = (elapsed > 0) ? _used_ms[i] / elapsed : 0;
+        retval.effective_weight[i]  = effectiveWeight(static_cast<SliceKind>(i));
+    }
+    retval.connects_pending = _connects.size();
+    retval.elapsed_seconds  = elapsed / 1000.0;
+    pthread_mutex_unlock(&_mutex);
+
+    return retval;
+}
+
+double SliceScheduler::effectiveWeight(SliceKind kind) const
+{
+    return _active.adaptive ? _active.weights[kind] * _adapt[kind] : _active.weights[kind];
+}
+
+void SliceScheduler::adapt(SliceKind kind, double factor)
+{
+    pthread_mutex_lock(&_mutex);
+    _adapt[kind] *= factor;
+    if(_adapt[kind] < SLICE_ADAPT_MIN)
+        _adapt[kind] = SLICE_ADAPT_MIN;
+    if(_adapt[kind] > SLICE_ADAPT_MAX)
+        _adapt[kind] = SLICE_ADAPT_MAX;
+    pthread_mutex_unlock(&_mutex);
+}
+
+/**
+ * With the mutex held. Scanning always has something to do, unless it was weighted out with no deadline to bring it back.
+ */
+bool SliceScheduler::hasWork(SliceKind kind)
+{
+    switch(kind)
+    {
+        case Slice_Scan:
+            return _active.weights[Slice_Scan] > 0 || _active.deadline_ms[Slice_Scan] > 0;
+        case Slice_Connect:
+            return !_connects.empty();
+        case Slice_Link:
+            return _worker != NULL && !_communicator->getLinks().empty();
+        default:
+            return false;
+    }
+}
+
+/**
+ * With the mutex held. Returns SLICE_KIND_COUNT if nothing has work.
+ */
+SliceKind SliceScheduler::pickSlice(const timespec& now, bool* deadline)
+{
+    bool    work[SLICE_KIND_COUNT];
+    double  minvirtual = -1;
+    int     picked = SLICE_KIND_COUNT;
+    double  mostoverdue = 1.0;
+
+    for(int i = 0; i < SLICE_KIND_COUNT; i++)
+    {
+        work[i] = hasWork(static_cast<SliceKind>(i));
+        if(work[i] && (minvirtual < 0 || _virtual_ms[i] < minvirtual))
+            minvirtual = _virtual_ms[i];
+    }
+
+    // Idle kinds don't save up time: when work comes, they start level with the others instead of taking over.
+    for(int i = 0; i < SLICE_KIND_COUNT; i++)
+    {
+        if(!work[i] && minvirtual >= 0 && _virtual_ms[i] < minvirtual)
+            _virtual_ms[i] = minvirtual;
+    }
+
+    // Past its deadline, the most overdue kind (relative to its deadline) goes first.
+    for(int i = 0; i < SLICE_KIND_COUNT; i++)
+    {
+        if(!work[i] || _active.deadline_ms[i] == 0)
+            continue;
+
+        double overdue = elapsedMilliseconds(_last_run[i], now) / _active.deadline_ms[i];
+        if(overdue > mostoverdue)
+        {
+            mostoverdue = overdue;
+            picked      = i;
+        }
+    }
+
+    *deadline = (picked != SLICE_KIND_COUNT);
+    if(*deadline)
+        return static_cast<SliceKind>(picked);
+
+    for(int i = 0; i < SLICE_KIND_COUNT; i++)
+    {
+        if(work[i] && effectiveWeight(static_cast<SliceKind>(i)) > 0 && (picked == SLICE_KIND_COUNT || _virtual_ms[i] < _virtual_ms[picked]))
+            picked = i;
+    }
+    return static_cast<SliceKind>(picked);
+}
+
+/**
+ * Scan and connect slices are discoveries: their length is the discovery duration. It's sent before every one, since a
+ * restored session or a scan profile applied meanwhile sets it too.
+ */
+bool SliceScheduler::setScanDuration(unsigned int ms)
+{
+    if(ms > 0xFFFF)
+        ms = 0xFFFF;
+
+    std::vector<GapParamSetting> settings;
+    settings.push_back(GapParamSetting(TGAP_GEN_DISC_SCAN, ms));
+    settings.push_back(GapParamSetting(TGAP_LIM_DISC_SCAN, ms));
+    return _communicator->txSetParams(settings) == Tx_Success;
+}
+
+bool SliceScheduler::runScan()
+{
+    if(!setScanDuration(_active.slice_ms[Slice_Scan]))
+        return false;
+
+    std::vector<MacAddress> devices = _communicator->txDeviceDiscovery();
+
+    size_t fresh = 0;
+    for(size_t i = 0; i < devices.size(); i++)
+    {
+        if(_advertisers.insert(devices[i].key()).second)
+            fresh++;
+    }
+
+    pthread_mutex_lock(&_mutex);
+    double rate = fresh * 1000.0 / _active.slice_ms[Slice_Scan];
+    _stats.advertisers_seen             = _advertisers.size();
+    _stats.advertisers_per_scan_second  = (_stats.slices[Slice_Scan] == 0) ? rate : 0.7 * _stats.advertisers_per_scan_second + 0.3 * rate;
+    pthread_mutex_unlock(&_mutex);
+
+    // Mostly new advertisers: there's more out there, scan more. Only known ones: the links can have the time.
+    if(!devices.empty() && fresh * 2 > devices.size())
+        adapt(Slice_Scan, 1.25);
+    else if(fresh * 10 < devices.size() || devices.empty())
+        adapt(Slice_Scan, 0.8);
+
+    return true;
+}
+
+bool SliceScheduler::runConnect()
+{
+    ConnectRequest request;
+
+    pthread_mutex_lock(&_mutex);
+    if(_connects.empty())
+    {
+        pthread_mutex_unlock(&_mutex);
+        return true;
+    }
+    request = _connects.front();
+    _connects.pop_front();
+    pthread_mutex_unlock(&_mutex);
+
+    // The request is out of the queue: an error from the dongle is one failed attempt, so it's queued again or given up.
+    LinkInfo    link;
+    bool        succeeded = true;
+    link.link_set = false;
+    try
+    {
+        if(setScanDuration(_active.slice_ms[Slice_Connect]))
+            link = _communicator->txAutoConnect(std::vector<MacAddress>(1, request.address));
+        else
+            succeeded = false;
+    }
+    catch(std::string error)
+    {
+        succeeded = false;
+    }
+
+    // Whatever else advertised meanwhile counts for the scan coverage too.
+    std::vector<MacAddress> devices = _communicator->getDiscoveredDevices();
+    for(size_t i = 0; i < devices.size(); i++)
+        _advertisers.insert(devices[i].key());
+
+    pthread_mutex_lock(&_mutex);
+    _stats.advertisers_seen = _advertisers.size();
+    if(link.link_set)
+    {
+        _stats.connects_done++;
+    }
+    else if(++request.attempts >= _active.max_connect_attempts)
+    {
+        _stats.connects_given_up++;
+        #ifdef CC2540_DEBUGMODE
+        std::cout << "SliceScheduler: gave up connecting to " << request.address.toString() << std::endl;
+        #endif
+    }
+    else
+    {
+        _connects.push_back(request);
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    return succeeded;
+}
+
+bool SliceScheduler::runLink()
+{
+    pthread_mutex_lock(&_mutex);
+    LinkWorker* worker = _worker;
+    pthread_mutex_unlock(&_mutex);
+
+    std::vector<LinkInfo> links = _communicator->getLinks();
+    if(links.empty() || worker == NULL)
+        return true;
+
+    const LinkInfo& link = links[_next_link++ % links.size()];
+    unsigned int budget = _active.slice_ms[Slice_Link];
+
+    timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    bool more = worker->service(_communicator, link, budget);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Links wanting more than their slices get more of them, and links done early give time back.
+    if(more)
+        adapt(Slice_Link, 1.25);
+    else if(elapsedMilliseconds(begin, end) < budget / 2.0)
+        adapt(Slice_Link, 0.8);
+
+    return true;
+}
+
+/**
+ * Main loop for the scheduler thread: one slice per turn. When nothing has work, it waits for a connect request or a
+ * worker, and looks again every SLICE_IDLE_WAIT_MS for new links.
+ */
+void SliceScheduler::threadMethod()
+{
+    // The discovery durations the slices overwrite (from a scan profile, say) are put back when stopping.
+    std::vector<GapParamSetting> saved;
+    saved.push_back(GapParamSetting(TGAP_GEN_DISC_SCAN));
+    saved.push_back(GapParamSetting(TGAP_LIM_DISC_SCAN));
+
+    bool havesaved;
+    try
+    {
+        havesaved = (_communicator->txGetParams(&saved) == Tx_Success);
+    }
+    catch(std::string error)
+    {
+        havesaved = false;
+    }
+
+    for(;;)
+    {
+        timespec now;
+        bool deadline;
+
+        pthread_mutex_lock(&_mutex);
+        if(!_running)
+        {
+            pthread_mutex_unlock(&_mutex);
+            break;
+        }
+
+        _active = _config;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        SliceKind kind = pickSlice(now, &deadline);
+
+        if(kind == SLICE_KIND_COUNT)
+        {
+            timespec wakeup;
+            clock_gettime(CLOCK_REALTIME, &wakeup);
+            wakeup.tv_nsec += SLICE_IDLE_WAIT_MS * 1000000L;
+            if(wakeup.tv_nsec >= 1000000000L)
+            {
+                wakeup.tv_sec++;
+                wakeup.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&_cond, &_mutex, &wakeup);
+            pthread_mutex_unlock(&_mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&_mutex);
+
+        bool succeeded;
+        try
+        {
+            switch(kind)
+            {
+                case Slice_Scan:        succeeded = runScan();      break;
+                case Slice_Connect:     succeeded = runConnect();   break;
+                default:                succeeded = runLink();      break;
+            }
+        }
+        catch(std::string error)
+        {
+            /// Nobody would catch it in this thread. The slice counts as failed, and the next one goes on.
+            succeeded = false;
+        }
+
+        timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double used = elapsedMilliseconds(now, end);
+
+        pthread_mutex_lock(&_mutex);
+        double weight = effectiveWeight(kind);
+        _used_ms[kind]     += used;
+        _virtual_ms[kind]  += used / (weight > 0 ? weight : 0.001);
+        _last_run[kind]     = end;
+        _stats.slices[kind]++;
+        if(deadline)
+            _stats.deadline_slices++;
+        if(!succeeded)
+            _stats.failed_slices++;
+        pthread_mutex_unlock(&_mutex);
+    }
+
+    if(havesaved)
+    {
+        try
+        {
+            _communicator->txSetParams(saved);
+        }
+        catch(std::string error)
+        {
+            /// Nobody would catch it in this thread. The durations stay as the last slice left them.
+        }
+    }
+
+    #ifdef CC2540_DEBUGMODE
+    std::cout << "Slice scheduler stopped after " << _stats.slices[Slice_Scan] << " scan, " << _stats.slices[Slice_Connect] << " connect and "
+              << _stats.slices[Slice_Link] << " link slices." << std::endl;
+    #endif
+}
@@ -0,0 +1,159 @@
+#ifndef SLICESCHEDULER_H
+#define SLICESCHEDULER_H
+
+#include "cc2540communicator.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <deque>
+#include <set>
+
+/**
+ * The three kinds of work a SliceScheduler shares the dongle between.
+ */
+enum SliceKind
+{
+    Slice_Scan          = 0,
+    Slice_Connect,
+    Slice_Link,
+
+    SLICE_KIND_COUNT
+};
+
+/**
+ * Does the application's work on one link, during a slice given to it by SliceScheduler. Runs on the scheduler thread,
+ * which owns the communicator meanwhile, so it can use the blocking tx functions. It should come back within budgetMs,
+ * and return true if it had more to do than the slice allowed.
+ */
+class LinkWorker
+{
+public:
+    virtual ~LinkWorker() {}
+    virtual bool    service(CC2540Communicator* communicator, const LinkInfo& link, unsigned int budgetMs) = 0;
+};
+
+/**
+ * How SliceScheduler shares the time. Weights set the share of each kind of work while all of them have something to do;
+ * a kind waiting longer than its deadline goes first regardless. With adaptive set, the scan and link weights are scaled
+ * (0.25 to 4 times) by how many new advertisers the last scans found, and by whether the links used up their slices.
+ */
+struct SliceSchedulerConfig
+{
+    double          weights[SLICE_KIND_COUNT];
+    unsigned int    slice_ms[SLICE_KIND_COUNT];         // Length of one slice. Scan and connect slices are discoveries this long.
+    unsigned int    deadline_ms[SLICE_KIND_COUNT];      // Longest a kind with pending work waits. 0: no deadline.
+    bool            adaptive;
+    unsigned int    max_connect_attempts;               // Connect slices a target gets before it's given up.
+
+    SliceSchedulerConfig() :
+        adaptive                (true),
+        max_connect_attempts    (3)
+    {
+        weights[Slice_Scan]         = 1.0;
+        weights[Slice_Connect]      = 1.0;
+        weights[Slice_Link]         = 2.0;
+
+        slice_ms[Slice_Scan]        = 640;
+        slice_ms[Slice_Connect]     = 1280;
+        slice_ms[Slice_Link]        = 100;
+
+        deadline_ms[Slice_Scan]     = 10000;
+        deadline_ms[Slice_Connect]  = 0;
+        deadline_ms[Slice_Link]     = 1000;
+    }
+};
+
+/**
+ * What SliceScheduler achieved since it started. Duty cycles are each kind's share of the elapsed time.
+ */
+struct SliceSchedulerStats
+{
+    double          duty_cycle[SLICE_KIND_COUNT];
+    double          effective_weight[SLICE_KIND_COUNT];
+    unsigned long   slices[SLICE_KIND_COUNT];
+    unsigned long   deadline_slices;                    // Slices given because a deadline had passed.
+    unsigned long   failed_slices;                      // Slices ended by an error from the dongle.
+    unsigned long   advertisers_seen;                   // Distinct advertisers found by scan slices.
+    double          advertisers_per_scan_second;        // New advertisers per second of scanning, lately.
+    unsigned long   connects_done, connects_given_up;
+    size_t          connects_pending;
+    double          elapsed_seconds;
+};
+
+/**
+ * Time-slices one dongle between discovering advertisers, connecting to requested devices and serving the established
+ * links, since the controller only does one blocking operation at a time.
+ *
+ * A thread picks what runs next by weighted fair sharing: each kind accumulates the time it ran divided by its weight,
+ * and the kind with work pending and the least of it goes next, unless some kind passed its deadline. Scan slices are
+ * discoveries of slice_ms, connect slices are auto-connects to the oldest requested device (see
+ * CC2540Communicator::txAutoConnect()), and link slices go round robin over the links, to the LinkWorker. The
+ * communicator must be left to the scheduler while it runs.
+ */
+class SliceScheduler
+{
+private:
+    struct ConnectRequest
+    {
+        MacAddress      address;
+        unsigned int    attempts;
+    };
+
+    CC2540Communicator*         _communicator;
+    SliceSchedulerConfig        _config;
+    SliceSchedulerConfig        _active;            // The thread's copy, taken before every slice.
+    LinkWorker*                 _worker;
+
+    std::deque<ConnectRequest>  _connects;
+    std::set<uint64_t>          _advertisers;
+    size_t                      _next_link;
+
+    double                      _used_ms[SLICE_KIND_COUNT];
+    double                      _virtual_ms[SLICE_KIND_COUNT];
+    double                      _adapt[SLICE_KIND_COUNT];
+    timespec                    _last_run[SLICE_KIND_COUNT];
+    timespec                    _started;
+    SliceSchedulerStats         _stats;
+
+    bool                        _running;
+    pthread_t                   _thread;
+    pthread_mutex_t             _mutex;
+    pthread_cond_t              _cond;
+
+    void            threadMethod();
+    bool            hasWork(SliceKind kind);
+    SliceKind       pickSlice(const timespec& now, bool* deadline);
+    double          effectiveWeight(SliceKind kind) const;
+
+    bool            runScan();
+    bool            runConnect();
+    bool            runLink();
+    bool            setScanDuration(unsigned int ms);
+
+    void            adapt(SliceKind kind, double factor);
+
+    friend void*    __sliceThreadEntry(void* castedScheduler);
+
+public:
+    SliceScheduler(CC2540Communicator* communicator, const SliceSchedulerConfig& config = SliceSchedulerConfig());
+    ~SliceScheduler();
+
+    bool            start();
+
+    /**
+     * Waits for the slice in progress to end, puts back the discovery durations the slices changed, and stops the thread.
+     */
+    bool            stop();
+
+    void            setConfig(const SliceSchedulerConfig& config);
+    void            setLinkWorker(LinkWorker* worker);
+
+    /**
+     * Queues a device to connect to. It's looked for in the next connect slices, until it's linked or given up.
+     */
+    void            requestConnect(const MacAddress& address);
+
+    SliceSchedulerStats getStats();
+};
+
+#endif // SLICESCHEDULER_H
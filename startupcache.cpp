@@ -0,0 +1,132 @@
+#include "startupcache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+static std::string toHex(const unsigned char* data, size_t length)
+{
+    std::string retval;
+    char tempbuffer[3];
+
+    for(size_t i = 0; i < length; i++)
+    {
+        sprintf(tempbuffer, "%02x", data[i]);
+        retval.append(tempbuffer);
+    }
+    return retval;
+}
+
+static bool fromHex(const std::string& text, unsigned char* data, size_t length)
+{
+    if(text.size() != length * 2)
+        return false;
+
+    for(size_t i = 0; i < length; i++)
+    {
+        unsigned int byte;
+        if(sscanf(text.c_str() + i * 2, "%2x", &byte) != 1)
+            return false;
+        data[i] = static_cast<unsigned char>(byte);
+    }
+    return true;
+}
+
+StartupCache::StartupCache() :
+    vendor          (0),
+    product         (0),
+    bus             (0),
+    identity_valid  (false)
+{
+    memset(device_mac_reversed, 0, sizeof(device_mac_reversed));
+    memset(device_irk, 0, sizeof(device_irk));
+    memset(device_csrk, 0, sizeof(device_csrk));
+}
+
+bool StartupCache::load(const std::string& path)
+{
+    /* Format:
+    device 0451:16aa
+    location 1 4.2
+    identity 1b9cea301800 <irk> <csrk> */
+
+    std::ifstream file(path.c_str());
+    std::string line;
+    bool havedevice = false, havelocation = false;
+
+    if(!file.is_open())
+        return false;
+
+    identity_valid = false;
+    ports.clear();
+
+    while(std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        std::string key;
+        fields >> key;
+
+        if(key == "device")
+        {
+            unsigned int v, p;
+            std::string value;
+            fields >> value;
+            if(sscanf(value.c_str(), "%4x:%4x", &v, &p) != 2)
+                return false;
+            vendor      = v;
+            product     = p;
+            havedevice  = true;
+        }
+        else if(key == "location")
+        {
+            unsigned int b;
+            std::string path;
+            fields >> b >> path;
+            bus = b;
+
+            std::istringstream portlist(path);
+            std::string port;
+            while(std::getline(portlist, port, '.'))
+                ports.push_back(static_cast<uint8_t>(atoi(port.c_str())));
+            havelocation = !ports.empty();
+        }
+        else if(key == "identity")
+        {
+            std::string mac, irk, csrk;
+            fields >> mac >> irk >> csrk;
+            identity_valid = fromHex(mac, device_mac_reversed, 6) &&
+                             fromHex(irk, device_irk, 16) &&
+                             fromHex(csrk, device_csrk, 16);
+        }
+    }
+
+    return havedevice && havelocation;
+}
+
+bool StartupCache::save(const std::string& path) const
+{
+    std::ofstream file(path.c_str(), std::ios::trunc);
+    char tempbuffer[16];
+
+    if(!file.is_open())
+        return false;
+
+    sprintf(tempbuffer, "%04x:%04x", vendor, product);
+    file << "device " << tempbuffer << std::endl;
+
+    file << "location " << static_cast<unsigned int>(bus) << " ";
+    for(size_t i = 0; i < ports.size(); i++)
+        file << (i > 0 ? "." : "") << static_cast<unsigned int>(ports[i]);
+    file << std::endl;
+
+    if(identity_valid)
+    {
+        file << "identity " << toHex(device_mac_reversed, 6) << " "
+                            << toHex(device_irk, 16) << " "
+                            << toHex(device_csrk, 16) << std::endl;
+    }
+
+    return file.good();
+}
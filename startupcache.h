@@ -0,0 +1,32 @@
+#ifndef STARTUPCACHE_H
+#define STARTUPCACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * What we learnt about the dongle in the last run: where it was plugged, and who the controller said it was.
+ * Stored as a small text file, so it can be checked or deleted by hand.
+ */
+struct StartupCache
+{
+    uint16_t                vendor, product;
+    uint8_t                 bus;
+    std::vector<uint8_t>    ports;              // Port path from the root hub, as given by libusb_get_port_numbers().
+
+    bool                    identity_valid;
+    unsigned char           device_mac_reversed[6];
+    unsigned char           device_irk[16];
+    unsigned char           device_csrk[16];
+
+    StartupCache();
+
+    /**
+     * Returns false if the file doesn't exist or can't be understood. Nothing is thrown: a missing cache is not an error.
+     */
+    bool            load(const std::string& path);
+    bool            save(const std::string& path) const;
+};
+
+#endif // STARTUPCACHE_H